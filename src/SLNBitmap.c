@@ -0,0 +1,596 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include "StrongLink.h"
+#include "SLNDB.h"
+#include "SLNBitmap.h"
+#include "../deps/libressl-portable/include/compat/stdlib.h"
+
+// Container format:
+// - Arrays: up to ARRAY_MAX-1 big-endian 16-bit IDs
+// - Bitmaps: BITMAP_BYTES, little-endian
+// Arrays are always shorter than bitmaps, which is how they're told apart.
+#define CONTAINER_BITS 16
+#define LOW_MASK ((UINT64_C(1) << CONTAINER_BITS) - 1)
+#define ARRAY_MAX 4096
+#define WORDS ((1 << CONTAINER_BITS) / 64)
+#define BITMAP_BYTES (WORDS * 8)
+
+static void container_free(SLNBitmapContainer *const c) {
+	FREE(&c->array);
+	FREE(&c->bits);
+	c->high = 0;
+	c->count = 0;
+}
+void SLNBitmapClear(SLNBitmap *const bitmap) {
+	if(!bitmap) return;
+	for(size_t i = 0; i < bitmap->count; i++) {
+		container_free(&bitmap->containers[i]);
+	}
+	FREE(&bitmap->containers);
+	bitmap->count = 0;
+	bitmap->size = 0;
+}
+
+// Index of the container for high, or where it would go.
+static size_t find(SLNBitmap const *const bitmap, uint64_t const high) {
+	size_t lo = 0, hi = bitmap->count;
+	while(lo < hi) {
+		size_t const mid = lo + (hi-lo) / 2;
+		if(bitmap->containers[mid].high < high) lo = mid+1;
+		else hi = mid;
+	}
+	return lo;
+}
+static SLNBitmapContainer *get(SLNBitmap const *const bitmap, uint64_t const high) {
+	size_t const i = find(bitmap, high);
+	if(i >= bitmap->count) return NULL;
+	if(high != bitmap->containers[i].high) return NULL;
+	return &bitmap->containers[i];
+}
+static SLNBitmapContainer *insert(SLNBitmap *const bitmap, uint64_t const high) {
+	size_t const i = find(bitmap, high);
+	if(i < bitmap->count && high == bitmap->containers[i].high) {
+		return &bitmap->containers[i];
+	}
+	if(bitmap->count+1 > bitmap->size) {
+		size_t const size = MAX(8, bitmap->size*2);
+		SLNBitmapContainer *const x = reallocarray(bitmap->containers, size, sizeof(*x));
+		if(!x) return NULL;
+		bitmap->containers = x;
+		bitmap->size = size;
+	}
+	memmove(&bitmap->containers[i+1], &bitmap->containers[i], sizeof(*bitmap->containers) * (bitmap->count-i));
+	bitmap->containers[i] = (SLNBitmapContainer){ .high = high };
+	bitmap->count++;
+	return &bitmap->containers[i];
+}
+static void remove_at(SLNBitmap *const bitmap, size_t const i) {
+	container_free(&bitmap->containers[i]);
+	memmove(&bitmap->containers[i], &bitmap->containers[i+1], sizeof(*bitmap->containers) * (bitmap->count-i-1));
+	bitmap->count--;
+}
+
+static size_t array_find(uint16_t const *const array, size_t const count, uint16_t const x) {
+	size_t lo = 0, hi = count;
+	while(lo < hi) {
+		size_t const mid = lo + (hi-lo) / 2;
+		if(array[mid] < x) lo = mid+1;
+		else hi = mid;
+	}
+	return lo;
+}
+static bool container_contains(SLNBitmapContainer const *const c, uint16_t const low) {
+	if(c->bits) return c->bits[low / 64] >> (low % 64) & 1;
+	size_t const i = array_find(c->array, c->count, low);
+	return i < c->count && low == c->array[i];
+}
+static void container_recount(SLNBitmapContainer *const c) {
+	uint32_t n = 0;
+	for(size_t i = 0; i < WORDS; i++) n += __builtin_popcountll(c->bits[i]);
+	c->count = n;
+}
+static int container_to_bits(SLNBitmapContainer *const c) {
+	if(c->bits) return 0;
+	uint64_t *const bits = calloc(WORDS, sizeof(*bits));
+	if(!bits) return DB_ENOMEM;
+	for(size_t i = 0; i < c->count; i++) {
+		bits[c->array[i] / 64] |= UINT64_C(1) << (c->array[i] % 64);
+	}
+	FREE(&c->array);
+	c->bits = bits;
+	return 0;
+}
+// Switches back to an array once there are few enough IDs.
+static void container_shrink(SLNBitmapContainer *const c) {
+	if(!c->bits) return;
+	if(c->count >= ARRAY_MAX) return;
+	uint16_t *const array = malloc(sizeof(*array) * MAX(1, c->count));
+	if(!array) return; // Bits work too.
+	size_t n = 0;
+	for(size_t i = 0; i < WORDS; i++) {
+		for(uint64_t w = c->bits[i]; w; w &= w-1) {
+			array[n++] = (uint16_t)(i*64 + __builtin_ctzll(w));
+		}
+	}
+	assert(c->count == n);
+	FREE(&c->bits);
+	c->array = array;
+}
+// Returns 1 if the ID was added, or 0 if it was already there.
+static int container_add(SLNBitmapContainer *const c, uint16_t const low) {
+	if(c->bits) {
+		uint64_t const mask = UINT64_C(1) << (low % 64);
+		if(c->bits[low / 64] & mask) return 0;
+		c->bits[low / 64] |= mask;
+		c->count++;
+		return 1;
+	}
+	size_t const i = array_find(c->array, c->count, low);
+	if(i < c->count && low == c->array[i]) return 0;
+	if(c->count+1 >= ARRAY_MAX) {
+		int rc = container_to_bits(c);
+		if(rc < 0) return rc;
+		return container_add(c, low);
+	}
+	uint16_t *const array = reallocarray(c->array, c->count+1, sizeof(*array));
+	if(!array) return DB_ENOMEM;
+	memmove(&array[i+1], &array[i], sizeof(*array) * (c->count-i));
+	array[i] = low;
+	c->array = array;
+	c->count++;
+	return 1;
+}
+static int container_copy(SLNBitmapContainer *const c, SLNBitmapContainer const *const x) {
+	assert(!c->array && !c->bits);
+	if(x->bits) {
+		c->bits = malloc(BITMAP_BYTES);
+		if(!c->bits) return DB_ENOMEM;
+		memcpy(c->bits, x->bits, BITMAP_BYTES);
+	} else {
+		c->array = malloc(sizeof(*c->array) * MAX(1, x->count));
+		if(!c->array) return DB_ENOMEM;
+		memcpy(c->array, x->array, sizeof(*c->array) * x->count);
+	}
+	c->count = x->count;
+	return 0;
+}
+static int container_and(SLNBitmapContainer *const c, SLNBitmapContainer const *const x) {
+	if(c->bits && x->bits) {
+		for(size_t i = 0; i < WORDS; i++) c->bits[i] &= x->bits[i];
+		container_recount(c);
+		container_shrink(c);
+		return 0;
+	}
+	if(c->bits) {
+		// The result is a subset of x's array.
+		uint16_t *const array = malloc(sizeof(*array) * MAX(1, x->count));
+		if(!array) return DB_ENOMEM;
+		size_t n = 0;
+		for(size_t i = 0; i < x->count; i++) {
+			if(container_contains(c, x->array[i])) array[n++] = x->array[i];
+		}
+		FREE(&c->bits);
+		c->array = array;
+		c->count = n;
+		return 0;
+	}
+	size_t n = 0;
+	for(size_t i = 0; i < c->count; i++) {
+		if(container_contains(x, c->array[i])) c->array[n++] = c->array[i];
+	}
+	c->count = n;
+	return 0;
+}
+static int container_or(SLNBitmapContainer *const c, SLNBitmapContainer const *const x) {
+	if(c->bits || x->bits || c->count + x->count >= ARRAY_MAX) {
+		int rc = container_to_bits(c);
+		if(rc < 0) return rc;
+		if(x->bits) {
+			for(size_t i = 0; i < WORDS; i++) c->bits[i] |= x->bits[i];
+		} else {
+			for(size_t i = 0; i < x->count; i++) {
+				c->bits[x->array[i] / 64] |= UINT64_C(1) << (x->array[i] % 64);
+			}
+		}
+		container_recount(c);
+		container_shrink(c);
+		return 0;
+	}
+	uint16_t *const array = malloc(sizeof(*array) * MAX(1, c->count + x->count));
+	if(!array) return DB_ENOMEM;
+	size_t i = 0, j = 0, n = 0;
+	while(i < c->count && j < x->count) {
+		if(c->array[i] < x->array[j]) array[n++] = c->array[i++];
+		else if(c->array[i] > x->array[j]) array[n++] = x->array[j++];
+		else { array[n++] = c->array[i++]; j++; }
+	}
+	while(i < c->count) array[n++] = c->array[i++];
+	while(j < x->count) array[n++] = x->array[j++];
+	FREE(&c->array);
+	c->array = array;
+	c->count = n;
+	return 0;
+}
+
+int SLNBitmapAdd(SLNBitmap *const bitmap, uint64_t const id) {
+	SLNBitmapContainer *const c = insert(bitmap, id >> CONTAINER_BITS);
+	if(!c) return DB_ENOMEM;
+	int rc = container_add(c, id & LOW_MASK);
+	if(rc < 0) return rc;
+	return 0;
+}
+bool SLNBitmapContains(SLNBitmap const *const bitmap, uint64_t const id) {
+	SLNBitmapContainer const *const c = get(bitmap, id >> CONTAINER_BITS);
+	if(!c) return false;
+	return container_contains(c, id & LOW_MASK);
+}
+uint64_t SLNBitmapCardinality(SLNBitmap const *const bitmap) {
+	uint64_t n = 0;
+	for(size_t i = 0; i < bitmap->count; i++) n += bitmap->containers[i].count;
+	return n;
+}
+int SLNBitmapCopy(SLNBitmap *const dst, SLNBitmap const *const src) {
+	assert(dst != src);
+	SLNBitmapClear(dst);
+	return SLNBitmapOr(dst, src);
+}
+int SLNBitmapAnd(SLNBitmap *const dst, SLNBitmap const *const src) {
+	size_t i = 0;
+	while(i < dst->count) {
+		SLNBitmapContainer *const c = &dst->containers[i];
+		SLNBitmapContainer const *const x = get(src, c->high);
+		if(x) {
+			int rc = container_and(c, x);
+			if(rc < 0) return rc;
+		}
+		if(!x || !c->count) {
+			remove_at(dst, i);
+			continue;
+		}
+		i++;
+	}
+	return 0;
+}
+int SLNBitmapOr(SLNBitmap *const dst, SLNBitmap const *const src) {
+	for(size_t i = 0; i < src->count; i++) {
+		SLNBitmapContainer const *const x = &src->containers[i];
+		SLNBitmapContainer *c = get(dst, x->high);
+		int rc;
+		if(c) {
+			rc = container_or(c, x);
+		} else {
+			c = insert(dst, x->high);
+			if(!c) return DB_ENOMEM;
+			rc = container_copy(c, x);
+		}
+		if(rc < 0) return rc;
+	}
+	return 0;
+}
+
+static size_t container_encode(SLNBitmapContainer const *const c, byte_t *const out) {
+	if(c->bits) {
+		for(size_t i = 0; i < WORDS; i++) {
+			for(size_t j = 0; j < 8; j++) out[i*8+j] = (byte_t)(c->bits[i] >> (j*8));
+		}
+		return BITMAP_BYTES;
+	}
+	assert(c->count < ARRAY_MAX);
+	for(size_t i = 0; i < c->count; i++) {
+		out[i*2+0] = (byte_t)(c->array[i] >> 8);
+		out[i*2+1] = (byte_t)(c->array[i] >> 0);
+	}
+	return c->count * 2;
+}
+static int container_decode(DB_val const *const val, SLNBitmapContainer *const c) {
+	assert(!c->array && !c->bits);
+	byte_t const *const buf = val->data;
+	if(BITMAP_BYTES == val->size) {
+		c->bits = calloc(WORDS, sizeof(*c->bits));
+		if(!c->bits) return DB_ENOMEM;
+		for(size_t i = 0; i < WORDS; i++) {
+			for(size_t j = 0; j < 8; j++) c->bits[i] |= (uint64_t)buf[i*8+j] << (j*8);
+		}
+		container_recount(c);
+		return 0;
+	}
+	if(val->size % 2) return DB_EIO;
+	size_t const count = val->size / 2;
+	if(count >= ARRAY_MAX) return DB_EIO;
+	c->array = malloc(sizeof(*c->array) * MAX(1, count));
+	if(!c->array) return DB_ENOMEM;
+	for(size_t i = 0; i < count; i++) {
+		c->array[i] = (uint16_t)(buf[i*2+0] << 8 | buf[i*2+1]);
+	}
+	c->count = count;
+	return 0;
+}
+static int container_put(DB_txn *const txn, strarg_t const field, strarg_t const value, SLNBitmapContainer const *const c) {
+	byte_t *buf = malloc(BITMAP_BYTES);
+	if(!buf) return DB_ENOMEM;
+	DB_val key[1];
+	SLNFieldValueFileBitmapKeyPack(key, txn, field, value, c->high);
+	DB_val val[1] = {{ container_encode(c, buf), buf }};
+	int rc = db_put(txn, key, val, 0);
+	FREE(&buf);
+	return rc;
+}
+
+int SLNBitmapLoad(DB_txn *const txn, strarg_t const field, strarg_t const value, SLNBitmap *const out) {
+	SLNBitmapClear(out);
+	DB_cursor *cursor = NULL;
+	int rc = db_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+	DB_range range[1];
+	SLNFieldValueFileBitmapRange2(range, txn, field, value);
+	DB_val bitmap_key[1], bitmap_val[1];
+	rc = db_cursor_firstr(cursor, range, bitmap_key, bitmap_val, +1);
+	for(; rc >= 0; rc = db_cursor_nextr(cursor, range, bitmap_key, bitmap_val, +1)) {
+		strarg_t f, v;
+		uint64_t high;
+		SLNFieldValueFileBitmapKeyUnpack(bitmap_key, txn, &f, &v, &high);
+		SLNBitmapContainer *const c = insert(out, high);
+		if(!c) return DB_ENOMEM;
+		rc = container_decode(bitmap_val, c);
+		if(rc < 0) return rc;
+	}
+	if(DB_NOTFOUND != rc) return rc;
+	return 0;
+}
+int SLNBitmapLoadContainer(DB_txn *const txn, strarg_t const field, strarg_t const value, uint64_t const id, SLNBitmap *const out) {
+	uint64_t const high = id >> CONTAINER_BITS;
+	if(get(out, high)) return 0;
+	DB_val bitmap_key[1];
+	SLNFieldValueFileBitmapKeyPack(bitmap_key, txn, field, value, high);
+	DB_val bitmap_val[1];
+	int rc = db_get(txn, bitmap_key, bitmap_val);
+	if(rc < 0 && DB_NOTFOUND != rc) return rc;
+	// Missing containers are kept empty, so we only look once.
+	SLNBitmapContainer *const c = insert(out, high);
+	if(!c) return DB_ENOMEM;
+	if(DB_NOTFOUND == rc) return 0;
+	return container_decode(bitmap_val, c);
+}
+
+static int add_id(DB_txn *const txn, strarg_t const field, strarg_t const value, uint64_t const fileID) {
+	SLNBitmapContainer c[1] = {{ .high = fileID >> CONTAINER_BITS }};
+	DB_val bitmap_key[1];
+	SLNFieldValueFileBitmapKeyPack(bitmap_key, txn, field, value, c->high);
+	DB_val bitmap_val[1];
+	int rc = db_get(txn, bitmap_key, bitmap_val);
+	if(rc >= 0) rc = container_decode(bitmap_val, c);
+	else if(DB_NOTFOUND == rc) rc = 0;
+	if(rc >= 0) rc = container_add(c, fileID & LOW_MASK);
+	if(rc > 0) rc = container_put(txn, field, value, c);
+	container_free(c);
+	if(rc < 0) return rc;
+	return 0;
+}
+static int add_targets(DB_txn *const txn, DB_cursor *const files, uint64_t const metaFileID, SLNBitmap *const out) {
+	DB_val metaFileID_key[1];
+	SLNMetaFileByIDKeyPack(metaFileID_key, txn, metaFileID);
+	DB_val metaFile_val[1];
+	int rc = db_get(txn, metaFileID_key, metaFile_val);
+	if(rc < 0) return rc;
+	uint64_t f;
+	strarg_t targetURI;
+	SLNMetaFileByIDValUnpack(metaFile_val, txn, &f, &targetURI);
+
+	DB_range fileIDs[1];
+	SLNURIAndFileIDRange1(fileIDs, txn, targetURI);
+	DB_val fileID_key[1];
+	rc = db_cursor_firstr(files, fileIDs, fileID_key, NULL, +1);
+	for(; rc >= 0; rc = db_cursor_nextr(files, fileIDs, fileID_key, NULL, +1)) {
+		strarg_t u;
+		uint64_t fileID;
+		SLNURIAndFileIDKeyUnpack(fileID_key, txn, &u, &fileID);
+		rc = SLNBitmapAdd(out, fileID);
+		if(rc < 0) return rc;
+	}
+	if(DB_NOTFOUND != rc) return rc;
+	return 0;
+}
+
+int SLNBitmapBuild(DB_txn *const txn, strarg_t const field, strarg_t const value) {
+	SLNBitmap files[1] = {};
+	DB_cursor *metafiles = NULL;
+	DB_cursor *URIs = NULL;
+	int rc = db_cursor_open(txn, &metafiles);
+	if(rc < 0) goto cleanup;
+	rc = db_cursor_open(txn, &URIs);
+	if(rc < 0) goto cleanup;
+
+	DB_range range[1];
+	SLNFieldValueAndMetaFileIDRange2(range, txn, field, value);
+	DB_val metadata_key[1];
+	rc = db_cursor_firstr(metafiles, range, metadata_key, NULL, +1);
+	for(; rc >= 0; rc = db_cursor_nextr(metafiles, range, metadata_key, NULL, +1)) {
+		strarg_t f, v;
+		uint64_t metaFileID;
+		SLNFieldValueAndMetaFileIDKeyUnpack(metadata_key, txn, &f, &v, &metaFileID);
+		rc = add_targets(txn, URIs, metaFileID, files);
+		if(rc < 0) goto cleanup;
+	}
+	if(DB_NOTFOUND != rc) goto cleanup;
+
+	for(size_t i = 0; i < files->count; i++) {
+		rc = container_put(txn, field, value, &files->containers[i]);
+		if(rc < 0) goto cleanup;
+	}
+	rc = 0;
+cleanup:
+	db_cursor_close(URIs); URIs = NULL;
+	db_cursor_close(metafiles); metafiles = NULL;
+	SLNBitmapClear(files);
+	return rc;
+}
+int SLNBitmapAddTarget(DB_txn *const txn, strarg_t const field, strarg_t const value, strarg_t const targetURI) {
+	DB_cursor *files = NULL;
+	int rc = db_cursor_open(txn, &files);
+	if(rc < 0) return rc;
+	DB_range fileIDs[1];
+	SLNURIAndFileIDRange1(fileIDs, txn, targetURI);
+	DB_val fileID_key[1];
+	rc = db_cursor_firstr(files, fileIDs, fileID_key, NULL, +1);
+	for(; rc >= 0; rc = db_cursor_nextr(files, fileIDs, fileID_key, NULL, +1)) {
+		strarg_t u;
+		uint64_t fileID;
+		SLNURIAndFileIDKeyUnpack(fileID_key, txn, &u, &fileID);
+		rc = add_id(txn, field, value, fileID);
+		if(rc < 0) break;
+	}
+	db_cursor_close(files); files = NULL;
+	if(DB_NOTFOUND != rc) return rc;
+	return 0;
+}
+
+static int add_if_indexed(DB_txn *const txn, strarg_t const field, strarg_t const value, uint64_t const fileID) {
+	DB_val count_key[1];
+	SLNFieldValueMetaFileCountKeyPack(count_key, txn, field, value);
+	DB_val count_val[1];
+	int rc = db_get(txn, count_key, count_val);
+	if(DB_NOTFOUND == rc) return 0;
+	if(rc < 0) return rc;
+	uint64_t count;
+	bool indexed;
+	SLNFieldValueMetaFileCountValUnpack(count_val, txn, &count, &indexed);
+	if(!indexed) return 0;
+	return add_id(txn, field, value, fileID);
+}
+int SLNBitmapAddFile(DB_txn *const txn, uint64_t const fileID, strarg_t const URI) {
+	DB_cursor *metafiles = NULL;
+	DB_cursor *pairs = NULL;
+	int rc = db_cursor_open(txn, &metafiles);
+	if(rc < 0) goto cleanup;
+	rc = db_cursor_open(txn, &pairs);
+	if(rc < 0) goto cleanup;
+
+	DB_range range[1];
+	SLNTargetURIAndMetaFileIDRange1(range, txn, URI);
+	DB_val metaFileID_key[1];
+	rc = db_cursor_firstr(metafiles, range, metaFileID_key, NULL, +1);
+	for(; rc >= 0; rc = db_cursor_nextr(metafiles, range, metaFileID_key, NULL, +1)) {
+		strarg_t u;
+		uint64_t metaFileID;
+		SLNTargetURIAndMetaFileIDKeyUnpack(metaFileID_key, txn, &u, &metaFileID);
+
+		DB_range fields[1];
+		SLNMetaFileIDFieldAndValueRange1(fields, txn, metaFileID);
+		DB_val field_key[1];
+		rc = db_cursor_firstr(pairs, fields, field_key, NULL, +1);
+		for(; rc >= 0; rc = db_cursor_nextr(pairs, fields, field_key, NULL, +1)) {
+			uint64_t m;
+			strarg_t f, v;
+			SLNMetaFileIDFieldAndValueKeyUnpack(field_key, txn, &m, &f, &v);
+			// Writing can move the cursor's data out from under us.
+			str_t *field = strdup(f);
+			str_t *value = strdup(v);
+			if(field && value) rc = add_if_indexed(txn, field, value, fileID);
+			else rc = DB_ENOMEM;
+			FREE(&field);
+			FREE(&value);
+			if(rc < 0) goto cleanup;
+		}
+		if(DB_NOTFOUND != rc) goto cleanup;
+	}
+	if(DB_NOTFOUND != rc) goto cleanup;
+	rc = 0;
+cleanup:
+	db_cursor_close(pairs); pairs = NULL;
+	db_cursor_close(metafiles); metafiles = NULL;
+	return rc;
+}
+
+// Keeps the bitmap flag, if there's already a count.
+static int count_put(DB_txn *const txn, strarg_t const field, strarg_t const value, uint64_t const count) {
+	DB_val count_key[1];
+	SLNFieldValueMetaFileCountKeyPack(count_key, txn, field, value);
+	DB_val count_val[1];
+	uint64_t old = 0;
+	bool indexed = false;
+	int rc = db_get(txn, count_key, count_val);
+	if(rc >= 0) SLNFieldValueMetaFileCountValUnpack(count_val, txn, &old, &indexed);
+	else if(DB_NOTFOUND != rc) return rc;
+	DB_val new_key[1];
+	SLNFieldValueMetaFileCountKeyPack(new_key, txn, field, value);
+	DB_val new_val[1];
+	SLNFieldValueMetaFileCountValPack(new_val, txn, count, indexed);
+	return db_put(txn, new_key, new_val, 0);
+}
+int SLNBitmapMigrateCounts(DB_txn *const txn, SLNBitmapCountsMigration *const state, size_t const max) {
+	if(!txn) return DB_EINVAL;
+	if(!state) return DB_EINVAL;
+	if(state->done) return 0;
+	DB_cursor *cursor = NULL;
+	int rc = db_cursor_open(txn, &cursor);
+	if(rc < 0) return rc;
+
+	DB_range all[1];
+	SLNFieldValueAndMetaFileIDRange0(all, txn);
+	DB_val row_key[1];
+	if(state->field) {
+		DB_val next[1];
+		SLNFieldValueAndMetaFileIDKeyPack(next, txn, state->field, state->value, state->metaFileID+1);
+		*row_key = *next;
+		rc = db_cursor_seekr(cursor, all, row_key, NULL, +1);
+	} else {
+		rc = db_cursor_firstr(cursor, all, row_key, NULL, +1);
+	}
+	for(size_t i = 0; rc >= 0 && i < max; i++) {
+		strarg_t field, value;
+		uint64_t metaFileID;
+		SLNFieldValueAndMetaFileIDKeyUnpack(row_key, txn, &field, &value, &metaFileID);
+		if(!state->field || 0 != strcmp(field, state->field) || 0 != strcmp(value, state->value)) {
+			// Writing can invalidate memory returned by the cursor.
+			str_t *f = strdup(field);
+			str_t *v = strdup(value);
+			if(!f || !v) rc = DB_ENOMEM;
+			if(rc >= 0 && state->field) {
+				rc = count_put(txn, state->field, state->value, state->count);
+				if(rc >= 0) state->seeded++;
+			}
+			if(rc < 0) {
+				FREE(&f);
+				FREE(&v);
+				break;
+			}
+			FREE(&state->field);
+			FREE(&state->value);
+			state->field = f; f = NULL;
+			state->value = v; v = NULL;
+			state->count = 0;
+		}
+		state->metaFileID = metaFileID;
+		state->count++;
+		rc = db_cursor_nextr(cursor, all, row_key, NULL, +1);
+	}
+	if(DB_NOTFOUND == rc) {
+		rc = 0;
+		if(state->field) {
+			rc = count_put(txn, state->field, state->value, state->count);
+			if(rc >= 0) state->seeded++;
+		}
+		if(rc >= 0) rc = SLNMigrationDonePut(txn, SLNMigrationMetaFileCounts);
+		if(rc >= 0) state->done = true;
+	}
+
+	db_cursor_close(cursor); cursor = NULL;
+	return rc;
+}
+int SLNBitmapCountsMigrationPending(DB_txn *const txn) {
+	if(!txn) return DB_EINVAL;
+	int rc = SLNMigrationDoneGet(txn, SLNMigrationMetaFileCounts);
+	if(0 != rc) return rc < 0 ? rc : 0;
+	DB_cursor *cursor = NULL;
+	rc = db_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+	DB_range all[1];
+	SLNFieldValueAndMetaFileIDRange0(all, txn);
+	rc = db_cursor_firstr(cursor, all, NULL, NULL, +1);
+	// With no values yet, every one added from now on gets a count.
+	if(DB_NOTFOUND == rc) return SLNMigrationDonePut(txn, SLNMigrationMetaFileCounts);
+	if(rc < 0) return rc;
+	return 1;
+}
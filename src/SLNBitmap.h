@@ -0,0 +1,66 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#ifndef SLNBITMAP_H
+#define SLNBITMAP_H
+
+#include "db/db_base.h"
+#include "common.h"
+
+// Compressed sets of file IDs, split into containers of 2^16 IDs like
+// Roaring bitmaps. Sparse containers are sorted arrays of the low bits and
+// dense ones are plain bitmaps.
+typedef struct {
+	uint64_t high;
+	uint32_t count;
+	uint16_t *array; // Sorted, used if bits is NULL.
+	uint64_t *bits;
+} SLNBitmapContainer;
+typedef struct {
+	SLNBitmapContainer *containers; // Sorted by high.
+	size_t count;
+	size_t size;
+} SLNBitmap;
+
+void SLNBitmapClear(SLNBitmap *const bitmap);
+int SLNBitmapAdd(SLNBitmap *const bitmap, uint64_t const id);
+bool SLNBitmapContains(SLNBitmap const *const bitmap, uint64_t const id);
+uint64_t SLNBitmapCardinality(SLNBitmap const *const bitmap);
+int SLNBitmapCopy(SLNBitmap *const dst, SLNBitmap const *const src);
+int SLNBitmapAnd(SLNBitmap *const dst, SLNBitmap const *const src);
+int SLNBitmapOr(SLNBitmap *const dst, SLNBitmap const *const src);
+
+// Metadata values with at least this many meta-files keep the set of files
+// they apply to, one row per container (SLNFieldValueFileBitmap). The flag
+// on SLNFieldValueMetaFileCount says whether a value has one.
+#define SLN_BITMAP_MIN 1024
+
+// Loading replaces the whole set. Loading a container only reads the one
+// holding id, and does nothing if it's already loaded.
+int SLNBitmapLoad(DB_txn *const txn, strarg_t const field, strarg_t const value, SLNBitmap *const out);
+int SLNBitmapLoadContainer(DB_txn *const txn, strarg_t const field, strarg_t const value, uint64_t const id, SLNBitmap *const out);
+
+// Build writes the set from scratch, once a value becomes common enough.
+// After that, new meta-files add their target's files, and new files add
+// themselves to every indexed value of the meta-files targeting them.
+int SLNBitmapBuild(DB_txn *const txn, strarg_t const field, strarg_t const value);
+int SLNBitmapAddTarget(DB_txn *const txn, strarg_t const field, strarg_t const value, strarg_t const targetURI);
+int SLNBitmapAddFile(DB_txn *const txn, uint64_t const fileID, strarg_t const URI);
+
+// Seeding SLNFieldValueMetaFileCount for values indexed before it existed
+// is a one-time migration, done in batches of at most max rows. Start with
+// a zeroed state, call until done, and free field and value afterward.
+typedef struct {
+	str_t *field; // Value being counted, or NULL before the first.
+	str_t *value;
+	uint64_t metaFileID; // Last row counted.
+	uint64_t count;
+	size_t seeded; // Values whose counts were written.
+	bool done;
+} SLNBitmapCountsMigration;
+int SLNBitmapMigrateCounts(DB_txn *const txn, SLNBitmapCountsMigration *const state, size_t const max);
+// Returns 1 if there are values from before the migration was run.
+// Marks databases without any values as done, so it needs a writable txn.
+int SLNBitmapCountsMigrationPending(DB_txn *const txn);
+
+#endif
@@ -27,11 +27,24 @@ enum {
 	SLNFieldValueAndMetaFileID = 64,
 	SLNTermMetaFileIDAndPosition = 65,
 	SLNFirstUniqueMetaFileID = 66,
+	SLNTermPostingBlock = 67, // Replaces SLNTermMetaFileIDAndPosition.
+	SLNTermMetaFileIDPositions = 68,
+	SLNTermMetaFileCount = 69,
+	SLNFieldValueMetaFileCount = 70,
+	SLNFieldValueFileBitmap = 71,
+
+	SLNMigrationDone = 80, // One-time data migrations that have finished.
 
 	// It's expected that values less than ~240 should fit in one byte
 	// Depending on the varint format, of course
 };
 
+enum {
+	// Also part of the persistent format.
+	SLNMigrationPostingBlocks = 1,
+	SLNMigrationMetaFileCounts = 2,
+};
+
 
 // TODO: Don't use simple assertions for data integrity checks.
 // TODO: Accept NULL out parameters in unpack functions.
@@ -256,6 +269,12 @@ static void SLNTargetURIAndMetaFileIDKeyUnpack(DB_val *const val, DB_txn *const
 	db_bind_string((range)->min, (field), (txn)); \
 	db_range_genmax((range)); \
 	DB_RANGE_STORAGE_VERIFY(range);
+#define SLNMetaFileIDFieldAndValueRange1(range, txn, metaFileID) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX * 2); \
+	db_bind_uint64((range)->min, SLNMetaFileIDFieldAndValue); \
+	db_bind_uint64((range)->min, (metaFileID)); \
+	db_range_genmax((range)); \
+	DB_RANGE_STORAGE_VERIFY(range);
 static void SLNMetaFileIDFieldAndValueKeyUnpack(DB_val *const val, DB_txn *const txn, uint64_t *const metaFileID, strarg_t *const field, strarg_t *const value) {
 	uint64_t const table = db_read_uint64(val);
 	assert(SLNMetaFileIDFieldAndValue == table);
@@ -278,6 +297,11 @@ static void SLNMetaFileIDFieldAndValueKeyUnpack(DB_val *const val, DB_txn *const
 	db_bind_string((range)->min, (value), (txn)); \
 	db_range_genmax((range)); \
 	DB_RANGE_STORAGE_VERIFY(range);
+#define SLNFieldValueAndMetaFileIDRange0(range, txn) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX); \
+	db_bind_uint64((range)->min, SLNFieldValueAndMetaFileID); \
+	db_range_genmax((range)); \
+	DB_RANGE_STORAGE_VERIFY(range);
 static void SLNFieldValueAndMetaFileIDKeyUnpack(DB_val *const val, DB_txn *const txn, strarg_t *const field, strarg_t *const value, uint64_t *const metaFileID) {
 	uint64_t const table = db_read_uint64(val);
 	assert(SLNFieldValueAndMetaFileID == table);
@@ -293,6 +317,11 @@ static void SLNFieldValueAndMetaFileIDKeyUnpack(DB_val *const val, DB_txn *const
 	db_bind_uint64((val), (metaFileID)); \
 	db_bind_uint64((val), (position)); \
 	DB_VAL_STORAGE_VERIFY(val);
+#define SLNTermMetaFileIDAndPositionRange0(range, txn) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX); \
+	db_bind_uint64((range)->min, SLNTermMetaFileIDAndPosition); \
+	db_range_genmax((range)); \
+	DB_RANGE_STORAGE_VERIFY(range);
 #define SLNTermMetaFileIDAndPositionRange1(range, txn, token) \
 	DB_RANGE_STORAGE(range, DB_VARINT_MAX + DB_INLINE_MAX); \
 	db_bind_uint64((range)->min, SLNTermMetaFileIDAndPosition); \
@@ -330,3 +359,113 @@ static void SLNFirstUniqueMetaFileIDKeyUnpack(DB_val *const val, DB_txn *const t
 	*metaFileID = db_read_uint64(val);
 }
 
+// The value is a delta-encoded block of meta-file IDs (see SLNPostings.c).
+#define SLNTermPostingBlockKeyPack(val, txn, token, firstMetaFileID) \
+	DB_VAL_STORAGE(val, DB_VARINT_MAX * 2 + DB_INLINE_MAX * 1); \
+	db_bind_uint64((val), SLNTermPostingBlock); \
+	db_bind_string((val), (token), (txn)); \
+	db_bind_uint64((val), (firstMetaFileID)); \
+	DB_VAL_STORAGE_VERIFY(val);
+#define SLNTermPostingBlockRange1(range, txn, token) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX + DB_INLINE_MAX); \
+	db_bind_uint64((range)->min, SLNTermPostingBlock); \
+	db_bind_string((range)->min, (token), (txn)); \
+	db_range_genmax((range)); \
+	DB_RANGE_STORAGE_VERIFY(range);
+static void SLNTermPostingBlockKeyUnpack(DB_val *const val, DB_txn *const txn, strarg_t *const token, uint64_t *const firstMetaFileID) {
+	uint64_t const table = db_read_uint64(val);
+	assert(SLNTermPostingBlock == table);
+	*token = db_read_string(val, txn);
+	*firstMetaFileID = db_read_uint64(val);
+}
+
+// The value is a list of varint position deltas.
+#define SLNTermMetaFileIDPositionsKeyPack(val, txn, token, metaFileID) \
+	DB_VAL_STORAGE(val, DB_VARINT_MAX * 2 + DB_INLINE_MAX * 1); \
+	db_bind_uint64((val), SLNTermMetaFileIDPositions); \
+	db_bind_string((val), (token), (txn)); \
+	db_bind_uint64((val), (metaFileID)); \
+	DB_VAL_STORAGE_VERIFY(val);
+static void SLNTermMetaFileIDPositionsKeyUnpack(DB_val *const val, DB_txn *const txn, strarg_t *const token, uint64_t *const metaFileID) {
+	uint64_t const table = db_read_uint64(val);
+	assert(SLNTermMetaFileIDPositions == table);
+	*token = db_read_string(val, txn);
+	*metaFileID = db_read_uint64(val);
+}
+
+// Statistics for the filter planner.
+#define SLNTermMetaFileCountKeyPack(val, txn, token) \
+	DB_VAL_STORAGE(val, DB_VARINT_MAX + DB_INLINE_MAX); \
+	db_bind_uint64((val), SLNTermMetaFileCount); \
+	db_bind_string((val), (token), (txn)); \
+	DB_VAL_STORAGE_VERIFY(val);
+#define SLNTermMetaFileCountValPack(val, txn, count) \
+	DB_VAL_STORAGE(val, DB_VARINT_MAX); \
+	db_bind_uint64((val), (count)); \
+	DB_VAL_STORAGE_VERIFY(val);
+static void SLNTermMetaFileCountValUnpack(DB_val *const val, DB_txn *const txn, uint64_t *const count) {
+	*count = db_read_uint64(val);
+}
+
+#define SLNFieldValueMetaFileCountKeyPack(val, txn, field, value) \
+	DB_VAL_STORAGE(val, DB_VARINT_MAX + DB_INLINE_MAX * 2); \
+	db_bind_uint64((val), SLNFieldValueMetaFileCount); \
+	db_bind_string((val), (field), (txn)); \
+	db_bind_string((val), (value), (txn)); \
+	DB_VAL_STORAGE_VERIFY(val);
+#define SLNFieldValueMetaFileCountValPack(val, txn, count, indexed) \
+	DB_VAL_STORAGE(val, DB_VARINT_MAX * 2); \
+	db_bind_uint64((val), (count)); \
+	db_bind_uint64((val), !!(indexed)); \
+	DB_VAL_STORAGE_VERIFY(val);
+static void SLNFieldValueMetaFileCountValUnpack(DB_val *const val, DB_txn *const txn, uint64_t *const count, bool *const indexed) {
+	*count = db_read_uint64(val);
+	// Whether the value has a SLNFieldValueFileBitmap. Rows written
+	// before bitmaps existed don't have the flag.
+	*indexed = val->size ? !!db_read_uint64(val) : false;
+}
+
+// One row per bitmap container (see SLNBitmap.h).
+#define SLNFieldValueFileBitmapKeyPack(val, txn, field, value, high) \
+	DB_VAL_STORAGE(val, DB_VARINT_MAX * 2 + DB_INLINE_MAX * 2); \
+	db_bind_uint64((val), SLNFieldValueFileBitmap); \
+	db_bind_string((val), (field), (txn)); \
+	db_bind_string((val), (value), (txn)); \
+	db_bind_uint64((val), (high)); \
+	DB_VAL_STORAGE_VERIFY(val);
+#define SLNFieldValueFileBitmapRange2(range, txn, field, value) \
+	DB_RANGE_STORAGE(range, DB_VARINT_MAX + DB_INLINE_MAX * 2); \
+	db_bind_uint64((range)->min, SLNFieldValueFileBitmap); \
+	db_bind_string((range)->min, (field), (txn)); \
+	db_bind_string((range)->min, (value), (txn)); \
+	db_range_genmax((range)); \
+	DB_RANGE_STORAGE_VERIFY(range);
+static void SLNFieldValueFileBitmapKeyUnpack(DB_val *const val, DB_txn *const txn, strarg_t *const field, strarg_t *const value, uint64_t *const high) {
+	uint64_t const table = db_read_uint64(val);
+	assert(SLNFieldValueFileBitmap == table);
+	*field = db_read_string(val, txn);
+	*value = db_read_string(val, txn);
+	*high = db_read_uint64(val);
+}
+
+#define SLNMigrationDoneKeyPack(val, txn, migration) \
+	DB_VAL_STORAGE(val, DB_VARINT_MAX * 2); \
+	db_bind_uint64((val), SLNMigrationDone); \
+	db_bind_uint64((val), (migration)); \
+	DB_VAL_STORAGE_VERIFY(val);
+// Returns 1 if the migration has finished.
+static int SLNMigrationDoneGet(DB_txn *const txn, uint64_t const migration) {
+	DB_val done_key[1];
+	SLNMigrationDoneKeyPack(done_key, txn, migration);
+	DB_val done_val[1];
+	int rc = db_get(txn, done_key, done_val);
+	if(DB_NOTFOUND == rc) return 0;
+	if(rc < 0) return rc;
+	return 1;
+}
+static int SLNMigrationDonePut(DB_txn *const txn, uint64_t const migration) {
+	DB_val done_key[1];
+	SLNMigrationDoneKeyPack(done_key, txn, migration);
+	DB_val null = { 0, NULL };
+	return db_put(txn, done_key, &null, 0);
+}
@@ -2,6 +2,7 @@
 // MIT licensed (see LICENSE for details)
 
 #include <openssl/sha.h>
+#include "util/sha_ni.h"
 #include "StrongLink.h"
 
 #define HASHLEN_MIN 8 // Sanity check.
@@ -10,28 +11,98 @@
 #define HASHLEN_LONG 32 // Longest reasonable, hex form fits 80-char line.
 #define HASHLEN_MAX 128 // Should be enough for anyone.
 
+// Writes are collected into batches of this size and each batch is hashed
+// by every algorithm in parallel on the thread pool. Smaller batches aren't
+// worth the context switches.
+#define HASH_BATCH_SIZE (1024 * 64)
+
 // Note: Support for old/weak algorithms is important for old files
 // that have links using those algorithms. The algorithm we use
 // internally is defined by SLN_INTERNAL_ALGO.
-static SLNAlgo const *const algos[];
+static SLNAlgo const *const *algos;
 static size_t const algocount;
+static uv_once_t algos_once[1];
+static void algos_init(void);
 
 struct SLNHasher {
 	str_t *type;
 	size_t count;
 	void **algos;
 	str_t *internalHash;
+	byte_t *buf;
+	size_t used;
 };
 
+typedef struct {
+	SLNHasherRef hasher;
+	size_t i;
+	byte_t const *buf;
+	size_t len;
+	int rc;
+	async_sem_t *done;
+} hash_job;
+
+static void hash_update(void *const arg) {
+	hash_job *const job = arg;
+	async_pool_enter(NULL);
+	job->rc = algos[job->i]->update(job->hasher->algos[job->i], job->buf, job->len);
+	async_pool_leave(NULL);
+	if(job->done) async_sem_post(job->done);
+}
+static int hash_parallel(SLNHasherRef const hasher, byte_t const *const buf, size_t const len) {
+	// Fibers can only be spawned from the main thread. If we're
+	// already on a worker, just hash serially.
+	if(async_pool_get_worker() || hasher->count < 2) {
+		for(size_t i = 0; i < hasher->count; i++) {
+			int rc = algos[i]->update(hasher->algos[i], buf, len);
+			if(rc < 0) return -1;
+		}
+		return 0;
+	}
+	hash_job jobs[hasher->count];
+	async_sem_t done[1];
+	async_sem_init(done, 0, 0);
+	size_t spawned = 0;
+	for(size_t i = 0; i < hasher->count; i++) {
+		jobs[i] = (hash_job){ hasher, i, buf, len, 0, NULL };
+	}
+	// The last algorithm runs on our own fiber (also on the pool).
+	for(size_t i = 0; i+1 < hasher->count; i++) {
+		jobs[i].done = done;
+		int rc = async_spawn(STACK_MINIMUM, hash_update, &jobs[i]);
+		if(rc < 0) {
+			jobs[i].done = NULL;
+			hash_update(&jobs[i]);
+			continue;
+		}
+		spawned++;
+	}
+	hash_update(&jobs[hasher->count-1]);
+	for(; spawned > 0; spawned--) async_sem_wait(done);
+	async_sem_destroy(done);
+	for(size_t i = 0; i < hasher->count; i++) {
+		if(jobs[i].rc < 0) return -1;
+	}
+	return 0;
+}
+static int hash_flush(SLNHasherRef const hasher) {
+	if(!hasher->used) return 0;
+	int rc = hash_parallel(hasher, hasher->buf, hasher->used);
+	hasher->used = 0;
+	return rc;
+}
+
 SLNHasherRef SLNHasherCreate(strarg_t const type) {
 	if(!type) return NULL;
+	uv_once(algos_once, algos_init);
 	SLNHasherRef hasher = calloc(1, sizeof(struct SLNHasher));
 	if(!hasher) return NULL;
 
 	hasher->type = strdup(type);
 	hasher->count = algocount;
 	hasher->algos = calloc(hasher->count, sizeof(hasher->algos[0]));
-	if(!hasher->type || !hasher->algos) {
+	hasher->buf = malloc(HASH_BATCH_SIZE);
+	if(!hasher->type || !hasher->algos || !hasher->buf) {
 		SLNHasherFree(&hasher);
 		return NULL;
 	}
@@ -60,6 +131,8 @@ void SLNHasherFree(SLNHasherRef *const hasherptr) {
 	}
 	hasher->count = 0;
 	FREE(&hasher->internalHash);
+	FREE(&hasher->buf);
+	hasher->used = 0;
 	assert_zeroed(hasher, 1);
 	FREE(hasherptr); hasher = NULL;
 }
@@ -67,15 +140,30 @@ int SLNHasherWrite(SLNHasherRef const hasher, byte_t const *const buf, size_t co
 	if(!hasher) return 0;
 	if(!len) return 0;
 	assert(buf);
-	for(size_t i = 0; i < hasher->count; i++) {
-		int rc = algos[i]->update(hasher->algos[i], buf, len);
-		if(rc < 0) return -1;
+	size_t pos = 0;
+	while(pos < len) {
+		// Large writes bypass the batch buffer entirely.
+		if(!hasher->used && len-pos >= HASH_BATCH_SIZE) {
+			size_t const x = len-pos - (len-pos) % HASH_BATCH_SIZE;
+			int rc = hash_parallel(hasher, buf+pos, x);
+			if(rc < 0) return rc;
+			pos += x;
+			continue;
+		}
+		size_t const x = MIN(len-pos, HASH_BATCH_SIZE-hasher->used);
+		memcpy(hasher->buf+hasher->used, buf+pos, x);
+		hasher->used += x;
+		pos += x;
+		if(hasher->used < HASH_BATCH_SIZE) break;
+		int rc = hash_flush(hasher);
+		if(rc < 0) return rc;
 	}
 	return 0;
 }
 
 str_t **SLNHasherEnd(SLNHasherRef const hasher) {
 	if(!hasher) return NULL;
+	if(hash_flush(hasher) < 0) return NULL;
 
 	size_t x = 0;
 	size_t const count = hasher->count * 4;
@@ -233,10 +321,121 @@ static SLNAlgo const sha512 = {
 	.final = sha512final,
 };
 
-static SLNAlgo const *const algos[] = {
+// Hardware accelerated SHA-1 and SHA-256 using the x86 SHA extensions.
+// OpenSSL's context structs are opaque-ish, so we keep our own.
+typedef struct {
+	uint32_t state[8];
+	uint64_t total;
+	byte_t block[64];
+	size_t used;
+	void (*compress)(uint32_t *, unsigned char const *, size_t);
+} shani_ctx;
+
+static int shaniinit(void **const algo, uint32_t const *const iv, size_t const n, void (*const compress)(uint32_t *, unsigned char const *, size_t)) {
+	assert(algo);
+	shani_ctx *const ctx = calloc(1, sizeof(shani_ctx));
+	if(!ctx) return -1;
+	memcpy(ctx->state, iv, n * sizeof(iv[0]));
+	ctx->compress = compress;
+	*algo = ctx;
+	return 0;
+}
+static int shaniupdate(void *const algo, byte_t const *const buf, size_t const len) {
+	shani_ctx *const ctx = algo;
+	if(!ctx) return 0;
+	size_t pos = 0;
+	ctx->total += len;
+	if(ctx->used) {
+		size_t const x = MIN(len, sizeof(ctx->block) - ctx->used);
+		memcpy(ctx->block + ctx->used, buf, x);
+		ctx->used += x;
+		pos += x;
+		if(ctx->used < sizeof(ctx->block)) return 0;
+		ctx->compress(ctx->state, ctx->block, 1);
+		ctx->used = 0;
+	}
+	size_t const blocks = (len - pos) / sizeof(ctx->block);
+	if(blocks) ctx->compress(ctx->state, buf + pos, blocks);
+	pos += blocks * sizeof(ctx->block);
+	memcpy(ctx->block, buf + pos, len - pos);
+	ctx->used = len - pos;
+	return 0;
+}
+static ssize_t shanifinal(void *const algo, size_t const n, byte_t *const out, size_t const max) {
+	shani_ctx *const ctx = algo;
+	if(!ctx) return 0;
+	if(max < n*4) {
+		free(ctx);
+		return -1;
+	}
+	uint64_t const bits = ctx->total * 8;
+	ctx->block[ctx->used++] = 0x80;
+	if(ctx->used > 56) {
+		memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+		ctx->compress(ctx->state, ctx->block, 1);
+		ctx->used = 0;
+	}
+	memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+	for(size_t i = 0; i < 8; i++) ctx->block[56+i] = bits >> (56 - i*8);
+	ctx->compress(ctx->state, ctx->block, 1);
+	for(size_t i = 0; i < n; i++) {
+		out[i*4+0] = ctx->state[i] >> 24;
+		out[i*4+1] = ctx->state[i] >> 16;
+		out[i*4+2] = ctx->state[i] >> 8;
+		out[i*4+3] = ctx->state[i] >> 0;
+	}
+	free(ctx);
+	return n*4;
+}
+
+static int sha1niinit(char const *const type, void **const algo) {
+	static uint32_t const iv[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+	};
+	return shaniinit(algo, iv, numberof(iv), sha1_ni_compress);
+}
+static ssize_t sha1nifinal(void *const ctx, byte_t *const out, size_t const max) {
+	return shanifinal(ctx, 5, out, max);
+}
+static SLNAlgo const sha1ni = {
+	.name = "sha1",
+	.init = sha1niinit,
+	.update = shaniupdate,
+	.final = sha1nifinal,
+};
+
+static int sha256niinit(char const *const type, void **const algo) {
+	static uint32_t const iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	return shaniinit(algo, iv, numberof(iv), sha256_ni_compress);
+}
+static ssize_t sha256nifinal(void *const ctx, byte_t *const out, size_t const max) {
+	return shanifinal(ctx, 8, out, max);
+}
+static SLNAlgo const sha256ni = {
+	.name = "sha256",
+	.init = sha256niinit,
+	.update = shaniupdate,
+	.final = sha256nifinal,
+};
+
+static SLNAlgo const *const algos_portable[] = {
 	&sha1,
 	&sha256,
 	&sha512,
 };
-static size_t const algocount = numberof(algos);
+static SLNAlgo const *const algos_shani[] = {
+	&sha1ni,
+	&sha256ni,
+	&sha512,
+};
+static SLNAlgo const *const *algos = algos_portable;
+static size_t const algocount = numberof(algos_portable);
+
+static void algos_init(void) {
+	assert(numberof(algos_portable) == numberof(algos_shani));
+	if(sha_ni_available()) algos = algos_shani;
+}
 
@@ -0,0 +1,513 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include "StrongLink.h"
+#include "SLNDB.h"
+#include "SLNPostings.h"
+#include "../deps/libressl-portable/include/compat/stdlib.h"
+
+// Block format (the first ID is in the key):
+// - 1 byte: number of deltas
+// - 2 bits per delta (rounded up to a byte): length of the delta minus one
+// - Deltas as 1-4 byte little-endian integers, packed back to back
+// Keeping the lengths separate from the data lets the decoder work without
+// branching on every byte, like StreamVByte.
+#define BLOCK_MAX SLN_POSTINGS_BLOCK_MAX
+#define BLOCK_BYTES_MAX (1 + (BLOCK_MAX+3)/4 + BLOCK_MAX*4)
+
+struct SLNPostingsCursor {
+	DB_txn *txn;
+	DB_cursor *blocks;
+	strarg_t token;
+	uint64_t ids[BLOCK_MAX];
+	size_t count; // 0 means unpositioned.
+	size_t pos;
+};
+
+static size_t block_encode(uint64_t const *const ids, size_t const count, byte_t *const out) {
+	assert(count > 0);
+	assert(count <= BLOCK_MAX);
+	size_t const deltas = count-1;
+	size_t const clen = (deltas+3) / 4;
+	byte_t *const ctrl = out+1;
+	byte_t *p = ctrl+clen;
+	out[0] = (byte_t)deltas;
+	memset(ctrl, 0, clen);
+	for(size_t i = 0; i < deltas; i++) {
+		assert(ids[i+1] > ids[i]);
+		assert(ids[i+1] - ids[i] <= UINT32_MAX);
+		uint32_t const x = (uint32_t)(ids[i+1] - ids[i]);
+		size_t const len =
+			x < (1UL << 8) ? 1 :
+			x < (1UL << 16) ? 2 :
+			x < (1UL << 24) ? 3 : 4;
+		ctrl[i/4] |= (byte_t)((len-1) << (i%4*2));
+		for(size_t j = 0; j < len; j++) *p++ = (byte_t)(x >> (j*8));
+	}
+	return p - out;
+}
+static int block_decode(DB_val const *const val, uint64_t const first, uint64_t *const ids, size_t *const count) {
+	byte_t const *const buf = val->data;
+	byte_t const *const end = buf + val->size;
+	if(val->size < 1) return DB_EIO;
+	size_t const deltas = buf[0];
+	if(deltas+1 > BLOCK_MAX) return DB_EIO;
+	byte_t const *const ctrl = buf+1;
+	byte_t const *p = ctrl + (deltas+3) / 4;
+	if(p > end) return DB_EIO;
+	ids[0] = first;
+	for(size_t i = 0; i < deltas; i++) {
+		size_t const len = ((ctrl[i/4] >> (i%4*2)) & 0x3) + 1;
+		if(p+len > end) return DB_EIO;
+		uint32_t x = 0;
+		for(size_t j = 0; j < len; j++) x |= (uint32_t)p[j] << (j*8);
+		p += len;
+		ids[i+1] = ids[i] + x;
+	}
+	if(p != end) return DB_EIO;
+	*count = deltas+1;
+	return 0;
+}
+// Index of the first ID >= target, or count if there isn't one.
+static size_t lower_bound(uint64_t const *const ids, size_t const count, uint64_t const target) {
+	size_t lo = 0, hi = count;
+	while(lo < hi) {
+		size_t const mid = lo + (hi-lo) / 2;
+		if(ids[mid] < target) lo = mid+1;
+		else hi = mid;
+	}
+	return lo;
+}
+// Same as lower_bound, but searches outward from `pos`. Cheap when the
+// target is close by, which is the usual case when intersecting lists.
+static size_t gallop(uint64_t const *const ids, size_t const count, size_t const pos, uint64_t const target) {
+	size_t lo, hi, step = 1;
+	if(ids[pos] < target) {
+		lo = pos+1;
+		hi = pos+1;
+		while(hi < count && ids[hi] < target) {
+			lo = hi+1;
+			hi += step;
+			step *= 2;
+		}
+		if(hi > count) hi = count;
+	} else {
+		lo = pos;
+		hi = pos;
+		while(lo > 0 && ids[lo-1] >= target) {
+			hi = lo-1;
+			lo = hi > step ? hi-step : 0;
+			step *= 2;
+		}
+	}
+	return lo + lower_bound(ids+lo, hi-lo, target);
+}
+// Splits a sorted list into as few blocks as possible and writes them out.
+static int write_blocks(DB_txn *const txn, strarg_t const token, uint64_t const *const ids, size_t const count) {
+	byte_t buf[BLOCK_BYTES_MAX];
+	size_t i = 0;
+	while(i < count) {
+		size_t j = i+1;
+		while(j < count && j-i < BLOCK_MAX && ids[j]-ids[j-1] <= UINT32_MAX) j++;
+		DB_val block_key[1];
+		SLNTermPostingBlockKeyPack(block_key, txn, token, ids[i]);
+		DB_val block_val[1] = {{ block_encode(ids+i, j-i, buf), buf }};
+		int rc = db_put(txn, block_key, block_val, 0);
+		if(rc < 0) return rc;
+		i = j;
+	}
+	return 0;
+}
+
+// Keeps the number of meta-files for each term, for the filter planner.
+// Called after the new ID has been written.
+static int count_add(DB_txn *const txn, strarg_t const token) {
+	DB_val count_key[1];
+	SLNTermMetaFileCountKeyPack(count_key, txn, token);
+	DB_val count_val[1];
+	uint64_t count = 0;
+	int rc = db_get(txn, count_key, count_val);
+	if(rc >= 0) {
+		SLNTermMetaFileCountValUnpack(count_val, txn, &count);
+		count++;
+	} else if(DB_NOTFOUND == rc) {
+		// Terms indexed before we kept counts start from the blocks.
+		rc = SLNPostingsEstimate(txn, token, UINT64_MAX, &count);
+		if(rc < 0) return rc;
+	} else {
+		return rc;
+	}
+	DB_val new_key[1];
+	SLNTermMetaFileCountKeyPack(new_key, txn, token);
+	DB_val new_val[1];
+	SLNTermMetaFileCountValPack(new_val, txn, count);
+	return db_put(txn, new_key, new_val, 0);
+}
+
+int SLNPostingsAdd(DB_txn *const txn, strarg_t const token, uint64_t const metaFileID) {
+	if(!txn) return DB_EINVAL;
+	if(!token) return DB_EINVAL;
+	DB_cursor *cursor = NULL;
+	int rc = db_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+
+	DB_range range[1];
+	SLNTermPostingBlockRange1(range, txn, token);
+	DB_val block_key[1];
+	SLNTermPostingBlockKeyPack(block_key, txn, token, metaFileID);
+	DB_val block_val[1];
+	uint64_t ids[BLOCK_MAX+1];
+	size_t count = 0;
+	rc = db_cursor_seekr(cursor, range, block_key, block_val, -1);
+	if(rc >= 0) {
+		strarg_t t;
+		uint64_t first;
+		SLNTermPostingBlockKeyUnpack(block_key, txn, &t, &first);
+		rc = block_decode(block_val, first, ids, &count);
+		if(rc < 0) return rc;
+	} else if(DB_NOTFOUND != rc) {
+		return rc;
+	}
+
+	size_t const i = lower_bound(ids, count, metaFileID);
+	if(i < count && metaFileID == ids[i]) return 0;
+	if(i == count && count > 0 &&
+	   (count >= BLOCK_MAX || metaFileID - ids[count-1] > UINT32_MAX)) {
+		// New IDs are almost always the highest so far. If the last
+		// block can't take it, start a new one without rewriting it.
+		rc = write_blocks(txn, token, &metaFileID, 1);
+	} else {
+		memmove(ids+i+1, ids+i, (count-i) * sizeof(*ids));
+		ids[i] = metaFileID;
+		count++;
+		// If the block overflows, the new block's key is still below the
+		// first ID of the following block, so nothing else needs to move.
+		rc = write_blocks(txn, token, ids, count);
+	}
+	if(rc < 0) return rc;
+	rc = count_add(txn, token);
+	if(rc < 0) return rc;
+	return 1;
+}
+
+int SLNPostingsCursorRenew(DB_txn *const txn, strarg_t const token, SLNPostingsCursor **const out) {
+	if(!txn) return DB_EINVAL;
+	if(!token) return DB_EINVAL;
+	if(!out) return DB_EINVAL;
+	SLNPostingsCursor *cursor = *out;
+	if(!cursor) {
+		cursor = calloc(1, sizeof(struct SLNPostingsCursor));
+		if(!cursor) return DB_ENOMEM;
+	}
+	int rc = db_cursor_renew(txn, &cursor->blocks);
+	if(rc < 0) {
+		if(!*out) SLNPostingsCursorClose(cursor);
+		return rc;
+	}
+	cursor->txn = txn;
+	cursor->token = token;
+	cursor->count = 0;
+	cursor->pos = 0;
+	*out = cursor;
+	return 0;
+}
+void SLNPostingsCursorClose(SLNPostingsCursor *const cursor) {
+	if(!cursor) return;
+	db_cursor_close(cursor->blocks); cursor->blocks = NULL;
+	cursor->txn = NULL;
+	cursor->token = NULL;
+	cursor->count = 0;
+	cursor->pos = 0;
+	free(cursor);
+}
+
+static int load(SLNPostingsCursor *const cursor, DB_val *const block_key, DB_val *const block_val) {
+	strarg_t token;
+	uint64_t first;
+	SLNTermPostingBlockKeyUnpack(block_key, cursor->txn, &token, &first);
+	int rc = block_decode(block_val, first, cursor->ids, &cursor->count);
+	if(rc < 0) cursor->count = 0;
+	return rc;
+}
+static int clear(SLNPostingsCursor *const cursor, int const rc) {
+	cursor->count = 0;
+	cursor->pos = 0;
+	return rc;
+}
+
+int SLNPostingsCursorCurrent(SLNPostingsCursor *const cursor, uint64_t *const metaFileID) {
+	if(!cursor) return DB_EINVAL;
+	if(!cursor->count) return DB_NOTFOUND;
+	if(metaFileID) *metaFileID = cursor->ids[cursor->pos];
+	return 0;
+}
+int SLNPostingsCursorSeek(SLNPostingsCursor *const cursor, uint64_t *const metaFileID, int const dir) {
+	if(!cursor) return DB_EINVAL;
+	if(!metaFileID) return DB_EINVAL;
+	uint64_t const target = *metaFileID;
+	uint64_t const *const ids = cursor->ids;
+
+	// If the target falls within the current block, the answer does too.
+	if(cursor->count && ids[0] <= target && target <= ids[cursor->count-1]) {
+		size_t const i = gallop(ids, cursor->count, cursor->pos, target);
+		assert(i < cursor->count);
+		if(target == ids[i]) cursor->pos = i;
+		else if(0 == dir) return clear(cursor, DB_NOTFOUND);
+		else if(dir < 0) cursor->pos = i-1;
+		else cursor->pos = i;
+		*metaFileID = ids[cursor->pos];
+		return 0;
+	}
+
+	// Otherwise check the block that would contain the target.
+	DB_range range[1];
+	SLNTermPostingBlockRange1(range, cursor->txn, cursor->token);
+	DB_val block_key[1];
+	SLNTermPostingBlockKeyPack(block_key, cursor->txn, cursor->token, target);
+	DB_val block_val[1];
+	int rc = db_cursor_seekr(cursor->blocks, range, block_key, block_val, -1);
+	if(DB_NOTFOUND == rc && dir > 0) {
+		// Every block starts after the target.
+		return SLNPostingsCursorFirst(cursor, metaFileID, +1);
+	}
+	if(rc < 0) return clear(cursor, rc);
+	rc = load(cursor, block_key, block_val);
+	if(rc < 0) return clear(cursor, rc);
+
+	size_t const i = lower_bound(cursor->ids, cursor->count, target);
+	if(i < cursor->count && target == cursor->ids[i]) {
+		cursor->pos = i;
+	} else if(0 == dir) {
+		return clear(cursor, DB_NOTFOUND);
+	} else if(dir < 0) {
+		assert(i > 0); // The block starts at or before the target.
+		cursor->pos = i-1;
+	} else if(i < cursor->count) {
+		cursor->pos = i;
+	} else {
+		rc = db_cursor_nextr(cursor->blocks, range, block_key, block_val, +1);
+		if(rc < 0) return clear(cursor, rc);
+		rc = load(cursor, block_key, block_val);
+		if(rc < 0) return clear(cursor, rc);
+		cursor->pos = 0;
+	}
+	*metaFileID = cursor->ids[cursor->pos];
+	return 0;
+}
+int SLNPostingsCursorFirst(SLNPostingsCursor *const cursor, uint64_t *const metaFileID, int const dir) {
+	if(!cursor) return DB_EINVAL;
+	if(0 == dir) return DB_EINVAL;
+	DB_range range[1];
+	SLNTermPostingBlockRange1(range, cursor->txn, cursor->token);
+	DB_val block_key[1], block_val[1];
+	int rc = db_cursor_firstr(cursor->blocks, range, block_key, block_val, dir);
+	if(rc < 0) return clear(cursor, rc);
+	rc = load(cursor, block_key, block_val);
+	if(rc < 0) return clear(cursor, rc);
+	cursor->pos = dir > 0 ? 0 : cursor->count-1;
+	if(metaFileID) *metaFileID = cursor->ids[cursor->pos];
+	return 0;
+}
+int SLNPostingsCursorNext(SLNPostingsCursor *const cursor, uint64_t *const metaFileID, int const dir) {
+	if(!cursor) return DB_EINVAL;
+	if(0 == dir) return DB_EINVAL;
+	if(!cursor->count) return SLNPostingsCursorFirst(cursor, metaFileID, dir);
+	if(dir > 0 && cursor->pos+1 < cursor->count) {
+		cursor->pos++;
+	} else if(dir < 0 && cursor->pos > 0) {
+		cursor->pos--;
+	} else {
+		DB_range range[1];
+		SLNTermPostingBlockRange1(range, cursor->txn, cursor->token);
+		DB_val block_key[1], block_val[1];
+		int rc = db_cursor_nextr(cursor->blocks, range, block_key, block_val, dir);
+		if(rc < 0) return clear(cursor, rc);
+		rc = load(cursor, block_key, block_val);
+		if(rc < 0) return clear(cursor, rc);
+		cursor->pos = dir > 0 ? 0 : cursor->count-1;
+	}
+	if(metaFileID) *metaFileID = cursor->ids[cursor->pos];
+	return 0;
+}
+
+int SLNPostingsAddPositions(DB_txn *const txn, strarg_t const token, uint64_t const metaFileID, uint64_t const *const positions, size_t const count) {
+	if(!txn) return DB_EINVAL;
+	if(!token) return DB_EINVAL;
+	if(!count) return 0;
+	assert(positions);
+
+	uint64_t *old = NULL;
+	size_t ocount = 0, osize = 0;
+	uint64_t *merged = NULL;
+	byte_t *buf = NULL;
+	int rc = SLNPostingsGetPositions(txn, token, metaFileID, &old, &ocount, &osize);
+	if(DB_NOTFOUND == rc) rc = 0;
+	if(rc < 0) goto cleanup;
+
+	merged = reallocarray(NULL, ocount+count, sizeof(*merged));
+	buf = reallocarray(NULL, ocount+count, DB_VARINT_MAX);
+	if(!merged || !buf) rc = DB_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	size_t i = 0, j = 0, n = 0;
+	while(i < ocount || j < count) {
+		uint64_t x;
+		if(j >= count || (i < ocount && old[i] <= positions[j])) x = old[i++];
+		else x = positions[j++];
+		if(n && merged[n-1] >= x) continue; // Duplicate (inputs are sorted).
+		merged[n++] = x;
+	}
+
+	DB_val pos_val[1] = {{ 0, buf }};
+	uint64_t prev = 0;
+	for(i = 0; i < n; i++) {
+		db_bind_uint64(pos_val, merged[i] - prev);
+		prev = merged[i];
+	}
+	DB_val pos_key[1];
+	SLNTermMetaFileIDPositionsKeyPack(pos_key, txn, token, metaFileID);
+	rc = db_put(txn, pos_key, pos_val, 0);
+
+cleanup:
+	FREE(&old);
+	FREE(&merged);
+	FREE(&buf);
+	return rc;
+}
+int SLNPostingsGetPositions(DB_txn *const txn, strarg_t const token, uint64_t const metaFileID, uint64_t **const positions, size_t *const count, size_t *const size) {
+	if(!txn) return DB_EINVAL;
+	if(!token) return DB_EINVAL;
+	if(!positions || !count || !size) return DB_EINVAL;
+	DB_val pos_key[1];
+	SLNTermMetaFileIDPositionsKeyPack(pos_key, txn, token, metaFileID);
+	DB_val pos_val[1];
+	*count = 0;
+	int rc = db_get(txn, pos_key, pos_val);
+	if(rc < 0) return rc;
+	uint64_t x = 0;
+	while(pos_val->size) {
+		if(*count+1 > *size) {
+			size_t const s = MAX(16, *size * 2);
+			uint64_t *const p = reallocarray(*positions, s, sizeof(**positions));
+			if(!p) return DB_ENOMEM;
+			*positions = p;
+			*size = s;
+		}
+		x += db_read_uint64(pos_val);
+		(*positions)[(*count)++] = x;
+	}
+	return 0;
+}
+
+int SLNPostingsEstimate(DB_txn *const txn, strarg_t const token, uint64_t const max, uint64_t *const out) {
+	if(!txn) return DB_EINVAL;
+	if(!token) return DB_EINVAL;
+	if(!out) return DB_EINVAL;
+	// Use the exact count if we have it.
+	DB_val count_key[1];
+	SLNTermMetaFileCountKeyPack(count_key, txn, token);
+	DB_val count_val[1];
+	int rc = db_get(txn, count_key, count_val);
+	if(rc >= 0) {
+		SLNTermMetaFileCountValUnpack(count_val, txn, out);
+		return 0;
+	}
+	if(DB_NOTFOUND != rc) return rc;
+
+	DB_cursor *cursor = NULL;
+	rc = db_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+	DB_range range[1];
+	SLNTermPostingBlockRange1(range, txn, token);
+	DB_val block_val[1];
+	uint64_t total = 0;
+	rc = db_cursor_firstr(cursor, range, NULL, block_val, +1);
+	for(; rc >= 0; rc = db_cursor_nextr(cursor, range, NULL, block_val, +1)) {
+		if(block_val->size < 1) return DB_EIO;
+		total += ((byte_t const *)block_val->data)[0] + 1;
+		if(total >= max) break;
+	}
+	if(rc < 0 && DB_NOTFOUND != rc) return rc;
+	*out = total;
+	return 0;
+}
+
+// Every old row for the pair maps to the same posting.
+static int legacy_del(DB_txn *const txn, DB_cursor *const cursor, strarg_t const token, uint64_t const metaFileID) {
+	DB_range range[1];
+	SLNTermMetaFileIDAndPositionRange2(range, txn, token, metaFileID);
+	for(;;) {
+		int rc = db_cursor_firstr(cursor, range, NULL, NULL, +1);
+		if(DB_NOTFOUND == rc) return 0;
+		if(rc < 0) return rc;
+		rc = db_cursor_del(cursor);
+		if(rc < 0) return rc;
+	}
+}
+int SLNPostingsMigrate(DB_txn *const txn, SLNPostingsMigration *const state, size_t const max) {
+	if(!txn) return DB_EINVAL;
+	if(!state) return DB_EINVAL;
+	if(state->done) return 0;
+	DB_cursor *cursor = NULL;
+	int rc = db_cursor_open(txn, &cursor);
+	if(rc < 0) return rc;
+
+	DB_range legacy[1];
+	SLNTermMetaFileIDAndPositionRange0(legacy, txn);
+	for(size_t i = 0; i < max; i++) {
+		// Seek past the last pair instead of relying on deletes, since
+		// not every back-end supports them.
+		DB_val token_key[1];
+		if(state->token) {
+			DB_range prev[1];
+			SLNTermMetaFileIDAndPositionRange2(prev, txn, state->token, state->metaFileID);
+			*token_key = *prev->max;
+			rc = db_cursor_seekr(cursor, legacy, token_key, NULL, +1);
+		} else {
+			rc = db_cursor_firstr(cursor, legacy, token_key, NULL, +1);
+		}
+		if(rc < 0) break;
+		strarg_t token;
+		uint64_t metaFileID, position;
+		SLNTermMetaFileIDAndPositionKeyUnpack(token_key, txn, &token, &metaFileID, &position);
+		// Writing can invalidate memory returned by the cursor.
+		str_t *const tmp = strdup(token);
+		if(!tmp) { rc = DB_ENOMEM; break; }
+		FREE(&state->token);
+		state->token = tmp;
+		state->metaFileID = metaFileID;
+
+		rc = SLNPostingsAdd(txn, state->token, metaFileID);
+		if(rc < 0) break;
+		state->added += rc;
+		if(!state->kept) {
+			rc = legacy_del(txn, cursor, state->token, metaFileID);
+			if(DB_EINVAL == rc) state->kept = true;
+			else if(rc < 0) break;
+		}
+		rc = 0;
+	}
+	if(DB_NOTFOUND == rc) {
+		// Rows the back-end couldn't delete are never scanned again.
+		rc = SLNMigrationDonePut(txn, SLNMigrationPostingBlocks);
+		if(rc >= 0) state->done = true;
+	}
+
+	db_cursor_close(cursor); cursor = NULL;
+	return rc;
+}
+int SLNPostingsMigrationPending(DB_txn *const txn) {
+	if(!txn) return DB_EINVAL;
+	int rc = SLNMigrationDoneGet(txn, SLNMigrationPostingBlocks);
+	if(0 != rc) return rc < 0 ? rc : 0;
+	DB_cursor *cursor = NULL;
+	rc = db_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+	DB_range legacy[1];
+	SLNTermMetaFileIDAndPositionRange0(legacy, txn);
+	rc = db_cursor_firstr(cursor, legacy, NULL, NULL, +1);
+	if(DB_NOTFOUND == rc) return 0;
+	if(rc < 0) return rc;
+	return 1;
+}
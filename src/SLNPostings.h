@@ -0,0 +1,57 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#ifndef SLNPOSTINGS_H
+#define SLNPOSTINGS_H
+
+#include "db/db_base.h"
+#include "common.h"
+
+// Full-text posting lists. Each term's meta-file IDs are stored in blocks
+// of up to SLN_POSTINGS_BLOCK_MAX delta-encoded IDs, one row per block,
+// keyed by term and the first ID in the block (SLNTermPostingBlock).
+#define SLN_POSTINGS_BLOCK_MAX 128
+
+typedef struct SLNPostingsCursor SLNPostingsCursor;
+
+// Opens the cursor if *out is NULL. The token isn't copied and must outlive
+// the cursor (or the next renew).
+int SLNPostingsCursorRenew(DB_txn *const txn, strarg_t const token, SLNPostingsCursor **const out);
+void SLNPostingsCursorClose(SLNPostingsCursor *const cursor);
+
+// Same conventions as db_cursor_seek/_first/_next: dir 0 is an exact match,
+// otherwise the nearest ID in the given direction.
+int SLNPostingsCursorCurrent(SLNPostingsCursor *const cursor, uint64_t *const metaFileID);
+int SLNPostingsCursorSeek(SLNPostingsCursor *const cursor, uint64_t *const metaFileID, int const dir);
+int SLNPostingsCursorFirst(SLNPostingsCursor *const cursor, uint64_t *const metaFileID, int const dir);
+int SLNPostingsCursorNext(SLNPostingsCursor *const cursor, uint64_t *const metaFileID, int const dir);
+
+// Uses the transaction's shared cursor. Returns 1 if the posting was
+// written, or 0 if it was already there.
+int SLNPostingsAdd(DB_txn *const txn, strarg_t const token, uint64_t const metaFileID);
+
+// Word positions of a token within a meta-file, for phrase matching.
+// Adding merges with any positions already stored. Getting fills a buffer
+// that is grown as needed, and returns DB_NOTFOUND if there are none.
+int SLNPostingsAddPositions(DB_txn *const txn, strarg_t const token, uint64_t const metaFileID, uint64_t const *const positions, size_t const count);
+int SLNPostingsGetPositions(DB_txn *const txn, strarg_t const token, uint64_t const metaFileID, uint64_t **const positions, size_t *const count, size_t *const size);
+
+// Number of meta-files containing a token. Falls back to counting postings
+// (stopping early once it reaches max) if the statistics are missing.
+int SLNPostingsEstimate(DB_txn *const txn, strarg_t const token, uint64_t const max, uint64_t *const out);
+
+// Moving rows from the old one-row-per-posting format into blocks is a
+// one-time migration, done in batches so each transaction stays small.
+// Start with a zeroed state, call until done, and free token afterward.
+typedef struct {
+	str_t *token; // Last pair migrated, or NULL before the first.
+	uint64_t metaFileID;
+	size_t added; // Postings actually written.
+	bool kept; // The back-end couldn't delete the old rows.
+	bool done;
+} SLNPostingsMigration;
+int SLNPostingsMigrate(DB_txn *const txn, SLNPostingsMigration *const state, size_t const max);
+// Returns 1 if there are old rows that haven't been migrated yet.
+int SLNPostingsMigrationPending(DB_txn *const txn);
+
+#endif
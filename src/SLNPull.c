@@ -178,7 +178,7 @@ static void writer(SLNPullRef const pull) {
 		assert(count <= QUEUE_SIZE);
 
 		for(;;) {
-			int rc = SLNSubmissionStoreBatch(queue, count);
+			int rc = SLNRepoSubmissionCommit(SLNSessionGetRepo(pull->session), queue, count);
 			if(rc >= 0) break;
 			fprintf(stderr, "Submission error %s (%d)\n", sln_strerror(rc), rc);
 			async_sleep(1000 * 5);
@@ -219,7 +219,6 @@ int SLNPullStart(SLNPullRef const pull) {
 	}
 	pull->tasks++;
 	async_spawn(STACK_DEFAULT, (void (*)())writer, pull);
-	// TODO: It'd be even better to have one writer shared between all pulls...
 
 	return 0;
 }
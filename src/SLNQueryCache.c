@@ -0,0 +1,250 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include "StrongLink.h"
+#include "SLNDB.h"
+
+// Only small pages are kept, like the blog's front page. Longer exports
+// aren't worth the memory.
+#define URIS_MAX 100
+
+// Entries are keyed by the filter's serialization and how it was walked.
+// The fingerprint is only checked first to skip most comparisons.
+// Counts are stored as entries with no direction and no page.
+typedef struct {
+	uint64_t fingerprint; // 0 if unused.
+	byte_t *key;
+	size_t keylen;
+	int posdir;
+	int dir;
+	bool meta;
+	size_t max;
+	uint64_t latest; // Known to be current as of this submission.
+	uint64_t used;
+	str_t **URIs;
+	size_t count;
+	uint64_t sortID; // Position after walking the page.
+	uint64_t fileID;
+	uint64_t total;
+} entry;
+
+struct SLNQueryCache {
+	SLNRepoRef repo;
+	async_mutex_t lock[1];
+	size_t size;
+	entry *entries;
+	uint64_t clock;
+	SLNQueryCacheStats stats;
+};
+
+SLNQueryCacheRef SLNQueryCacheCreate(SLNRepoRef const repo, size_t const size) {
+	assert(repo);
+	assert(size);
+	SLNQueryCacheRef cache = calloc(1, sizeof(struct SLNQueryCache));
+	if(!cache) return NULL;
+	cache->repo = repo;
+	async_mutex_init(cache->lock, 0);
+	cache->size = size;
+	cache->entries = calloc(size, sizeof(*cache->entries));
+	if(!cache->entries) {
+		SLNQueryCacheFree(&cache);
+		return NULL;
+	}
+	return cache;
+}
+static void entry_clear(entry *const e) {
+	FREE(&e->key);
+	if(e->URIs) {
+		for(size_t i = 0; i < e->count; i++) FREE(&e->URIs[i]);
+		FREE(&e->URIs);
+	}
+	memset(e, 0, sizeof(*e));
+}
+void SLNQueryCacheFree(SLNQueryCacheRef *const cacheptr) {
+	SLNQueryCacheRef cache = *cacheptr;
+	if(!cache) return;
+	cache->repo = NULL;
+	async_mutex_destroy(cache->lock);
+	for(size_t i = 0; cache->entries && i < cache->size; i++) {
+		entry_clear(&cache->entries[i]);
+	}
+	FREE(&cache->entries);
+	cache->size = 0;
+	cache->clock = 0;
+	memset(&cache->stats, 0, sizeof(cache->stats));
+	assert_zeroed(cache, 1);
+	FREE(cacheptr); cache = NULL;
+}
+
+typedef struct {
+	uint64_t fingerprint;
+	byte_t *data;
+	size_t len;
+} filter_key;
+static int key_init(filter_key *const key, SLNFilterRef const filter) {
+	key->fingerprint = SLNFilterFingerprint(filter);
+	key->len = SLNFilterSerialize(filter, NULL, 0);
+	key->data = malloc(key->len);
+	if(!key->data) return DB_ENOMEM;
+	SLNFilterSerialize(filter, key->data, key->len);
+	return 0;
+}
+static entry *find(SLNQueryCacheRef const cache, filter_key const *const key, int const posdir, int const dir, bool const meta, size_t const max) {
+	for(size_t i = 0; i < cache->size; i++) {
+		entry *const e = &cache->entries[i];
+		if(key->fingerprint != e->fingerprint) continue;
+		if(posdir != e->posdir || dir != e->dir) continue;
+		if(meta != e->meta || max != e->max) continue;
+		if(key->len != e->keylen) continue;
+		if(0 != memcmp(key->data, e->key, key->len)) continue;
+		return e;
+	}
+	return NULL;
+}
+static entry *victim(SLNQueryCacheRef const cache) {
+	entry *v = &cache->entries[0];
+	for(size_t i = 0; i < cache->size; i++) {
+		entry *const e = &cache->entries[i];
+		if(!e->fingerprint) return e;
+		if(e->used < v->used) v = e;
+	}
+	cache->stats.evictions++;
+	entry_clear(v);
+	return v;
+}
+static bool may_match(void *ctx, SLNChanges const *const changes) {
+	return SLNFilterMayMatch((SLNFilterRef)ctx, changes);
+}
+// Entries stay good as long as nothing submitted since could match.
+static bool fresh(SLNQueryCacheRef const cache, entry *const e, SLNFilterRef const filter) {
+	uint64_t latest = e->latest;
+	if(!SLNRepoSubmissionUnchanged(cache->repo, &latest, may_match, filter)) {
+		entry_clear(e);
+		return false;
+	}
+	if(latest != e->latest) cache->stats.revalidations++;
+	e->latest = latest;
+	return true;
+}
+// Takes ownership of URIs.
+static void add(SLNQueryCacheRef const cache, SLNFilterRef const filter, uint64_t const latest, int const posdir, int const dir, bool const meta, size_t const max, str_t **const URIs, size_t const count, uint64_t const sortID, uint64_t const fileID, uint64_t const total) {
+	filter_key key[1];
+	if(key_init(key, filter) < 0) {
+		for(size_t i = 0; URIs && i < count; i++) free(URIs[i]);
+		free(URIs);
+		return;
+	}
+	async_mutex_lock(cache->lock);
+	entry *e = find(cache, key, posdir, dir, meta, max);
+	if(e && e->latest > latest) {
+		// Someone else already stored newer results.
+		async_mutex_unlock(cache->lock);
+		FREE(&key->data);
+		for(size_t i = 0; URIs && i < count; i++) free(URIs[i]);
+		free(URIs);
+		return;
+	}
+	if(e) entry_clear(e);
+	else e = victim(cache);
+	e->fingerprint = key->fingerprint;
+	e->key = key->data; key->data = NULL;
+	e->keylen = key->len;
+	e->posdir = posdir;
+	e->dir = dir;
+	e->meta = meta;
+	e->max = max;
+	e->latest = latest;
+	e->used = ++cache->clock;
+	e->URIs = URIs;
+	e->count = count;
+	e->sortID = sortID;
+	e->fileID = fileID;
+	e->total = total;
+	async_mutex_unlock(cache->lock);
+}
+
+ssize_t SLNQueryCacheCopyURIs(SLNQueryCacheRef const cache, SLNFilterRef const filter, SLNFilterPosition *const pos, int const dir, bool const meta, str_t *URIs[], size_t const max) {
+	if(!cache) return DB_NOTFOUND;
+	if(max > URIS_MAX) return DB_NOTFOUND;
+	filter_key key[1];
+	ssize_t rc = key_init(key, filter);
+	if(rc < 0) return DB_NOTFOUND;
+	rc = DB_NOTFOUND;
+	async_mutex_lock(cache->lock);
+	entry *const e = find(cache, key, pos->dir, dir, meta, max);
+	if(!e || !fresh(cache, e, filter)) {
+		cache->stats.misses++;
+		goto cleanup;
+	}
+	for(size_t i = 0; i < e->count; i++) {
+		URIs[i] = strdup(e->URIs[i]);
+		if(URIs[i]) continue;
+		for(size_t j = 0; j < i; j++) FREE(&URIs[j]);
+		rc = DB_ENOMEM;
+		goto cleanup;
+	}
+	FREE(&pos->URI);
+	pos->sortID = e->sortID;
+	pos->fileID = e->fileID;
+	e->used = ++cache->clock;
+	cache->stats.hits++;
+	rc = e->count;
+cleanup:
+	async_mutex_unlock(cache->lock);
+	FREE(&key->data);
+	return rc;
+}
+void SLNQueryCacheAddURIs(SLNQueryCacheRef const cache, SLNFilterRef const filter, uint64_t const latest, SLNFilterPosition const *const pos, int const dir, bool const meta, str_t *const URIs[], size_t const count, size_t const max) {
+	if(!cache) return;
+	if(max > URIS_MAX) return;
+	assert(count <= max);
+	str_t **copy = calloc(count+1, sizeof(*copy));
+	if(!copy) return;
+	for(size_t i = 0; i < count; i++) {
+		copy[i] = strdup(URIs[i]);
+		if(copy[i]) continue;
+		for(size_t j = 0; j < i; j++) FREE(&copy[j]);
+		FREE(&copy);
+		return;
+	}
+	add(cache, filter, latest, pos->dir, dir, meta, max, copy, count, pos->sortID, pos->fileID, 0);
+}
+
+int SLNQueryCacheGetCount(SLNQueryCacheRef const cache, SLNFilterRef const filter, uint64_t *const out) {
+	if(!cache) return DB_NOTFOUND;
+	filter_key key[1];
+	int rc = key_init(key, filter);
+	if(rc < 0) return DB_NOTFOUND;
+	rc = DB_NOTFOUND;
+	async_mutex_lock(cache->lock);
+	entry *const e = find(cache, key, 0, 0, false, 0);
+	if(!e || !fresh(cache, e, filter)) {
+		cache->stats.misses++;
+	} else {
+		*out = e->total;
+		e->used = ++cache->clock;
+		cache->stats.hits++;
+		rc = 0;
+	}
+	async_mutex_unlock(cache->lock);
+	FREE(&key->data);
+	return rc;
+}
+void SLNQueryCacheAddCount(SLNQueryCacheRef const cache, SLNFilterRef const filter, uint64_t const latest, uint64_t const count) {
+	if(!cache) return;
+	add(cache, filter, latest, 0, 0, false, 0, NULL, 0, 0, 0, count);
+}
+
+void SLNQueryCacheGetStats(SLNQueryCacheRef const cache, SLNQueryCacheStats *const out) {
+	assert(out);
+	memset(out, 0, sizeof(*out));
+	if(!cache) return;
+	async_mutex_lock(cache->lock);
+	*out = cache->stats;
+	out->size = cache->size;
+	for(size_t i = 0; i < cache->size; i++) {
+		if(cache->entries[i].fingerprint) out->entries++;
+	}
+	async_mutex_unlock(cache->lock);
+}
@@ -3,9 +3,45 @@
 
 #include "StrongLink.h"
 #include "SLNDB.h"
+#include "SLNPostings.h"
+#include "SLNBitmap.h"
 #include "../deps/libressl-portable/include/compat/stdlib.h"
+#include "../deps/smhasher/MurmurHash3.h"
 
 #define CACHE_SIZE 1000
+#define QUERY_CACHE_SIZE 128
+
+// Submissions from concurrent uploads are gathered for up to
+// COMMIT_DELAY milliseconds (or COMMIT_MAX files) and then stored
+// in a single transaction.
+#define COMMIT_DELAY 5
+#define COMMIT_MAX 64
+
+// Recent submission batches, so live queries can be checked against
+// what changed before touching the database.
+#define SUB_LOG_SIZE 32
+#define CHANGES_HASHES 4
+// Time one fan-out spends on subscriber callbacks, in nanoseconds.
+#define FANOUT_BUDGET (1000 * 1000 * 50)
+
+// Postings or metadata rows handled per transaction by SLNRepoMigrate.
+#define MIGRATE_BATCH 5000
+
+typedef struct commit_req commit_req;
+struct commit_req {
+	SLNSubmissionRef const *list;
+	size_t count;
+	int rc;
+	bool lead;
+	async_sem_t done[1];
+	commit_req *next;
+};
+
+typedef struct {
+	uint64_t sortID;
+	bool known;
+	SLNChanges changes;
+} sub_entry;
 
 struct SLNRepo {
 	str_t *dir;
@@ -19,12 +55,25 @@ struct SLNRepo {
 	SLNMode pub_mode;
 	SLNMode reg_mode;
 	SLNSessionCacheRef session_cache;
+	SLNQueryCacheRef query_cache;
 
 	DB_env *db;
 
 	async_mutex_t sub_mutex[1];
 	async_cond_t sub_cond[1];
 	uint64_t sub_latest;
+	SLNSubscriber *sub_waiting;
+	bool sub_fanout;
+	sub_entry sub_log[SUB_LOG_SIZE];
+	size_t sub_log_count;
+	size_t sub_log_next;
+	uint64_t sub_log_floor; // Older positions aren't covered.
+
+	commit_req *commit_head;
+	commit_req *commit_tail;
+	size_t commit_pending;
+	bool commit_leader;
+	async_sem_t commit_full[1];
 
 	SLNPullRef *pulls;
 	size_t pull_count;
@@ -66,6 +115,11 @@ SLNRepoRef SLNRepoCreate(strarg_t const dir, strarg_t const name) {
 		SLNRepoFree(&repo);
 		return NULL;
 	}
+	repo->query_cache = SLNQueryCacheCreate(repo, QUERY_CACHE_SIZE);
+	if(!repo->query_cache) {
+		SLNRepoFree(&repo);
+		return NULL;
+	}
 
 	int rc = createDBConnection(repo);
 	if(rc < 0) {
@@ -78,6 +132,7 @@ SLNRepoRef SLNRepoCreate(strarg_t const dir, strarg_t const name) {
 
 	async_mutex_init(repo->sub_mutex, 0);
 	async_cond_init(repo->sub_cond, 0);
+	async_sem_init(repo->commit_full, 0, 0);
 	return repo;
 }
 void SLNRepoFree(SLNRepoRef *const repoptr) {
@@ -97,12 +152,25 @@ void SLNRepoFree(SLNRepoRef *const repoptr) {
 	repo->pub_mode = 0;
 	repo->reg_mode = 0;
 	SLNSessionCacheFree(&repo->session_cache);
+	SLNQueryCacheFree(&repo->query_cache);
 
 	db_env_close(repo->db); repo->db = NULL;
 
 	async_mutex_destroy(repo->sub_mutex);
 	async_cond_destroy(repo->sub_cond);
 	repo->sub_latest = 0;
+	assert(!repo->sub_waiting);
+	assert(!repo->sub_fanout);
+	memset(repo->sub_log, 0, sizeof(repo->sub_log));
+	repo->sub_log_count = 0;
+	repo->sub_log_next = 0;
+	repo->sub_log_floor = 0;
+
+	assert(!repo->commit_head);
+	assert(!repo->commit_leader);
+	repo->commit_tail = NULL;
+	repo->commit_pending = 0;
+	async_sem_destroy(repo->commit_full);
 
 	for(size_t i = 0; i < repo->pull_count; ++i) {
 		SLNPullFree(&repo->pulls[i]);
@@ -160,6 +228,10 @@ SLNSessionCacheRef SLNRepoGetSessionCache(SLNRepoRef const repo) {
 	if(!repo) return NULL;
 	return repo->session_cache;
 }
+SLNQueryCacheRef SLNRepoGetQueryCache(SLNRepoRef const repo) {
+	if(!repo) return NULL;
+	return repo->query_cache;
+}
 
 void SLNRepoDBOpen(SLNRepoRef const repo, DB_env **const dbptr) {
 	assert(repo);
@@ -175,10 +247,66 @@ void SLNRepoDBClose(SLNRepoRef const repo, DB_env **const dbptr) {
 	*dbptr = NULL;
 }
 
-void SLNRepoSubmissionEmit(SLNRepoRef const repo, uint64_t const sortID) {
+static void changes_hash(strarg_t const field, strarg_t const value, uint64_t out[2]) {
+	uint32_t seed = 0;
+	if(field) MurmurHash3_x86_32(field, strlen(field), SLNSeed, &seed);
+	if(field) seed++;
+	MurmurHash3_x64_128(value, strlen(value), seed, out);
+}
+void SLNChangesAdd(SLNChanges *const changes, strarg_t const field, strarg_t const value) {
+	if(!changes) return;
+	assert(value);
+	if(++changes->count > SLN_CHANGES_MAX) return; // Saturated.
+	uint64_t h[2];
+	changes_hash(field, value, h);
+	for(size_t i = 0; i < CHANGES_HASHES; i++) {
+		uint64_t const bit = (h[0] + i * h[1]) % SLN_CHANGES_BITS;
+		changes->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+	}
+}
+bool SLNChangesMayContain(SLNChanges const *const changes, strarg_t const field, strarg_t const value) {
+	if(!changes) return true;
+	if(changes->count > SLN_CHANGES_MAX) return true;
+	if(!value) return true;
+	uint64_t h[2];
+	changes_hash(field, value, h);
+	for(size_t i = 0; i < CHANGES_HASHES; i++) {
+		uint64_t const bit = (h[0] + i * h[1]) % SLN_CHANGES_BITS;
+		if(!(changes->bits[bit / 64] & (uint64_t)1 << (bit % 64))) return false;
+	}
+	return true;
+}
+
+// Each entry covers submissions after the previous one, up to its sortID.
+static void log_append(SLNRepoRef const repo, uint64_t const sortID, SLNChanges const *const changes) {
+	sub_entry *const e = &repo->sub_log[repo->sub_log_next];
+	if(SUB_LOG_SIZE == repo->sub_log_count) {
+		repo->sub_log_floor = e->sortID;
+	} else {
+		repo->sub_log_count++;
+	}
+	repo->sub_log_next = (repo->sub_log_next + 1) % SUB_LOG_SIZE;
+	e->sortID = sortID;
+	e->known = !!changes;
+	if(changes) e->changes = *changes;
+}
+static bool log_may_match(SLNRepoRef const repo, SLNSubscriber *const s) {
+	if(!s->test) return true;
+	if(s->sortID < repo->sub_log_floor) return true;
+	for(size_t i = 0; i < repo->sub_log_count; i++) {
+		sub_entry const *const e = &repo->sub_log[i];
+		if(e->sortID <= s->sortID) continue;
+		if(!e->known) return true;
+		if(s->test(s->ctx, &e->changes)) return true;
+	}
+	return false;
+}
+
+void SLNRepoSubmissionEmit(SLNRepoRef const repo, uint64_t const sortID, SLNChanges const *const changes) {
 	assert(repo);
 	async_mutex_lock(repo->sub_mutex);
 	if(sortID > repo->sub_latest) {
+		log_append(repo, sortID, changes);
 		repo->sub_latest = sortID;
 		async_cond_broadcast(repo->sub_cond);
 	}
@@ -198,6 +326,203 @@ int SLNRepoSubmissionWait(SLNRepoRef const repo, uint64_t *const sortID, uint64_
 	return rc;
 }
 
+uint64_t SLNRepoSubmissionLatest(SLNRepoRef const repo) {
+	assert(repo);
+	async_mutex_lock(repo->sub_mutex);
+	uint64_t const latest = repo->sub_latest;
+	async_mutex_unlock(repo->sub_mutex);
+	return latest;
+}
+bool SLNRepoSubmissionUnchanged(SLNRepoRef const repo, uint64_t *const sortID, SLNSubscriberTestCB const test, void *ctx) {
+	assert(repo);
+	assert(sortID);
+	SLNSubscriber s[1] = {{ .test = test, .ctx = ctx, .sortID = *sortID }};
+	async_mutex_lock(repo->sub_mutex);
+	bool const changed = repo->sub_latest > *sortID && log_may_match(repo, s);
+	if(!changed) *sortID = MAX(*sortID, repo->sub_latest);
+	async_mutex_unlock(repo->sub_mutex);
+	return !changed;
+}
+
+// Called with sub_mutex held, which is released while the callbacks run.
+static void fanout(SLNRepoRef const repo) {
+	assert(!repo->sub_fanout);
+	uint64_t const latest = repo->sub_latest;
+	SLNSubscriber *batch = NULL;
+	for(SLNSubscriber *s = repo->sub_waiting; s; s = s->next) {
+		if(s->done || s->sortID >= latest) continue;
+		s->latest = latest;
+		if(!log_may_match(repo, s)) {
+			s->rc = 0;
+			s->done = true;
+			continue;
+		}
+		s->busy = true;
+		s->batch = batch;
+		batch = s;
+	}
+	if(!batch) {
+		async_cond_broadcast(repo->sub_cond);
+		return;
+	}
+	repo->sub_fanout = true;
+	async_mutex_unlock(repo->sub_mutex);
+
+	// Subscribers left over once the budget runs out go back to waiting,
+	// and whoever wakes next picks them up in a new fan-out.
+	DB_env *db = NULL;
+	DB_txn *txn = NULL;
+	SLNRepoDBOpen(repo, &db);
+	int rc = db_txn_begin(db, NULL, DB_RDONLY, &txn);
+	uint64_t const deadline = uv_hrtime() + FANOUT_BUDGET;
+	SLNSubscriber *rest = batch;
+	while(rest) {
+		rest->rc = rc < 0 ? rc : rest->cb(rest->ctx, txn, latest);
+		rest = rest->batch;
+		if(uv_hrtime() >= deadline) break;
+	}
+	db_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, &db);
+
+	async_mutex_lock(repo->sub_mutex);
+	bool done = true;
+	while(batch) {
+		SLNSubscriber *const s = batch;
+		if(s == rest) done = false;
+		batch = s->batch;
+		s->batch = NULL;
+		s->busy = false;
+		s->done = done;
+	}
+	repo->sub_fanout = false;
+	async_cond_broadcast(repo->sub_cond);
+}
+int SLNRepoSubmissionSubscribe(SLNRepoRef const repo, SLNSubscriber *const sub, uint64_t const future) {
+	assert(repo);
+	assert(sub);
+	assert(sub->cb);
+	int rc = 0;
+	async_mutex_lock(repo->sub_mutex);
+	sub->rc = 0;
+	sub->done = false;
+	sub->prev = NULL;
+	sub->next = repo->sub_waiting;
+	if(sub->next) sub->next->prev = sub;
+	repo->sub_waiting = sub;
+	for(;;) {
+		if(sub->done) {
+			rc = sub->rc;
+			break;
+		}
+		if(!repo->sub_fanout && repo->sub_latest > sub->sortID) {
+			fanout(repo);
+			continue;
+		}
+		// Once we're part of a fan-out we can't time out.
+		if(sub->busy) {
+			(void)async_cond_wait(repo->sub_cond, repo->sub_mutex);
+			continue;
+		}
+		if(rc < 0) break;
+		rc = async_cond_timedwait(repo->sub_cond, repo->sub_mutex, future);
+	}
+	if(sub->prev) sub->prev->next = sub->next;
+	else repo->sub_waiting = sub->next;
+	if(sub->next) sub->next->prev = sub->prev;
+	sub->prev = NULL;
+	sub->next = NULL;
+	sub->done = false;
+	async_mutex_unlock(repo->sub_mutex);
+	return rc;
+}
+
+static int commit_batch(SLNSubmissionRef *const all, commit_req *const batch) {
+	size_t total = 0;
+	for(commit_req *r = batch; r; r = r->next) {
+		for(size_t i = 0; i < r->count; i++) {
+			if(r->list[i]) all[total++] = r->list[i];
+		}
+	}
+	return SLNSubmissionStoreBatch(all, total);
+}
+static void commit_lead(SLNRepoRef const repo) {
+	assert(repo->commit_leader);
+	if(repo->commit_pending < COMMIT_MAX) {
+		uint64_t const future = uv_now(async_loop) + COMMIT_DELAY;
+		(void)async_sem_timedwait(repo->commit_full, future);
+	}
+	while(async_sem_trywait(repo->commit_full) >= 0);
+
+	commit_req *batch = repo->commit_head;
+	size_t const pending = repo->commit_pending;
+	repo->commit_head = NULL;
+	repo->commit_tail = NULL;
+	repo->commit_pending = 0;
+	assert(batch);
+
+	SLNSubmissionRef *all = calloc(pending, sizeof(SLNSubmissionRef));
+	int rc = all ? commit_batch(all, batch) : UV_ENOMEM;
+	FREE(&all);
+	for(commit_req *r = batch; r; r = r->next) r->rc = rc;
+	if(rc < 0 && batch->next) {
+		// Don't let one bad submission fail everyone else's.
+		for(commit_req *r = batch; r; r = r->next) {
+			r->rc = SLNSubmissionStoreBatch(r->list, r->count);
+		}
+	}
+
+	// Note: waking a request lets it return and invalidate itself.
+	commit_req *next = NULL;
+	for(commit_req *r = batch; r; r = next) {
+		next = r->next;
+		async_sem_post(r->done);
+	}
+
+	// Hand off to whoever arrived while we were committing.
+	commit_req *const leader = repo->commit_head;
+	if(!leader) {
+		repo->commit_leader = false;
+		return;
+	}
+	leader->lead = true;
+	async_sem_post(leader->done);
+}
+int SLNRepoSubmissionCommit(SLNRepoRef const repo, SLNSubmissionRef const *const list, size_t const count) {
+	assert(repo);
+	if(!count) return 0;
+	commit_req req[1] = {{
+		.list = list,
+		.count = count,
+		.rc = 0,
+		.lead = false,
+		.next = NULL,
+	}};
+	async_sem_init(req->done, 0, 0);
+	if(repo->commit_tail) repo->commit_tail->next = req;
+	else repo->commit_head = req;
+	repo->commit_tail = req;
+	size_t const old = repo->commit_pending;
+	repo->commit_pending += count;
+
+	if(repo->commit_leader) {
+		if(old < COMMIT_MAX && repo->commit_pending >= COMMIT_MAX) {
+			async_sem_post(repo->commit_full);
+		}
+	} else {
+		repo->commit_leader = true;
+		req->lead = true;
+		async_sem_post(req->done);
+	}
+	for(;;) {
+		async_sem_wait(req->done);
+		if(!req->lead) break;
+		req->lead = false;
+		commit_lead(repo);
+	}
+	async_sem_destroy(req->done);
+	return req->rc;
+}
+
 void SLNRepoPullsStart(SLNRepoRef const repo) {
 	if(!repo) return;
 	for(size_t i = 0; i < repo->pull_count; ++i) {
@@ -211,6 +536,36 @@ void SLNRepoPullsStop(SLNRepoRef const repo) {
 	}
 }
 
+int SLNRepoMigrate(SLNRepoRef const repo) {
+	if(!repo) return DB_EINVAL;
+	SLNPostingsMigration postings[1] = {{ NULL, 0, 0, false, false }};
+	SLNBitmapCountsMigration counts[1] = {{ NULL, NULL, 0, 0, 0, false }};
+	DB_env *db = NULL;
+	DB_txn *txn = NULL;
+	int rc = 0;
+	while(!postings->done || !counts->done) {
+		SLNRepoDBOpen(repo, &db);
+		rc = db_txn_begin(db, NULL, DB_RDWR, &txn);
+		if(rc >= 0 && !postings->done) rc = SLNPostingsMigrate(txn, postings, MIGRATE_BATCH);
+		else if(rc >= 0) rc = SLNBitmapMigrateCounts(txn, counts, MIGRATE_BATCH);
+		if(rc >= 0) rc = db_txn_commit(txn);
+		else db_txn_abort(txn);
+		txn = NULL;
+		SLNRepoDBClose(repo, &db);
+		if(rc < 0) break;
+		if(!postings->done) fprintf(stderr, "Migrated %zu full-text postings so far\n", postings->added);
+		else if(!counts->done) fprintf(stderr, "Counted %zu metadata values so far\n", counts->seeded);
+	}
+	FREE(&postings->token);
+	FREE(&counts->field);
+	FREE(&counts->value);
+	if(rc < 0) return rc;
+	fprintf(stderr, "Full-text migration finished (%zu postings written)\n", postings->added);
+	if(postings->kept) fprintf(stderr, "Old full-text rows were left in place (deletion unsupported)\n");
+	fprintf(stderr, "Metadata counts finished (%zu values counted)\n", counts->seeded);
+	return 0;
+}
+
 
 #define PASS_LEN 16
 static int create_admin(SLNRepoRef const repo, DB_txn *const txn) {
@@ -238,10 +593,23 @@ static int create_admin(SLNRepoRef const repo, DB_txn *const txn) {
 
 	return 0;
 }
+// Full-text postings dwarf everything else and are written in big bursts,
+// so they get a large write buffer of their own. File lookups stay hot
+// and get their own cache so index scans can't evict them.
+static DB_partition const partitions[] = {
+	{ "files", SLNFileByID, SLNURIAndFileID+1, 1024 * 1024 * 32, 1024 * 1024 * 16 },
+	{ "meta", SLNMetaFileByID, SLNTermMetaFileIDAndPosition, 0, 0 },
+	{ "terms", SLNTermMetaFileIDAndPosition, SLNFirstUniqueMetaFileID, 0, 1024 * 1024 * 128 },
+	{ "meta", SLNFirstUniqueMetaFileID, SLNTermPostingBlock, 0, 0 },
+	{ "terms", SLNTermPostingBlock, SLNFieldValueMetaFileCount, 0, 0 },
+	{ "meta", SLNFieldValueMetaFileCount, SLNFieldValueFileBitmap+1, 0, 0 },
+};
+
 static int createDBConnection(SLNRepoRef const repo) {
 	assert(repo);
 	int rc = db_env_create(&repo->db);
 	rc = rc < 0 ? rc : db_env_set_mapsize(repo->db, 1024 * 1024 * 1024 * 1);
+	rc = rc < 0 ? rc : db_env_set_partitions(repo->db, partitions, numberof(partitions));
 	if(rc < 0) {
 		fprintf(stderr, "Database setup error (%s)\n", sln_strerror(rc));
 		return rc;
@@ -278,6 +646,20 @@ static int createDBConnection(SLNRepoRef const repo) {
 
 	// TODO: Application-level schema verification
 
+	// Migrations run separately (see SLNRepoMigrate), so opening stays fast.
+	rc = SLNPostingsMigrationPending(txn);
+	if(0 == rc) rc = SLNBitmapCountsMigrationPending(txn);
+	if(rc < 0) {
+		db_txn_abort(txn); txn = NULL;
+		SLNRepoDBClose(repo, &db);
+		fprintf(stderr, "Database migration check error (%s)\n", sln_strerror(rc));
+		return rc;
+	}
+	if(rc > 0) {
+		fprintf(stderr, "Warning: some indexes are in an old format, so searches may be slow or miss older files\n");
+		fprintf(stderr, "Run with --migrate to update them\n");
+	}
+
 	DB_cursor *cursor = NULL;
 	rc = db_txn_cursor(txn, &cursor);
 	if(rc < 0) {
@@ -2,6 +2,7 @@
 // MIT licensed (see LICENSE for details)
 
 #include <assert.h>
+#include <ctype.h>
 #include "common.h"
 #include "StrongLink.h"
 #include "http/HTTPServer.h"
@@ -63,6 +64,86 @@ bool URIPath(strarg_t const URI, strarg_t const path, strarg_t *const qs) {
 	FREE(&cookie);
 	return 0;
 }*/
+// Files are immutable, so clients can cache them forever.
+#define FILE_CACHE_CONTROL "max-age=31536000"
+// More ranges than this and we just send the whole file.
+#define RANGES_MAX 16
+
+struct range {
+	uint64_t offset;
+	uint64_t length;
+};
+
+// Checks a comma-separated list of entity tags, as in If-None-Match.
+// Weak tags (W/"...") only match if weak comparison is allowed.
+static bool etag_match(strarg_t const list, strarg_t const etag, bool const weak) {
+	if(!list) return false;
+	size_t const elen = strlen(etag);
+	strarg_t x = list;
+	for(;;) {
+		while(isspace(*x) || ',' == *x) x++;
+		if('\0' == *x) return false;
+		strarg_t const end = strchr(x, ',');
+		size_t len = end ? (size_t)(end - x) : strlen(x);
+		while(len && isspace(x[len-1])) len--;
+		if(1 == len && '*' == x[0]) return true;
+		if(len >= 2 && 0 == strncmp(x, "W/", 2)) {
+			x += 2;
+			len -= 2;
+			if(!weak) len = 0;
+		}
+		if(len && elen == len && 0 == memcmp(x, etag, len)) return true;
+		if(!end) return false;
+		x = end;
+	}
+}
+static bool read_uint64(strarg_t *const str, uint64_t *const out) {
+	strarg_t x = *str;
+	if(!isdigit(*x)) return false;
+	uint64_t val = 0;
+	for(; isdigit(*x); x++) {
+		uint64_t const d = *x - '0';
+		if(val > (UINT64_MAX - d) / 10) return false;
+		val = val * 10 + d;
+	}
+	*str = x;
+	*out = val;
+	return true;
+}
+// Parses a Range header (RFC 7233). Returns the number of satisfiable
+// ranges, which may be zero, or UV_EINVAL if the header should be ignored.
+static ssize_t parse_ranges(strarg_t const str, uint64_t const size, struct range *const out, size_t const max) {
+	strarg_t x = str;
+	if(0 != strncasecmp(x, "bytes=", 6)) return UV_EINVAL;
+	x += 6;
+	size_t count = 0;
+	for(;;) {
+		while(isspace(*x) || ',' == *x) x++;
+		if('\0' == *x) break;
+		uint64_t first = 0, last = UINT64_MAX;
+		if('-' == *x) {
+			// Suffix range, the last n bytes.
+			x++;
+			uint64_t n;
+			if(!read_uint64(&x, &n)) return UV_EINVAL;
+			if(0 == n || 0 == size) continue;
+			first = size - MIN(n, size);
+		} else {
+			if(!read_uint64(&x, &first)) return UV_EINVAL;
+			if('-' != *x++) return UV_EINVAL;
+			if(isdigit(*x) && !read_uint64(&x, &last)) return UV_EINVAL;
+			if(last < first) return UV_EINVAL;
+		}
+		while(isspace(*x)) x++;
+		if('\0' != *x && ',' != *x) return UV_EINVAL;
+		if(first >= size) continue;
+		if(count >= max) return UV_EINVAL;
+		last = MIN(last, size-1);
+		out[count++] = (struct range){ first, last - first + 1 };
+	}
+	return count;
+}
+
 static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
 	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
 	int len = 0;
@@ -74,8 +155,6 @@ static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConn
 	if(!algo[0] || !hash[0]) return -1;
 	if('\0' != URI[len] && '?' != URI[len]) return -1;
 
-	// TODO: Check for conditional get headers and return 304 Not Modified.
-
 	str_t fileURI[SLN_URI_MAX];
 	int rc = snprintf(fileURI, sizeof(fileURI), "hash://%s/%s", algo, hash);
 	if(rc < 0 || rc >= sizeof(fileURI)) return 500;
@@ -86,14 +165,53 @@ static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConn
 	if(DB_NOTFOUND == rc) return 404;
 	if(rc < 0) return 500;
 
-	uv_file file = async_fs_open(info->path, O_RDONLY, 0000);
+	uv_file file = -1;
+	str_t *parts[RANGES_MAX] = {};
+	int status = 0;
+
+	// The internal hash identifies the content, so it makes a strong ETag.
+	str_t etag[SLN_HASH_SIZE+2];
+	rc = snprintf(etag, sizeof(etag), "\"%s\"", info->hash);
+	if(rc < 0 || rc >= sizeof(etag)) {
+		status = 500;
+		goto cleanup;
+	}
+
+	if(etag_match(HTTPHeadersGet(headers, "If-None-Match"), etag, true)) {
+		HTTPConnectionWriteResponse(conn, 304, "Not Modified");
+		HTTPConnectionWriteHeader(conn, "Cache-Control", FILE_CACHE_CONTROL);
+		HTTPConnectionWriteHeader(conn, "ETag", etag);
+		HTTPConnectionBeginBody(conn);
+		HTTPConnectionEnd(conn);
+		goto cleanup;
+	}
+
+	struct range ranges[RANGES_MAX];
+	ssize_t nranges = UV_EINVAL; // Whole file.
+	strarg_t const range = HTTPHeadersGet(headers, "Range");
+	strarg_t const ifrange = HTTPHeadersGet(headers, "If-Range");
+	if(range && (!ifrange || etag_match(ifrange, etag, false))) {
+		nranges = parse_ranges(range, info->size, ranges, numberof(ranges));
+	}
+	if(0 == nranges) {
+		str_t unsatisfied[32];
+		snprintf(unsatisfied, sizeof(unsatisfied), "bytes */%llu", (unsigned long long)info->size);
+		HTTPConnectionWriteResponse(conn, 416, "Range Not Satisfiable");
+		HTTPConnectionWriteHeader(conn, "Content-Range", unsatisfied);
+		HTTPConnectionWriteContentLength(conn, 0);
+		HTTPConnectionBeginBody(conn);
+		HTTPConnectionEnd(conn);
+		goto cleanup;
+	}
+
+	file = async_fs_open(info->path, O_RDONLY, 0000);
 	if(UV_ENOENT == file) {
-		SLNFileInfoCleanup(info);
-		return 410; // Gone
+		status = 410; // Gone
+		goto cleanup;
 	}
 	if(file < 0) {
-		SLNFileInfoCleanup(info);
-		return 500;
+		status = 500;
+		goto cleanup;
 	}
 
 	// TODO: Hosting untrusted data is really hard.
@@ -110,26 +228,90 @@ static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConn
 	// TODO: Use Content-Disposition to suggest a filename, for file types
 	// that aren't useful to view inline.
 
-	HTTPConnectionWriteResponse(conn, 200, "OK");
-	HTTPConnectionWriteContentLength(conn, info->size);
-	HTTPConnectionWriteHeader(conn, "Content-Type", info->type);
-	HTTPConnectionWriteHeader(conn, "Cache-Control", "max-age=31536000");
-	HTTPConnectionWriteHeader(conn, "ETag", "1");
-//	HTTPConnectionWriteHeader(conn, "Accept-Ranges", "bytes"); // TODO
+	// Multiple ranges are sent as multipart/byteranges. The boundary
+	// can't appear in the file because it's a hash of the content.
+	str_t *const boundary = info->hash;
+	uint64_t length = info->size;
+	if(nranges > 1) {
+		length = 0;
+		for(size_t i = 0; i < nranges; i++) {
+			parts[i] = aasprintf("\r\n--%s\r\n"
+				"Content-Type: %s\r\n"
+				"Content-Range: bytes %llu-%llu/%llu\r\n"
+				"\r\n",
+				boundary, info->type,
+				(unsigned long long)ranges[i].offset,
+				(unsigned long long)(ranges[i].offset + ranges[i].length - 1),
+				(unsigned long long)info->size);
+			if(!parts[i]) {
+				status = 500;
+				goto cleanup;
+			}
+			length += strlen(parts[i]) + ranges[i].length;
+		}
+		length += sizeof("\r\n--")-1 + strlen(boundary) + sizeof("--\r\n")-1;
+	} else if(1 == nranges) {
+		length = ranges[0].length;
+	}
+
+	if(nranges > 0) {
+		HTTPConnectionWriteResponse(conn, 206, "Partial Content");
+	} else {
+		HTTPConnectionWriteResponse(conn, 200, "OK");
+	}
+	HTTPConnectionWriteContentLength(conn, length);
+	if(nranges > 1) {
+		str_t *type = aasprintf("multipart/byteranges; boundary=%s", boundary);
+		HTTPConnectionWriteHeader(conn, "Content-Type", type ? type : "");
+		FREE(&type);
+	} else {
+		HTTPConnectionWriteHeader(conn, "Content-Type", info->type);
+	}
+	if(1 == nranges) {
+		str_t *crange = aasprintf("bytes %llu-%llu/%llu",
+			(unsigned long long)ranges[0].offset,
+			(unsigned long long)(ranges[0].offset + ranges[0].length - 1),
+			(unsigned long long)info->size);
+		HTTPConnectionWriteHeader(conn, "Content-Range", crange ? crange : "");
+		FREE(&crange);
+	}
+	HTTPConnectionWriteHeader(conn, "Cache-Control", FILE_CACHE_CONTROL);
+	HTTPConnectionWriteHeader(conn, "ETag", etag);
+	HTTPConnectionWriteHeader(conn, "Accept-Ranges", "bytes");
 	HTTPConnectionWriteHeader(conn, "Content-Security-Policy", "'none'");
 	HTTPConnectionWriteHeader(conn, "X-Content-Type-Options", "nosniff");
-//	HTTPConnectionWriteHeader(conn, "Vary", "Accept, Accept-Ranges");
-	// TODO: Double check Vary header syntax.
-	// Also do we need to change the ETag?
 	HTTPConnectionBeginBody(conn);
 	if(HTTP_HEAD != method) {
-		HTTPConnectionWriteFile(conn, file);
+		// Once the body has started, errors can only drop the connection,
+		// which the socket already takes care of.
+		if(nranges < 0) {
+			rc = HTTPConnectionWriteFileRange(conn, file, 0, info->size);
+		} else if(1 == nranges) {
+			rc = HTTPConnectionWriteFileRange(conn, file, ranges[0].offset, ranges[0].length);
+		} else for(size_t i = 0; i < nranges; i++) {
+			rc = HTTPConnectionWrite(conn, (byte_t const *)parts[i], strlen(parts[i]));
+			if(rc < 0) break;
+			rc = HTTPConnectionWriteFileRange(conn, file, ranges[i].offset, ranges[i].length);
+			if(rc < 0) break;
+		}
+		if(rc < 0) goto cleanup;
+		if(nranges > 1) {
+			uv_buf_t end[] = {
+				uv_buf_init((char *)STR_LEN("\r\n--")),
+				uv_buf_init(boundary, strlen(boundary)),
+				uv_buf_init((char *)STR_LEN("--\r\n")),
+			};
+			HTTPConnectionWritev(conn, end, numberof(end));
+		}
 	}
 	HTTPConnectionEnd(conn);
 
+cleanup:
+	for(size_t i = 0; i < numberof(parts); i++) FREE(&parts[i]);
+	if(file >= 0) async_fs_close(file);
+	file = -1;
 	SLNFileInfoCleanup(info);
-	async_fs_close(file);
-	return 0;
+	return status;
 }
 static int GET_meta(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
 	// TODO: This is pretty much copy and pasted from above.
@@ -187,7 +369,7 @@ static int accept_sub(SLNSessionRef const session, strarg_t const knownURI, HTTP
 	}
 	rc = SLNSubmissionEnd(sub);
 	if(rc < 0) goto cleanup;
-	rc = SLNSubmissionStoreBatch(&sub, 1);
+	rc = SLNRepoSubmissionCommit(SLNSessionGetRepo(session), &sub, 1);
 	if(rc < 0) goto cleanup;
 	strarg_t const location = SLNSubmissionGetPrimaryURI(sub);
 	if(!location) rc = UV_ENOMEM;
@@ -245,35 +427,112 @@ cleanup:
 	return 0;
 }
 
-static void sendURIList(SLNSessionRef const session, SLNFilterRef const filter, strarg_t const qs, bool const meta, HTTPConnectionRef const conn) {
+// Server-sent events (text/event-stream) for browsers. Each URI becomes
+// one event, and the blank lines we send to keep the connection alive
+// become comments. Plain URIs are also used as event IDs, so that clients
+// can resume with Last-Event-ID after reconnecting.
+typedef struct {
+	HTTPConnectionRef conn;
+	bool meta;
+} event_stream;
+static int write_events(event_stream *const stream, uv_buf_t const parts[], unsigned int const count) {
+	uv_buf_t *events = calloc(count*5, sizeof(uv_buf_t));
+	if(!events) return UV_ENOMEM;
+	unsigned int n = 0;
+	bool line = false;
+	for(unsigned int i = 0; i < count; i++) {
+		if(2 != parts[i].len || 0 != memcmp(parts[i].base, "\r\n", 2)) {
+			if(!stream->meta) {
+				events[n++] = uv_buf_init((char *)STR_LEN("id: "));
+				events[n++] = parts[i];
+				events[n++] = uv_buf_init((char *)STR_LEN("\n"));
+			}
+			events[n++] = uv_buf_init((char *)STR_LEN("data: "));
+			events[n++] = parts[i];
+			line = true;
+		} else if(line) {
+			events[n++] = uv_buf_init((char *)STR_LEN("\n\n"));
+			line = false;
+		} else {
+			events[n++] = uv_buf_init((char *)STR_LEN(":\n\n"));
+		}
+	}
+	assert(n <= count*5);
+	int rc = HTTPConnectionWriteChunkv(stream->conn, events, n);
+	FREE(&events);
+	return rc;
+}
+static int flush_events(event_stream *const stream) {
+	return HTTPConnectionFlush(stream->conn);
+}
+
+static int sendURIList(SLNSessionRef const session, SLNFilterRef const filter, strarg_t const qs, bool const meta, HTTPConnectionRef const conn, HTTPHeadersRef const headers) {
 	SLNFilterPosition pos[1] = {{ .dir = +1 }};
 	uint64_t count = UINT64_MAX;
 	bool wait = true;
 	SLNFilterParseOptions(qs, pos, &count, NULL, &wait);
+	if(!SLNFilterPositionMatches(filter, pos)) {
+		// Expired, forged, or issued for a different query.
+		SLNFilterPositionCleanup(pos);
+		return 400;
+	}
+
+	strarg_t const accept = HTTPHeadersGet(headers, "Accept");
+	bool const events = accept && strstr(accept, "text/event-stream");
+	strarg_t const lastID = HTTPHeadersGet(headers, "Last-Event-ID");
+	if(events && !meta && lastID && '\0' != lastID[0] && !pos->URI && pos->dir > 0) {
+		pos->URI = strdup(lastID);
+	}
 
 	// I'm aware that we're abusing HTTP for sending real-time push data.
-	// I'd also like to support WebSocket at some point, but this is simpler
-	// and frankly probably more widely supported.
+	// Browsers can ask for server-sent events instead, which is the same
+	// thing with standard framing.
 	// Note that the protocol doesn't really break even if this data is
 	// cached. It DOES break if a proxy tries to buffer the whole response
 	// before passing it back to the client. I'd be curious to know whether
 	// such proxies still exist in 2015.
 	HTTPConnectionWriteResponse(conn, 200, "OK");
 	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
-	HTTPConnectionWriteHeader(conn,
-		"Content-Type", "text/uri-list; charset=utf-8");
+	if(events) {
+		HTTPConnectionWriteHeader(conn,
+			"Content-Type", "text/event-stream; charset=utf-8");
+	} else {
+		HTTPConnectionWriteHeader(conn,
+			"Content-Type", "text/uri-list; charset=utf-8");
+	}
 	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
 	HTTPConnectionWriteHeader(conn, "Vary", "*");
 	HTTPConnectionBeginBody(conn);
 
-	int rc = SLNFilterWriteURIs(filter, session, pos, meta, count, wait, (SLNFilterWriteCB)HTTPConnectionWriteChunkv, (SLNFilterFlushCB)HTTPConnectionFlush, conn);
+	int rc;
+	if(events) {
+		event_stream stream[1] = {{ conn, meta }};
+		rc = SLNFilterWriteURIs(filter, session, pos, meta, count, wait, (SLNFilterWriteCB)write_events, (SLNFilterFlushCB)flush_events, stream);
+	} else {
+		rc = SLNFilterWriteURIs(filter, session, pos, meta, count, wait, (SLNFilterWriteCB)HTTPConnectionWriteChunkv, (SLNFilterFlushCB)HTTPConnectionFlush, conn);
+	}
 	if(rc < 0) {
 		fprintf(stderr, "Query response error %s\n", sln_strerror(rc));
 	}
 
+	// Clients that stopped early can pass this back as `start` to pick
+	// up where we left off without looking up the last URI again.
+	// Lines beginning with # are comments in text/uri-list.
+	str_t *token = rc >= 0 && !events ? SLNFilterPositionCopyToken(filter, pos) : NULL;
+	if(token) {
+		uv_buf_t parts[] = {
+			uv_buf_init((char *)STR_LEN("#start=")),
+			uv_buf_init(token, strlen(token)),
+			uv_buf_init((char *)STR_LEN("\r\n")),
+		};
+		HTTPConnectionWriteChunkv(conn, parts, numberof(parts));
+		FREE(&token);
+	}
+
 	HTTPConnectionWriteChunkEnd(conn);
 	HTTPConnectionEnd(conn);
 	SLNFilterPositionCleanup(pos);
+	return 0;
 }
 static int parseFilter(SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, HTTPHeadersRef const headers, SLNFilterRef *const out) {
 	assert(HTTP_POST == method);
@@ -314,9 +573,9 @@ static int GET_query(SLNRepoRef const repo, SLNSessionRef const session, HTTPCon
 	if(DB_EACCES == rc) return 403;
 	if(rc < 0) return 500;
 
-	sendURIList(session, filter, qs, false, conn);
+	rc = sendURIList(session, filter, qs, false, conn, headers);
 	SLNFilterFree(&filter);
-	return 0;
+	return rc;
 }
 static int POST_query(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
 	if(HTTP_POST != method) return -1;
@@ -327,9 +586,9 @@ static int POST_query(SLNRepoRef const repo, SLNSessionRef const session, HTTPCo
 	int rc = parseFilter(session, conn, method, headers, &filter);
 	if(DB_EACCES == rc) return 403;
 	if(rc < 0) return 500;
-	sendURIList(session, filter, qs, false, conn);
+	rc = sendURIList(session, filter, qs, false, conn, headers);
 	SLNFilterFree(&filter);
-	return 0;
+	return rc;
 }
 static int GET_metafiles(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
 	if(HTTP_GET != method) return -1;
@@ -340,9 +599,9 @@ static int GET_metafiles(SLNRepoRef const repo, SLNSessionRef const session, HTT
 	int rc = SLNFilterCreate(session, SLNMetaFileFilterType, &filter);
 	if(DB_EACCES == rc) return 403;
 	if(rc < 0) return 500;
-	sendURIList(session, filter, qs, true, conn);
+	rc = sendURIList(session, filter, qs, true, conn, headers);
 	SLNFilterFree(&filter);
-	return 0;
+	return rc;
 }
 static int GET_all(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
 	if(HTTP_GET != method) return -1;
@@ -353,8 +612,109 @@ static int GET_all(SLNRepoRef const repo, SLNSessionRef const session, HTTPConne
 	int rc = SLNFilterCreate(session, SLNAllFilterType, &filter);
 	if(DB_EACCES == rc) return 403;
 	if(rc < 0) return 500;
-	sendURIList(session, filter, qs, false, conn);
+	rc = sendURIList(session, filter, qs, false, conn, headers);
+	SLNFilterFree(&filter);
+	return rc;
+}
+
+static bool parse_estimate(strarg_t const str) {
+	if(!str) return false;
+	if(0 == strcasecmp(str, "0")) return false;
+	if(0 == strcasecmp(str, "no")) return false;
+	if(0 == strcasecmp(str, "false")) return false;
+	return true;
+}
+// Plain text, so that dashboards can poll it without parsing URIs.
+static int sendCount(SLNSessionRef const session, SLNFilterRef const filter, bool const estimate, HTTPConnectionRef const conn) {
+	uint64_t count = 0;
+	int rc = estimate ?
+		SLNFilterEstimate(filter, session, &count) :
+		SLNFilterCount(filter, session, &count);
+	if(DB_EACCES == rc) return 403;
+	if(rc < 0) return 500;
+	str_t body[32];
+	int const len = snprintf(body, sizeof(body), "%llu\n", (unsigned long long)count);
+	assert(len > 0 && len < sizeof(body));
+	HTTPConnectionWriteResponse(conn, 200, "OK");
+	HTTPConnectionWriteHeader(conn, "Content-Type", "text/plain; charset=utf-8");
+	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
+	if(estimate) HTTPConnectionWriteHeader(conn, "X-Estimate", "1");
+	HTTPConnectionWriteContentLength(conn, len);
+	HTTPConnectionBeginBody(conn);
+	HTTPConnectionWrite(conn, (byte_t const *)body, len);
+	HTTPConnectionEnd(conn);
+	return 0;
+}
+static int GET_count(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(HTTP_GET != method) return -1;
+	strarg_t qs;
+	if(!URIPath(URI, "/sln/count", &qs)) return -1;
+
+	SLNFilterRef filter = NULL;
+	int rc;
+
+	static strarg_t const fields[] = { "q", "estimate" };
+	str_t *values[numberof(fields)] = {};
+	QSValuesParse(qs, values, fields, numberof(fields));
+	rc = SLNUserFilterParse(session, values[0], &filter);
+	bool const estimate = parse_estimate(values[1]);
+	QSValuesCleanup(values, numberof(values));
+	if(DB_EINVAL == rc) rc = SLNFilterCreate(session, SLNVisibleFilterType, &filter);
+	if(DB_EACCES == rc) return 403;
+	if(rc < 0) return 500;
+
+	rc = sendCount(session, filter, estimate, conn);
+	SLNFilterFree(&filter);
+	return rc;
+}
+static int POST_count(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(HTTP_POST != method) return -1;
+	strarg_t qs;
+	if(!URIPath(URI, "/sln/count", &qs)) return -1;
+
+	static strarg_t const fields[] = { "estimate" };
+	str_t *values[numberof(fields)] = {};
+	QSValuesParse(qs, values, fields, numberof(fields));
+	bool const estimate = parse_estimate(values[0]);
+	QSValuesCleanup(values, numberof(values));
+
+	SLNFilterRef filter;
+	int rc = parseFilter(session, conn, method, headers, &filter);
+	if(DB_EACCES == rc) return 403;
+	if(rc < 0) return 500;
+	rc = sendCount(session, filter, estimate, conn);
 	SLNFilterFree(&filter);
+	return rc;
+}
+static int GET_stats(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(HTTP_GET != method) return -1;
+	if(!URIPath(URI, "/sln/stats", NULL)) return -1;
+	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return 403;
+
+	SLNQueryCacheStats stats[1];
+	SLNQueryCacheGetStats(SLNRepoGetQueryCache(repo), stats);
+	str_t *body = aasprintf(
+		"query-cache-hits: %llu\n"
+		"query-cache-misses: %llu\n"
+		"query-cache-revalidations: %llu\n"
+		"query-cache-evictions: %llu\n"
+		"query-cache-entries: %llu/%llu\n",
+		(unsigned long long)stats->hits,
+		(unsigned long long)stats->misses,
+		(unsigned long long)stats->revalidations,
+		(unsigned long long)stats->evictions,
+		(unsigned long long)stats->entries,
+		(unsigned long long)stats->size);
+	if(!body) return 500;
+	size_t const len = strlen(body);
+	HTTPConnectionWriteResponse(conn, 200, "OK");
+	HTTPConnectionWriteHeader(conn, "Content-Type", "text/plain; charset=utf-8");
+	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
+	HTTPConnectionWriteContentLength(conn, len);
+	HTTPConnectionBeginBody(conn);
+	HTTPConnectionWrite(conn, (byte_t const *)body, len);
+	HTTPConnectionEnd(conn);
+	FREE(&body);
 	return 0;
 }
 
@@ -371,6 +731,9 @@ int SLNServerDispatch(SLNRepoRef const repo, SLNSessionRef const session, HTTPCo
 	rc = rc >= 0 ? rc : POST_query(repo, session, conn, method, URI, headers);
 	rc = rc >= 0 ? rc : GET_metafiles(repo, session, conn, method, URI, headers);
 	rc = rc >= 0 ? rc : GET_all(repo, session, conn, method, URI, headers);
+	rc = rc >= 0 ? rc : GET_count(repo, session, conn, method, URI, headers);
+	rc = rc >= 0 ? rc : POST_count(repo, session, conn, method, URI, headers);
+	rc = rc >= 0 ? rc : GET_stats(repo, session, conn, method, URI, headers);
 	if(rc >= 0) return rc;
 
 	// We "own" the /sln prefix.
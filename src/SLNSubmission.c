@@ -6,6 +6,15 @@
 #include <fcntl.h>
 #include "StrongLink.h"
 #include "SLNDB.h"
+#include "SLNBitmap.h"
+
+// Incoming data is collected and written out in large batches so that
+// uploads don't hop onto the thread pool (and make a syscall) for every
+// small buffer read from the socket.
+// The buffer starts small and grows so that tiny submissions (like most
+// meta-files) don't pay for it.
+#define WRITE_BUFFER_MIN (1024 * 16)
+#define WRITE_BUFFER_SIZE (1024 * 256)
 
 struct SLNSubmission {
 	SLNSessionRef session;
@@ -15,6 +24,9 @@ struct SLNSubmission {
 	str_t *tmppath;
 	uv_file tmpfile;
 	uint64_t size;
+	byte_t *buf;
+	size_t used;
+	size_t cap;
 
 	SLNHasherRef hasher;
 	uint64_t metaFileID;
@@ -24,7 +36,7 @@ struct SLNSubmission {
 	str_t *internalHash;
 };
 
-int SLNSubmissionParseMetaFile(SLNSubmissionRef const sub, uint64_t const fileID, DB_txn *const txn, uint64_t *const out);
+int SLNSubmissionParseMetaFile(SLNSubmissionRef const sub, uint64_t const fileID, DB_txn *const txn, SLNChanges *const changes, uint64_t *const out);
 
 int SLNSubmissionCreate(SLNSessionRef const session, strarg_t const knownURI, strarg_t const type, SLNSubmissionRef *const out) {
 	assert(out);
@@ -84,6 +96,9 @@ void SLNSubmissionFree(SLNSubmissionRef *const subptr) {
 	if(sub->tmpfile >= 0) async_fs_close(sub->tmpfile);
 	sub->tmpfile = 0;
 	sub->size = 0;
+	FREE(&sub->buf);
+	sub->used = 0;
+	sub->cap = 0;
 
 	SLNHasherFree(&sub->hasher);
 	sub->metaFileID = 0;
@@ -110,19 +125,50 @@ uv_file SLNSubmissionGetFile(SLNSubmissionRef const sub) {
 	return sub->tmpfile;
 }
 
-int SLNSubmissionWrite(SLNSubmissionRef const sub, byte_t const *const buf, size_t const len) {
-	if(!sub) return 0;
-	assert(sub->tmpfile >= 0);
-
-	uv_buf_t parts[] = { uv_buf_init((char *)buf, len) };
+// Writes out any buffered data followed by `buf` in a single call.
+static int flush(SLNSubmissionRef const sub, byte_t const *const buf, size_t const len) {
+	if(!sub->used && !len) return 0;
+	uv_buf_t parts[] = {
+		uv_buf_init((char *)sub->buf, sub->used),
+		uv_buf_init((char *)buf, len),
+	};
 	int rc = async_fs_writeall(sub->tmpfile, parts, numberof(parts), -1);
 	if(rc < 0) {
 		fprintf(stderr, "SLNSubmission write error %s\n", sln_strerror(rc));
 		return rc;
 	}
+	SLNHasherWrite(sub->hasher, sub->buf, sub->used);
+	SLNHasherWrite(sub->hasher, buf, len);
+	sub->used = 0;
+	return 0;
+}
+int SLNSubmissionWrite(SLNSubmissionRef const sub, byte_t const *const buf, size_t const len) {
+	if(!sub) return 0;
+	assert(sub->tmpfile >= 0);
+	assert(sub->tmppath);
+
+	if(sub->used + len > sub->cap && sub->cap < WRITE_BUFFER_SIZE) {
+		size_t cap = MAX(sub->cap * 2, WRITE_BUFFER_MIN);
+		while(cap < sub->used + len && cap < WRITE_BUFFER_SIZE) cap *= 2;
+		cap = MIN(cap, WRITE_BUFFER_SIZE);
+		byte_t *const tmp = realloc(sub->buf, cap);
+		if(!tmp) return UV_ENOMEM;
+		sub->buf = tmp;
+		sub->cap = cap;
+	}
+	if(sub->used + len > sub->cap) {
+		int rc = flush(sub, buf, len);
+		if(rc < 0) return rc;
+	} else {
+		memcpy(sub->buf + sub->used, buf, len);
+		sub->used += len;
+		if(sub->used >= WRITE_BUFFER_SIZE) {
+			int rc = flush(sub, NULL, 0);
+			if(rc < 0) return rc;
+		}
+	}
 
 	sub->size += len;
-	SLNHasherWrite(sub->hasher, buf, len);
 	return 0;
 }
 static int verify(SLNSubmissionRef const sub) {
@@ -143,6 +189,11 @@ int SLNSubmissionEnd(SLNSubmissionRef const sub) {
 	assert(sub->tmppath);
 	assert(sub->tmpfile >= 0);
 
+	int rc = flush(sub, NULL, 0);
+	if(rc < 0) return rc;
+	FREE(&sub->buf);
+	sub->cap = 0;
+
 	sub->URIs = SLNHasherEnd(sub->hasher);
 	sub->internalHash = strdup(SLNHasherGetInternalHash(sub->hasher));
 	SLNHasherFree(&sub->hasher);
@@ -151,7 +202,6 @@ int SLNSubmissionEnd(SLNSubmissionRef const sub) {
 	SLNRepoRef const repo = SLNSubmissionGetRepo(sub);
 	str_t *internalPath = NULL;
 	bool worker = false;
-	int rc = 0;
 
 	rc = verify(sub);
 	if(rc < 0) goto cleanup;
@@ -178,7 +228,8 @@ int SLNSubmissionEnd(SLNSubmissionRef const sub) {
 		goto cleanup;
 	}
 
-	rc = async_fs_sync_dirname(internalPath);
+	// The directory is synced later by SLNSubmissionStoreBatch, once
+	// for every file in the batch with the same hash prefix.
 
 cleanup:
 	if(worker) { async_pool_leave(NULL); worker = false; }
@@ -225,7 +276,7 @@ int SLNSubmissionGetFileInfo(SLNSubmissionRef const sub, SLNFileInfo *const info
 	return 0;
 }
 
-int SLNSubmissionStore(SLNSubmissionRef const sub, DB_txn *const txn) {
+static int store(SLNSubmissionRef const sub, DB_txn *const txn, SLNChanges *const changes) {
 	assert(sub);
 	assert(txn);
 	assert(!sub->tmppath);
@@ -240,6 +291,7 @@ int SLNSubmissionStore(SLNSubmissionRef const sub, DB_txn *const txn) {
 	DB_val fileInfo_key[1];
 	SLNFileIDByInfoKeyPack(fileInfo_key, txn, sub->internalHash, sub->type);
 	rc = db_put(txn, fileInfo_key, dupFileID_val, DB_NOOVERWRITE);
+	bool const dup = DB_KEYEXIST == rc;
 	if(rc >= 0) {
 		DB_val fileID_key[1];
 		SLNFileByIDKeyPack(fileID_key, txn, fileID);
@@ -260,13 +312,24 @@ int SLNSubmissionStore(SLNSubmissionRef const sub, DB_txn *const txn) {
 		rc = db_put(txn, fwd, &null, DB_NOOVERWRITE_FAST);
 		if(rc < 0 && DB_KEYEXIST != rc) return rc;
 
+		// A new file can't have this row yet. For a duplicate we have to
+		// check, so that it isn't counted in the bitmaps twice.
 		DB_val rev[1];
 		SLNURIAndFileIDKeyPack(rev, txn, URI, fileID);
-		rc = db_put(txn, rev, &null, DB_NOOVERWRITE_FAST);
+		rc = db_put(txn, rev, &null, dup ? DB_NOOVERWRITE : DB_NOOVERWRITE_FAST);
 		if(rc < 0 && DB_KEYEXIST != rc) return rc;
+		bool const added = DB_KEYEXIST != rc;
+
+		// Meta-files can arrive before the files they describe.
+		if(added) {
+			rc = SLNBitmapAddFile(txn, fileID, URI);
+			if(rc < 0) return rc;
+		}
+
+		SLNChangesAdd(changes, "", URI);
 	}
 
-	rc = SLNSubmissionParseMetaFile(sub, fileID, txn, &sub->metaFileID);
+	rc = SLNSubmissionParseMetaFile(sub, fileID, txn, changes, &sub->metaFileID);
 	if(rc < 0) {
 		fprintf(stderr, "Submission meta-file error %s\n", sln_strerror(rc));
 		return rc;
@@ -274,25 +337,96 @@ int SLNSubmissionStore(SLNSubmissionRef const sub, DB_txn *const txn) {
 
 	return 0;
 }
+int SLNSubmissionStore(SLNSubmissionRef const sub, DB_txn *const txn) {
+	return store(sub, txn, NULL);
+}
+typedef struct {
+	str_t *path;
+	int rc;
+	async_sem_t *done;
+} dir_sync;
+static void sync_dir(void *const arg) {
+	dir_sync *const d = arg;
+	d->rc = async_fs_sync_dirname(d->path);
+	if(d->done) async_sem_post(d->done);
+}
+// Files are linked into data/xx/ without syncing the directory. Before
+// any transaction references them, sync each distinct directory once,
+// all in parallel.
+static int sync_dirs(SLNSubmissionRef const *const list, size_t const count) {
+	SLNRepoRef const repo = SLNSessionGetRepo(list[0]->session);
+	dir_sync *dirs = calloc(count, sizeof(dir_sync));
+	if(!dirs) return UV_ENOMEM;
+	async_sem_t done[1];
+	async_sem_init(done, 0, 0);
+	size_t n = 0;
+	size_t spawned = 0;
+	int rc = 0;
+	for(size_t i = 0; i < count; i++) {
+		if(!list[i]) continue;
+		strarg_t const hash = list[i]->internalHash;
+		assert(hash);
+		bool dup = false;
+		for(size_t j = 0; j < i; j++) {
+			if(!list[j]) continue;
+			if(0 != strncmp(hash, list[j]->internalHash, 2)) continue;
+			dup = true;
+			break;
+		}
+		if(dup) continue;
+		dirs[n].path = SLNRepoCopyInternalPath(repo, hash);
+		if(!dirs[n].path) {
+			rc = UV_ENOMEM;
+			break;
+		}
+		// Fibers can't be spawned from the thread pool.
+		if(async_pool_get_worker()) {
+			sync_dir(&dirs[n++]);
+			continue;
+		}
+		dirs[n].done = done;
+		if(async_spawn(STACK_DEFAULT, sync_dir, &dirs[n]) < 0) {
+			dirs[n].done = NULL;
+			sync_dir(&dirs[n]);
+		} else spawned++;
+		n++;
+	}
+	for(; spawned > 0; spawned--) async_sem_wait(done);
+	async_sem_destroy(done);
+	for(size_t i = 0; i < n; i++) {
+		if(rc >= 0 && dirs[i].rc < 0) rc = dirs[i].rc;
+		FREE(&dirs[i].path);
+	}
+	FREE(&dirs);
+	return rc;
+}
 int SLNSubmissionStoreBatch(SLNSubmissionRef const *const list, size_t const count) {
 	if(!count) return 0;
 	// Session permissions were already checked when the sub was created.
 
-	SLNRepoRef const repo = SLNSessionGetRepo(list[0]->session);
+	size_t first = 0;
+	while(first < count && !list[first]) first++;
+	if(first >= count) return 0;
+	int rc = sync_dirs(list+first, count-first);
+	if(rc < 0) return rc;
+
+	SLNRepoRef const repo = SLNSessionGetRepo(list[first]->session);
 	DB_env *db = NULL;
 	SLNRepoDBOpen(repo, &db);
 	DB_txn *txn = NULL;
-	int rc = db_txn_begin(db, NULL, DB_RDWR, &txn);
+	rc = db_txn_begin(db, NULL, DB_RDWR, &txn);
 	if(rc < 0) {
 		SLNRepoDBClose(repo, &db);
 		return rc;
 	}
+	// If this allocation fails, waiters just can't skip this batch.
+	SLNChanges *changes = calloc(1, sizeof(SLNChanges));
 	uint64_t sortID = 0;
 	rc = DB_NOTFOUND;
 	for(size_t i = 0; i < count; i++) {
 		if(!list[i]) continue;
 		assert(repo == SLNSessionGetRepo(list[i]->session));
-		rc = SLNSubmissionStore(list[i], txn);
+		rc = store(list[i], txn, changes);
 		if(rc < 0) break;
 		uint64_t const metaFileID = list[i]->metaFileID;
 		if(metaFileID > sortID) sortID = metaFileID;
@@ -303,7 +437,8 @@ int SLNSubmissionStoreBatch(SLNSubmissionRef const *const list, size_t const cou
 		db_txn_abort(txn); txn = NULL;
 	}
 	SLNRepoDBClose(repo, &db);
-	if(rc >= 0) SLNRepoSubmissionEmit(repo, sortID);
+	if(rc >= 0) SLNRepoSubmissionEmit(repo, sortID, changes);
+	FREE(&changes);
 	return rc;
 }
 
@@ -5,6 +5,9 @@
 #include "util/fts.h"
 #include "StrongLink.h"
 #include "SLNDB.h"
+#include "SLNPostings.h"
+#include "SLNBitmap.h"
+#include "../deps/libressl-portable/include/compat/stdlib.h"
 
 #define BUF_LEN (1024 * 8)
 #define PARSE_MAX (1024 * 1024 * 1)
@@ -16,19 +19,21 @@ typedef struct {
 	DB_txn *txn;
 	int64_t metaFileID;
 	strarg_t targetURI;
+	SLNChanges *changes;
 	str_t *fields[DEPTH_MAX];
 	int depth;
+	uint64_t position; // Next full-text word position.
 } parser_t;
 
 static yajl_callbacks const callbacks;
 
 // TODO: Error handling.
 static uint64_t add_metafile(DB_txn *const txn, uint64_t const fileID, strarg_t const targetURI);
-static void add_metadata(DB_txn *const txn, uint64_t const metaFileID, strarg_t const field, strarg_t const value);
-static void add_fulltext(DB_txn *const txn, uint64_t const metaFileID, strarg_t const str, size_t const len);
+static void add_metadata(DB_txn *const txn, uint64_t const metaFileID, strarg_t const targetURI, strarg_t const field, strarg_t const value, SLNChanges *const changes);
+static void add_fulltext(DB_txn *const txn, uint64_t const metaFileID, strarg_t const str, size_t const len, uint64_t *const position, SLNChanges *const changes);
 
 
-int SLNSubmissionParseMetaFile(SLNSubmissionRef const sub, uint64_t const fileID, DB_txn *const txn, uint64_t *const out) {
+int SLNSubmissionParseMetaFile(SLNSubmissionRef const sub, uint64_t const fileID, DB_txn *const txn, SLNChanges *const changes, uint64_t *const out) {
 	assert(out);
 	if(!sub) return DB_EINVAL;
 	if(!fileID) return DB_EINVAL;
@@ -88,10 +93,12 @@ int SLNSubmissionParseMetaFile(SLNSubmissionRef const sub, uint64_t const fileID
 	if(!metaFileID) goto cleanup;
 	// Duplicate meta-file, not an error.
 	// TODO: Unless the previous version wasn't actually a meta-file.
+	SLNChangesAdd(changes, "", targetURI);
 
 	ctx->txn = subtxn;
 	ctx->metaFileID = metaFileID;
 	ctx->targetURI = targetURI;
+	ctx->changes = changes;
 	ctx->depth = -1;
 	parser = yajl_alloc(&callbacks, NULL, ctx);
 	if(!parser) rc = DB_ENOMEM;
@@ -155,11 +162,11 @@ static int yajl_map_key(parser_t *const ctx, strarg_t const key, size_t const le
 		strarg_t const field = ctx->fields[ctx->depth-1];
 		assert(field);
 		if(0 == strcmp("fulltext", field)) {
-			add_fulltext(ctx->txn, ctx->metaFileID, key, len);
+			add_fulltext(ctx->txn, ctx->metaFileID, key, len, &ctx->position, ctx->changes);
 		} else {
 			str_t *x = strndup(key, len);
 			if(!x) return false;
-			add_metadata(ctx->txn, ctx->metaFileID, field, x);
+			add_metadata(ctx->txn, ctx->metaFileID, ctx->targetURI, field, x, ctx->changes);
 			FREE(&x);
 		}
 	}
@@ -217,15 +224,17 @@ static yajl_callbacks const callbacks = {
 
 static uint64_t add_metafile(DB_txn *const txn, uint64_t const fileID, strarg_t const targetURI) {
 	uint64_t const metaFileID = fileID;
-	uint64_t const latestMetaFileID = db_next_id(SLNMetaFileByID, txn);
-	if(metaFileID < latestMetaFileID) return 0;
+	uint64_t latestMetaFileID = 0;
+	int rc = db_last_id(SLNMetaFileByID, txn, &latestMetaFileID);
+	assert(rc >= 0);
+	if(metaFileID <= latestMetaFileID) return 0;
 	// If it's not a new file, then it's not a new meta-file.
 	// Note that ordinary files can't be "promoted" to meta-files later
 	// because that would break the ordering.
 
 	DB_val null = { 0, NULL };
 	DB_cursor *cursor = NULL;
-	int rc = db_txn_cursor(txn, &cursor);
+	rc = db_txn_cursor(txn, &cursor);
 	assert(rc >= 0);
 
 	DB_val metaFileID_key[1];
@@ -253,14 +262,22 @@ static uint64_t add_metafile(DB_txn *const txn, uint64_t const fileID, strarg_t
 
 	return metaFileID;
 }
-static void add_metadata(DB_txn *const txn, uint64_t const metaFileID, strarg_t const field, strarg_t const value) {
+static void add_metadata(DB_txn *const txn, uint64_t const metaFileID, strarg_t const targetURI, strarg_t const field, strarg_t const value, SLNChanges *const changes) {
 	assert(field);
 	assert(value);
 	if('\0' == value[0]) return;
+	SLNChangesAdd(changes, field, value);
 
 	DB_val null = { 0, NULL };
 	int rc;
 
+	// Only count each field and value once per meta-file.
+	DB_val dup[1];
+	SLNMetaFileIDFieldAndValueKeyPack(dup, txn, metaFileID, field, value);
+	rc = db_get(txn, dup, NULL);
+	if(rc >= 0) return;
+	assertf(DB_NOTFOUND == rc, "Database error %s", sln_strerror(rc));
+
 	DB_val fwd[1];
 	SLNMetaFileIDFieldAndValueKeyPack(fwd, txn, metaFileID, field, value);
 	rc = db_put(txn, fwd, &null, DB_NOOVERWRITE_FAST);
@@ -270,8 +287,65 @@ static void add_metadata(DB_txn *const txn, uint64_t const metaFileID, strarg_t
 	SLNFieldValueAndMetaFileIDKeyPack(rev, txn, field, value, metaFileID);
 	rc = db_put(txn, rev, &null, DB_NOOVERWRITE_FAST);
 	assertf(rc >= 0 || DB_KEYEXIST == rc, "Database error %s", sln_strerror(rc));
+
+	// Keep the number of meta-files for the filter planner. Values
+	// indexed before we kept counts start from the existing rows, but
+	// only up to SLN_BITMAP_MIN so this stays cheap. That's enough to
+	// decide on a bitmap, and --migrate seeds the exact counts.
+	uint64_t count = 0;
+	bool indexed = false;
+	DB_val count_key[1];
+	SLNFieldValueMetaFileCountKeyPack(count_key, txn, field, value);
+	DB_val count_val[1];
+	rc = db_get(txn, count_key, count_val);
+	if(rc >= 0) {
+		SLNFieldValueMetaFileCountValUnpack(count_val, txn, &count, &indexed);
+		count++;
+	} else {
+		assertf(DB_NOTFOUND == rc, "Database error %s", sln_strerror(rc));
+		DB_cursor *cursor = NULL;
+		rc = db_txn_cursor(txn, &cursor);
+		assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+		DB_range range[1];
+		SLNFieldValueAndMetaFileIDRange2(range, txn, field, value);
+		rc = db_cursor_firstr(cursor, range, NULL, NULL, +1);
+		for(; rc >= 0; rc = db_cursor_nextr(cursor, range, NULL, NULL, +1)) {
+			if(++count >= SLN_BITMAP_MIN) break;
+		}
+		assertf(rc >= 0 || DB_NOTFOUND == rc, "Database error %s", sln_strerror(rc));
+	}
+
+	// Common values also keep the set of files they apply to.
+	if(!indexed && count >= SLN_BITMAP_MIN) {
+		rc = SLNBitmapBuild(txn, field, value);
+		assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+		indexed = true;
+	} else if(indexed) {
+		rc = SLNBitmapAddTarget(txn, field, value, targetURI);
+		assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+	}
+
+	DB_val new_key[1];
+	SLNFieldValueMetaFileCountKeyPack(new_key, txn, field, value);
+	DB_val new_val[1];
+	SLNFieldValueMetaFileCountValPack(new_val, txn, count, indexed);
+	rc = db_put(txn, new_key, new_val, 0);
+	assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+}
+struct occurrence {
+	str_t *token;
+	uint64_t position;
+};
+static int occurrence_cmp(void const *const a, void const *const b) {
+	struct occurrence const *const x = a;
+	struct occurrence const *const y = b;
+	int const r = strcmp(x->token, y->token);
+	if(r) return r;
+	if(x->position < y->position) return -1;
+	if(x->position > y->position) return +1;
+	return 0;
 }
-static void add_fulltext(DB_txn *const txn, uint64_t const metaFileID, strarg_t const str, size_t const len) {
+static void add_fulltext(DB_txn *const txn, uint64_t const metaFileID, strarg_t const str, size_t const len, uint64_t *const position, SLNChanges *const changes) {
 	if(0 == len) return;
 	assert(str);
 
@@ -285,29 +359,55 @@ static void add_fulltext(DB_txn *const txn, uint64_t const metaFileID, strarg_t
 	rc = fts->xOpen(tokenizer, str, len, &tcur);
 	assert(SQLITE_OK == rc);
 
-	DB_cursor *cursor = NULL;
-	rc = db_cursor_open(txn, &cursor);
-	assert(rc >= 0);
-
+	struct occurrence *list = NULL;
+	size_t count = 0;
+	size_t size = 0;
+	uint64_t const base = *position;
 	for(;;) {
 		strarg_t token;
 		int tlen;
-		int tpos; // TODO
+		int tpos;
 		int ignored1, ignored2;
 		rc = fts->xNext(tcur, &token, &tlen, &ignored1, &ignored2, &tpos);
 		if(SQLITE_OK != rc) break;
 
 		assert('\0' == token[tlen]); // Assumption
-		DB_val token_val[1];
-		SLNTermMetaFileIDAndPositionKeyPack(token_val, txn, token, metaFileID, 0);
-		// TODO: Record tpos. Requires changes to SLNFulltextFilter so that each document only gets returned once, no matter how many times the token appears within it.
-		DB_val null = { 0, NULL };
-		rc = db_cursor_put(cursor, token_val, &null, DB_NOOVERWRITE_FAST);
-		assert(rc >= 0 || DB_KEYEXIST == rc);
+		if(count+1 > size) {
+			size = MAX(16, size*2);
+			list = reallocarray(list, size, sizeof(*list));
+			assert(list); // TODO
+		}
+		list[count].token = strndup(token, tlen);
+		assert(list[count].token); // TODO
+		list[count].position = base + tpos;
+		*position = MAX(*position, base + tpos + 1);
+		count++;
 	}
 
-	db_cursor_close(cursor); cursor = NULL;
-
 	fts->xClose(tcur); tcur = NULL;
+
+	// Leave a gap so that phrases can't span separate strings.
+	*position += 1;
+
+	// Group by token so each one is only written once per string.
+	qsort(list, count, sizeof(*list), occurrence_cmp);
+	uint64_t *positions = reallocarray(NULL, MAX(1, count), sizeof(*positions));
+	assert(positions); // TODO
+	for(size_t i = 0; i < count;) {
+		size_t n = 0;
+		for(; i+n < count && 0 == strcmp(list[i].token, list[i+n].token); n++) {
+			positions[n] = list[i+n].position;
+		}
+		rc = SLNPostingsAdd(txn, list[i].token, metaFileID);
+		assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+		rc = SLNPostingsAddPositions(txn, list[i].token, metaFileID, positions, n);
+		assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+		SLNChangesAdd(changes, NULL, list[i].token);
+		i += n;
+	}
+
+	for(size_t i = 0; i < count; i++) FREE(&list[i].token);
+	FREE(&list);
+	FREE(&positions);
 }
 
@@ -24,6 +24,7 @@ enum {
 
 typedef struct SLNRepo* SLNRepoRef;
 typedef struct SLNSessionCache* SLNSessionCacheRef;
+typedef struct SLNQueryCache* SLNQueryCacheRef;
 typedef struct SLNSession* SLNSessionRef;
 typedef struct SLNSubmission* SLNSubmissionRef;
 typedef struct SLNHasher* SLNHasherRef;
@@ -58,12 +59,57 @@ strarg_t SLNRepoGetName(SLNRepoRef const repo);
 SLNMode SLNRepoGetPublicMode(SLNRepoRef const repo);
 SLNMode SLNRepoGetRegistrationMode(SLNRepoRef const repo);
 SLNSessionCacheRef SLNRepoGetSessionCache(SLNRepoRef const repo);
+SLNQueryCacheRef SLNRepoGetQueryCache(SLNRepoRef const repo);
+
+// Approximate summary of what a batch of submissions added, so that live
+// queries can skip batches that can't match them. Full-text terms are added
+// with a NULL field and URIs (including meta-file targets) with an empty one.
+// False positives are possible, false negatives aren't.
+#define SLN_CHANGES_BITS (1024 * 16)
+#define SLN_CHANGES_MAX (1024 * 2)
+typedef struct {
+	size_t count;
+	uint64_t bits[SLN_CHANGES_BITS / 64];
+} SLNChanges;
+void SLNChangesAdd(SLNChanges *const changes, strarg_t const field, strarg_t const value);
+bool SLNChangesMayContain(SLNChanges const *const changes, strarg_t const field, strarg_t const value);
+
+// Live query subscribers. When new submissions arrive, whichever subscriber
+// wakes first checks everyone waiting against the recent changes, and runs
+// the callbacks of those that might match in one shared read transaction.
+// A fan-out is time-limited, and anyone it didn't get to goes in the next.
+typedef struct SLNSubscriber SLNSubscriber;
+typedef int (*SLNSubscriberCB)(void *ctx, DB_txn *const txn, uint64_t const latest);
+typedef bool (*SLNSubscriberTestCB)(void *ctx, SLNChanges const *const changes);
+struct SLNSubscriber {
+	SLNSubscriberCB cb;
+	SLNSubscriberTestCB test; // Optional.
+	void *ctx;
+	uint64_t sortID; // Wait for submissions newer than this.
+	uint64_t latest; // Set on return, whether or not cb was called.
+	// Private.
+	int rc;
+	bool busy;
+	bool done;
+	SLNSubscriber *prev;
+	SLNSubscriber *next;
+	SLNSubscriber *batch;
+};
+
 void SLNRepoDBOpen(SLNRepoRef const repo, DB_env **const dbptr);
 void SLNRepoDBClose(SLNRepoRef const repo, DB_env **const dbptr);
-void SLNRepoSubmissionEmit(SLNRepoRef const repo, uint64_t const sortID);
+void SLNRepoSubmissionEmit(SLNRepoRef const repo, uint64_t const sortID, SLNChanges const *const changes);
 int SLNRepoSubmissionWait(SLNRepoRef const repo, uint64_t *const sortID, uint64_t const future);
+int SLNRepoSubmissionSubscribe(SLNRepoRef const repo, SLNSubscriber *const sub, uint64_t const future);
+uint64_t SLNRepoSubmissionLatest(SLNRepoRef const repo);
+// If nothing submitted after *sortID could pass test, advances *sortID to
+// the latest submission and returns true.
+bool SLNRepoSubmissionUnchanged(SLNRepoRef const repo, uint64_t *const sortID, SLNSubscriberTestCB const test, void *ctx);
+int SLNRepoSubmissionCommit(SLNRepoRef const repo, SLNSubmissionRef const *const list, size_t const count);
 void SLNRepoPullsStart(SLNRepoRef const repo);
 void SLNRepoPullsStop(SLNRepoRef const repo);
+// One-time data migrations, run with the server stopped.
+int SLNRepoMigrate(SLNRepoRef const repo);
 
 
 // TODO: Make this private (and maybe clean it up).
@@ -154,7 +200,7 @@ enum {
 	SLNURIFilterType = 8,
 	// Meta-files with a given target
 	SLNTargetURIFilterType = 9,
-	// Full-text search // TODO: Phrase search
+	// Full-text search
 	SLNFulltextFilterType = 10,
 	// Exact meta-data field and value // TODO: Case-insensitivity
 	SLNMetadataFilterType = 11,
@@ -162,6 +208,8 @@ enum {
 	SLNLinksToFilterType = 12,
 	// Forward links (everything linked from a file with the given URI)
 //	SLNLinkedFromFilterType = 13, // TODO
+	// Full-text search for terms at consecutive positions
+	SLNPhraseFilterType = 14,
 };
 
 typedef struct {
@@ -178,13 +226,26 @@ strarg_t SLNFilterGetStringArg(SLNFilterRef const filter, size_t const i);
 int SLNFilterAddStringArg(SLNFilterRef const filter, strarg_t const str, ssize_t const len);
 int SLNFilterAddFilterArg(SLNFilterRef const filter, SLNFilterRef const subfilter);
 void SLNFilterPrint(SLNFilterRef const filter, size_t const depth);
+// Rewrites the filter into an equivalent one that's cheaper to run.
+// Takes ownership of the filter and returns its replacement.
+SLNFilterRef SLNFilterPlan(SLNFilterRef const filter);
 size_t SLNFilterToUserFilterString(SLNFilterRef const filter, str_t *const data, size_t const size, size_t const depth);
 int SLNFilterPrepare(SLNFilterRef const filter, DB_txn *const txn);
+// Rough upper bound on the number of results from the index statistics,
+// or UINT64_MAX if unknown. Only valid after preparing.
+uint64_t SLNFilterGetEstimate(SLNFilterRef const filter);
 void SLNFilterSeek(SLNFilterRef const filter, int const dir, uint64_t const sortID, uint64_t const fileID);
 void SLNFilterCurrent(SLNFilterRef const filter, int const dir, uint64_t *const sortID, uint64_t *const fileID);
 void SLNFilterStep(SLNFilterRef const filter, int const dir);
 SLNAgeRange SLNFilterFullAge(SLNFilterRef const filter, uint64_t const fileID);
 uint64_t SLNFilterFastAge(SLNFilterRef const filter, uint64_t const fileID, uint64_t const sortID);
+// False if nothing in changes could add new matches.
+bool SLNFilterMayMatch(SLNFilterRef const filter, SLNChanges const *const changes);
+// Identifies the filter's structure and arguments. Never 0 or UINT64_MAX.
+uint64_t SLNFilterFingerprint(SLNFilterRef const filter);
+// Canonical bytes for comparing filters exactly. Returns the full length,
+// even if it didn't fit in size.
+size_t SLNFilterSerialize(SLNFilterRef const filter, byte_t *const data, size_t const size);
 
 
 typedef struct {
@@ -192,6 +253,7 @@ typedef struct {
 	str_t *URI;
 	uint64_t sortID;
 	uint64_t fileID;
+	uint64_t fingerprint; // Filter a token was issued for, or 0.
 } SLNFilterPosition;
 
 typedef int (*SLNFilterWriteCB)(void *ctx, uv_buf_t const parts[], unsigned int const count);
@@ -199,6 +261,12 @@ typedef int (*SLNFilterFlushCB)(void *ctx);
 
 void SLNFilterParseOptions(strarg_t const qs, SLNFilterPosition *const start, uint64_t *const count, int *const dir, bool *const wait);
 void SLNFilterPositionCleanup(SLNFilterPosition *const pos);
+// Signed continuation tokens ("~" followed by hex) encode an exact position,
+// so resuming takes a single seek instead of looking up a URI. They're
+// accepted anywhere a start URI is, and only for the same filter.
+// Returns NULL if the position can't be encoded (e.g. it's still a URI).
+str_t *SLNFilterPositionCopyToken(SLNFilterRef const filter, SLNFilterPosition const *const pos);
+bool SLNFilterPositionMatches(SLNFilterRef const filter, SLNFilterPosition const *const pos);
 
 int SLNFilterSeekToPosition(SLNFilterRef const filter, SLNFilterPosition const *const pos, DB_txn *const txn);
 int SLNFilterGetPosition(SLNFilterRef const filter, SLNFilterPosition *const pos, DB_txn *const txn);
@@ -207,6 +275,30 @@ int SLNFilterCopyNextURI(SLNFilterRef const filter, int const dir, bool const me
 ssize_t SLNFilterCopyURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const dir, bool const meta, str_t *URIs[], size_t const max);
 ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx);
 int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, bool const wait, SLNFilterWriteCB const writecb, SLNFilterFlushCB const flushcb, void *ctx);
+// Count walks the indexes without resolving any URIs. Estimate is exact for
+// small result sets, and otherwise extrapolates from the newest results.
+int SLNFilterCount(SLNFilterRef const filter, SLNSessionRef const session, uint64_t *const out);
+int SLNFilterEstimate(SLNFilterRef const filter, SLNSessionRef const session, uint64_t *const out);
+
+// First pages and counts of recent queries, keyed by filter serialization.
+// Entries are checked against the submissions since they were stored, and
+// only dropped if one of them might match. Lookups return DB_NOTFOUND on
+// a miss. Results don't depend on the session, so entries are shared.
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t revalidations; // Hits that survived newer submissions.
+	uint64_t evictions;
+	size_t entries;
+	size_t size;
+} SLNQueryCacheStats;
+SLNQueryCacheRef SLNQueryCacheCreate(SLNRepoRef const repo, size_t const size);
+void SLNQueryCacheFree(SLNQueryCacheRef *const cacheptr);
+ssize_t SLNQueryCacheCopyURIs(SLNQueryCacheRef const cache, SLNFilterRef const filter, SLNFilterPosition *const pos, int const dir, bool const meta, str_t *URIs[], size_t const max);
+void SLNQueryCacheAddURIs(SLNQueryCacheRef const cache, SLNFilterRef const filter, uint64_t const latest, SLNFilterPosition const *const pos, int const dir, bool const meta, str_t *const URIs[], size_t const count, size_t const max);
+int SLNQueryCacheGetCount(SLNQueryCacheRef const cache, SLNFilterRef const filter, uint64_t *const out);
+void SLNQueryCacheAddCount(SLNQueryCacheRef const cache, SLNFilterRef const filter, uint64_t const latest, uint64_t const count);
+void SLNQueryCacheGetStats(SLNQueryCacheRef const cache, SLNQueryCacheStats *const out);
 
 
 int SLNJSONFilterParserCreate(SLNSessionRef const session, SLNJSONFilterParserRef *const out);
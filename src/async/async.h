@@ -57,6 +57,12 @@ int async_sleep(uint64_t const milliseconds);
 void async_close(uv_handle_t *const handle);
 
 // async_stream.c
+// Buffers up to ASYNC_BUFFER_SIZE are recycled through a per-thread
+// freelist. Buffers returned by async_read must be freed with
+// async_buffer_free.
+#define ASYNC_BUFFER_SIZE (1024 * 8)
+void *async_buffer_alloc(size_t const size);
+void async_buffer_free(void *const buf);
 int async_read(uv_stream_t *const stream, size_t const size, uv_buf_t *const out);
 
 int async_write(uv_stream_t *const stream, uv_buf_t const bufs[], unsigned const nbufs);
@@ -75,6 +81,7 @@ int async_fs_mkdir_nosync(const char* path, int mode); // Warning: unsafe!
 int async_fs_ftruncate(uv_file file, int64_t offset);
 
 int async_fs_symlink(const char* path, const char* new_path, int flags);
+ssize_t async_fs_sendfile(uv_file out_fd, uv_file in_fd, int64_t in_offset, size_t length);
 
 ssize_t async_fs_readall_simple(uv_file const file, uv_buf_t const *const buf);
 int async_fs_writeall(uv_file const file, uv_buf_t bufs[], unsigned int const nbufs, int64_t const offset);
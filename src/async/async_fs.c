@@ -83,6 +83,9 @@ int async_fs_ftruncate(uv_file file, int64_t offset) {
 int async_fs_symlink(const char* path, const char* new_path, int flags) {
 	ASYNC_FS_WRAP(symlink, path, new_path, flags);
 }
+ssize_t async_fs_sendfile(uv_file out_fd, uv_file in_fd, int64_t in_offset, size_t length) {
+	ASYNC_FS_WRAP(sendfile, out_fd, in_fd, in_offset, length)
+}
 
 ssize_t async_fs_readall_simple(uv_file const file, uv_buf_t const *const buf) {
 	async_pool_enter(NULL);
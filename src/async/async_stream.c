@@ -6,6 +6,47 @@
 #include <string.h> /* DEBUG */
 #include "async.h"
 
+// Enough for a burst of connections without holding much while idle.
+#define BUFFERS_MAX 256
+
+// Each buffer is preceded by a header that's either its size (while in
+// use) or the next free buffer (while on the freelist).
+typedef union buffer buffer;
+union buffer {
+	buffer *next;
+	size_t size;
+	uint64_t align[2];
+};
+
+static thread_local buffer *freelist = NULL;
+static thread_local size_t freecount = 0;
+
+void *async_buffer_alloc(size_t const size) {
+	if(size <= ASYNC_BUFFER_SIZE && freelist) {
+		buffer *const b = freelist;
+		freelist = b->next;
+		freecount--;
+		b->size = ASYNC_BUFFER_SIZE;
+		return b+1;
+	}
+	size_t const cap = size < ASYNC_BUFFER_SIZE ? ASYNC_BUFFER_SIZE : size;
+	buffer *const b = malloc(sizeof(buffer) + cap);
+	if(!b) return NULL;
+	b->size = cap;
+	return b+1;
+}
+void async_buffer_free(void *const buf) {
+	if(!buf) return;
+	buffer *const b = (buffer *)buf - 1;
+	if(ASYNC_BUFFER_SIZE != b->size || freecount >= BUFFERS_MAX) {
+		free(b);
+		return;
+	}
+	b->next = freelist;
+	freelist = b;
+	freecount++;
+}
+
 typedef struct {
 	async_t *thread;
 	size_t size;
@@ -20,13 +61,13 @@ static void alloc_cb(uv_handle_t *const handle, size_t const suggested_size, uv_
 		buf->base = NULL;
 		return;
 	}
-	buf->base = malloc(state->size);
+	buf->base = async_buffer_alloc(state->size);
 	assert(buf->base); // TODO
 }
 static void read_cb(uv_stream_t *const stream, ssize_t const nread, uv_buf_t const *const buf) {
 	async_state *const state = stream->data;
 	if(nread <= 0) {
-		free(buf->base); // buf->base = NULL;
+		async_buffer_free(buf->base); // buf->base = NULL;
 		state->buf->base = NULL;
 		state->buf->len = 0;
 		state->status = nread ? nread : UV_EAGAIN;
@@ -51,7 +92,7 @@ int async_read(uv_stream_t *const stream, size_t const size, uv_buf_t *const out
 	rc = async_yield_cancelable();
 	uv_read_stop(stream);
 	if(rc < 0) {
-		free(state->buf->base);
+		async_buffer_free(state->buf->base);
 		return rc;
 	}
 	out->base = state->buf->base;
@@ -94,6 +94,9 @@ static int send_preview(BlogRef const blog, HTTPConnectionRef const conn, SLNSes
 	}
 	if(UV_ENOENT != rc) return rc;
 
+	// Generating can take a while, or wait on someone else doing it.
+	rc = HTTPConnectionFlush(conn);
+	if(rc < 0) return rc;
 	gen_preview(blog, session, URI, path);
 
 	rc = HTTPConnectionWriteChunkFile(conn, path);
@@ -174,12 +177,17 @@ static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 
 	str_t *URIs[RESULTS_MAX];
 	ssize_t const count = SLNFilterCopyURIs(filter, session, pos, outdir, false, URIs, (size_t)max);
+	// The position is left on the last result we walked, which is at
+	// one end of the page or the other.
+	str_t *token = count > 0 ? SLNFilterPositionCopyToken(filter, pos) : NULL;
+	ssize_t const last = pos->dir * outdir > 0 ? count-1 : 0;
 	SLNFilterPositionCleanup(pos);
 	if(count < 0) {
 		fprintf(stderr, "Filter error: %s\n", sln_strerror(count));
 		FREE(&query);
 		FREE(&query_HTMLSafe);
 		SLNFilterFree(&filter);
+		if(DB_EINVAL == count) return 400;
 		return 500;
 	}
 	SLNFilterFree(&filter);
@@ -213,10 +221,14 @@ static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 	str_t *lastpage_HTMLSafe = NULL;
 	snprintf(tmp, sizeof(tmp), "?q=%s&start=-", query_encoded ?: "");
 	firstpage_HTMLSafe = htmlenc(tmp);
-	str_t *p = !count ? NULL : URIs[outdir > 0 ? 0 : count-1];
-	str_t *n = !count ? NULL : URIs[outdir > 0 ? count-1 : 0];
-	if(p) p = QSEscape(p, strlen(p), 1);
-	if(n) n = QSEscape(n, strlen(n), 1);
+	ssize_t const pi = outdir > 0 ? 0 : count-1;
+	ssize_t const ni = outdir > 0 ? count-1 : 0;
+	str_t *p = !count ? NULL : URIs[pi];
+	str_t *n = !count ? NULL : URIs[ni];
+	// Tokens resume without looking the URI up again. They're plain hex.
+	if(p) p = token && last == pi ? strdup(token) : QSEscape(p, strlen(p), 1);
+	if(n) n = token && last == ni ? strdup(token) : QSEscape(n, strlen(n), 1);
+	FREE(&token);
 	snprintf(tmp, sizeof(tmp), "?q=%s&start=%s", query_encoded ?: "", p ?: "");
 	prevpage_HTMLSafe = htmlenc(tmp);
 	snprintf(tmp, sizeof(tmp), "?q=%s&start=-%s", query_encoded ?: "", n ?: "");
@@ -556,7 +568,7 @@ static int POST_post(BlogRef const blog,
 
 
 	SLNSubmissionRef subs[] = { sub, meta, extra };
-	rc = SLNSubmissionStoreBatch(subs, numberof(subs));
+	rc = SLNRepoSubmissionCommit(blog->repo, subs, numberof(subs));
 
 	location = aasprintf("/?q=%s", target_QSEscaped);
 	if(!location) rc = UV_ENOMEM;
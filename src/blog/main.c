@@ -34,6 +34,7 @@ static HTTPServerRef server_tls = NULL;
 static uv_signal_t sigpipe[1] = {};
 static uv_signal_t sigint[1] = {};
 static int sig = 0;
+static int status = 0;
 
 static int listener0(void *ctx, HTTPServerRef const server, HTTPConnectionRef const conn) {
 	HTTPMethod method;
@@ -83,6 +84,17 @@ static int listener0(void *ctx, HTTPServerRef const server, HTTPConnectionRef co
 	if(rc < 0) return 500;
 	// Note: null session is valid (zero permissions).
 
+	// Responses held for pipelining shouldn't wait on writes, which can
+	// block on the repo's write lock. Reads that wait flush on their own.
+	if(HTTP_GET != method && HTTP_HEAD != method) {
+		rc = HTTPConnectionFlush(conn);
+		if(rc < 0) {
+			SLNSessionRelease(&session);
+			HTTPHeadersFree(&headers);
+			return rc;
+		}
+	}
+
 	rc = -1;
 	rc = rc >= 0 ? rc : SLNServerDispatch(repo, session, conn, method, URI, headers);
 	rc = rc >= 0 ? rc : BlogDispatch(blog, session, conn, method, URI, headers);
@@ -218,6 +230,23 @@ static void init(void *const unused) {
 	uv_signal_start(sigint, stop, SIGINT);
 	uv_unref((uv_handle_t *)sigint);
 }
+static void migrate(void *const unused) {
+	str_t *tmp = strdup(path);
+	strarg_t const reponame = basename(tmp); // TODO
+	repo = SLNRepoCreate(path, reponame);
+	FREE(&tmp);
+	if(!repo) {
+		fprintf(stderr, "Repository could not be opened\n");
+		status = 1;
+		return;
+	}
+	int rc = SLNRepoMigrate(repo);
+	if(rc < 0) {
+		fprintf(stderr, "Migration error (%s)\n", sln_strerror(rc));
+		status = 1;
+		return;
+	}
+}
 static void term(void *const unused) {
 	fprintf(stderr, "\nStopping StrongLink server...\n");
 
@@ -258,11 +287,21 @@ int main(int const argc, char const *const *const argv) {
 		return 1;
 	}
 
-	if(2 != argc || '-' == argv[1][0]) {
-		fprintf(stderr, "Usage:\n\t" "%s repo\n", argv[0]);
+	bool const migrating = 3 == argc && 0 == strcmp("--migrate", argv[1]);
+	if((2 != argc || '-' == argv[1][0]) && !migrating) {
+		fprintf(stderr, "Usage:\n\t" "%s repo\n\t" "%s --migrate repo\n", argv[0], argv[0]);
 		return 1;
 	}
-	path = argv[1];
+	path = argv[argc-1];
+
+	if(migrating) {
+		async_spawn(STACK_DEFAULT, migrate, NULL);
+		uv_run(async_loop, UV_RUN_DEFAULT);
+		async_spawn(STACK_DEFAULT, cleanup, NULL);
+		uv_run(async_loop, UV_RUN_DEFAULT);
+		async_destroy();
+		return status;
+	}
 
 	// Even our init code wants to use async I/O.
 	async_spawn(STACK_DEFAULT, init, NULL);
@@ -5,6 +5,7 @@
 #define DB_BASE_H
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
 
@@ -15,6 +16,10 @@
 #define DB_RDWR 0
 #define DB_RDONLY 0x20000
 
+// Reported by db_txn_get_flags when the keyspace is split into partitions.
+// Not a valid flag to pass in.
+#define DB_PARTITIONED 0x1000000
+
 #define DB_NOOVERWRITE 0x10 // May be expensive for LSM-tree back-ends.
 
 #define DB_KEYEXIST (-30799)
@@ -47,6 +52,21 @@ int db_env_set_mapsize(DB_env *const env, size_t const size);
 int db_env_open(DB_env *const env, char const *const name, unsigned const flags, unsigned const mode);
 void db_env_close(DB_env *const env);
 
+// Keys can be routed to separate storage by their leading table ID (the
+// varint from db_schema.h), so that small, hot tables don't share files or
+// B-trees with huge indexes. Entries with the same name share a partition
+// (and its sizes are taken from the first one). Unlisted tables go in the
+// default partition. Partitions are part of the database format. Call
+// before db_env_open. Back-ends without separate storage ignore them.
+typedef struct {
+	char const *name; // Must outlive the environment.
+	uint64_t min; // First table ID.
+	uint64_t max; // Last table ID + 1.
+	size_t cache; // Own block cache in bytes, or 0 to share.
+	size_t write_buffer; // Bytes, or 0 for the default.
+} DB_partition;
+int db_env_set_partitions(DB_env *const env, DB_partition const *const partitions, size_t const count);
+
 int db_txn_begin(DB_env *const env, DB_txn *const parent, unsigned const flags, DB_txn **const out);
 int db_txn_commit(DB_txn *const txn);
 void db_txn_abort(DB_txn *const txn);
@@ -69,6 +89,9 @@ int db_cursor_renew(DB_txn *const txn, DB_cursor **const out);
 int db_cursor_clear(DB_cursor *const cursor);
 int db_cursor_cmp(DB_cursor *const cursor, DB_val const *const a, DB_val const *const b);
 
+// Keys and values may point into the cursor, so copy anything you need
+// after moving it. The shared cursor's results last a bit longer, so a few
+// db_get calls can be chained.
 int db_cursor_current(DB_cursor *const cursor, DB_val *const key, DB_val *const data);
 int db_cursor_seek(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir);
 int db_cursor_first(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir);
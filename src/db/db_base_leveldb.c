@@ -2,10 +2,10 @@
 // MIT licensed (see LICENSE for details)
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h> // For unlink(2)
 #include <sys/resource.h>
 
 #ifdef USE_ROCKSDB
@@ -14,7 +14,6 @@
 #include <leveldb/c.h>
 #endif
 
-#include "../../deps/lsmdb/liblmdb/lmdb.h"
 #include "db_base.h"
 
 // TODO
@@ -27,10 +26,6 @@
 	} \
 } while(0)
 
-#define MDB_RDWR 0
-
-#define MDB_MAIN_DBI 1
-
 typedef enum {
 	S_INVALID = 0,
 	S_EQUAL,
@@ -38,20 +33,161 @@ typedef enum {
 	S_PERSIST,
 } DB_state;
 
+typedef int DB_cmp_func(DB_val const *const a, DB_val const *const b);
+typedef struct LDB_cursor LDB_cursor;
+
+// Writes are kept in a skiplist until commit, so that reads within the
+// transaction can merge them with LevelDB's iterator. Like RocksDB's
+// WriteBatchWithIndex (see db_base_rocksdb.c), but we only need puts.
+#define WB_HEIGHT_MAX 12
+typedef struct WB_node WB_node;
+struct WB_node {
+	DB_val key; // Stored after next[].
+	DB_val data; // Separate, since it can be overwritten.
+	WB_node *prev;
+	WB_node *next[];
+};
 typedef struct {
-	DB_val key;
-	DB_val data;
-} DB_write;
+	DB_cmp_func *cmp;
+	WB_node *head; // Sentinel, not a real node.
+	WB_node *tail;
+	unsigned height;
+	uint32_t seed;
+} WB;
+typedef struct {
+	WB *batch;
+	WB_node *node; // NULL if unpositioned.
+} WB_cursor;
+
+static void wb_free(WB *const batch);
+static int wb_create(DB_cmp_func *const cmp, WB **const out) {
+	WB *batch = calloc(1, sizeof(WB));
+	if(!batch) return DB_ENOMEM;
+	batch->cmp = cmp;
+	batch->head = calloc(1, sizeof(WB_node) + sizeof(WB_node *) * WB_HEIGHT_MAX);
+	batch->tail = NULL;
+	batch->height = 1;
+	batch->seed = 0x9e3779b9;
+	if(!batch->head) {
+		wb_free(batch);
+		return DB_ENOMEM;
+	}
+	*out = batch;
+	return 0;
+}
+static void wb_free(WB *const batch) {
+	if(!batch) return;
+	WB_node *node = batch->head ? batch->head->next[0] : NULL;
+	while(node) {
+		WB_node *const next = node->next[0];
+		free(node->data.data);
+		free(node);
+		node = next;
+	}
+	free(batch->head); batch->head = NULL;
+	batch->tail = NULL;
+	batch->cmp = NULL;
+	batch->height = 0;
+	batch->seed = 0;
+	assert_zeroed(batch, 1);
+	free(batch);
+}
+// Each level has a quarter as many nodes as the one below.
+static unsigned wb_height(WB *const batch) {
+	uint32_t x = batch->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	batch->seed = x;
+	unsigned height = 1;
+	while(height < WB_HEIGHT_MAX && 0 == (x & 3)) {
+		height++;
+		x >>= 2;
+	}
+	return height;
+}
+// Returns the first node >= key, and the last node < key at every level.
+static WB_node *wb_find(WB *const batch, DB_val const *const key, WB_node **const prev) {
+	WB_node *x = batch->head;
+	for(unsigned i = WB_HEIGHT_MAX; i-- > 0;) {
+		if(i < batch->height) {
+			while(x->next[i] && batch->cmp(&x->next[i]->key, key) < 0) x = x->next[i];
+		}
+		if(prev) prev[i] = x;
+	}
+	return x->next[0];
+}
+static int wb_put(WB *const batch, DB_val const *const key, DB_val const *const data) {
+	WB_node *prev[WB_HEIGHT_MAX];
+	WB_node *node = wb_find(batch, key, prev);
+	void *const copy = malloc(data->size ? data->size : 1);
+	if(!copy) return DB_ENOMEM;
+	memcpy(copy, data->data, data->size);
+	if(node && 0 == batch->cmp(&node->key, key)) {
+		free(node->data.data);
+		node->data = (DB_val){ data->size, copy };
+		return 0;
+	}
+
+	unsigned const height = wb_height(batch);
+	node = malloc(sizeof(WB_node) + sizeof(WB_node *) * height + key->size);
+	if(!node) {
+		free(copy);
+		return DB_ENOMEM;
+	}
+	char *const k = (char *)&node->next[height];
+	memcpy(k, key->data, key->size);
+	node->key = (DB_val){ key->size, k };
+	node->data = (DB_val){ data->size, copy };
+	if(height > batch->height) batch->height = height;
+	for(unsigned i = 0; i < height; ++i) {
+		node->next[i] = prev[i]->next[i];
+		prev[i]->next[i] = node;
+	}
+	node->prev = prev[0] == batch->head ? NULL : prev[0];
+	if(node->next[0]) node->next[0]->prev = node;
+	else batch->tail = node;
+	return 0;
+}
+
+// Read-only cursors have no batch, and act like it's empty.
+static int wb_cursor_current(WB_cursor *const cursor, DB_val *const key, DB_val *const data) {
+	if(!cursor->node) return DB_NOTFOUND;
+	if(key) *key = cursor->node->key;
+	if(data) *data = cursor->node->data;
+	return 0;
+}
+static int wb_cursor_seek(WB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
+	if(!key) return DB_EINVAL;
+	if(!cursor->batch) return DB_NOTFOUND;
+	WB_node *prev[WB_HEIGHT_MAX];
+	WB_node *node = wb_find(cursor->batch, key, prev);
+	int const eq = node && 0 == cursor->batch->cmp(&node->key, key);
+	if(0 == dir && !eq) node = NULL;
+	if(dir < 0 && !eq) node = prev[0] == cursor->batch->head ? NULL : prev[0];
+	cursor->node = node;
+	return wb_cursor_current(cursor, key, data);
+}
+static int wb_cursor_first(WB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
+	if(0 == dir) return DB_EINVAL;
+	if(!cursor->batch) return DB_NOTFOUND;
+	cursor->node = dir > 0 ? cursor->batch->head->next[0] : cursor->batch->tail;
+	return wb_cursor_current(cursor, key, data);
+}
+static int wb_cursor_next(WB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
+	if(!cursor->node) return wb_cursor_first(cursor, key, data, dir);
+	if(0 == dir) return DB_EINVAL;
+	cursor->node = dir > 0 ? cursor->node->next[0] : cursor->node->prev;
+	return wb_cursor_current(cursor, key, data);
+}
 
-typedef struct LDB_cursor LDB_cursor;
 
 struct DB_env {
 	leveldb_options_t *opts;
 	leveldb_filterpolicy_t *filterpolicy;
 	leveldb_t *db;
-	MDB_env *tmpenv;
 	leveldb_writeoptions_t *wopts;
-	MDB_cmp_func *cmp;
+	DB_cmp_func *cmp;
 };
 struct DB_txn {
 	DB_env *env;
@@ -59,24 +195,25 @@ struct DB_txn {
 	unsigned flags;
 	leveldb_readoptions_t *ropts;
 	leveldb_snapshot_t const *snapshot;
-	MDB_txn *tmptxn;
+	WB *batch; // Pending writes, or NULL if read-only.
 	DB_cursor *cursor;
 };
 struct DB_cursor {
 	DB_txn *txn;
 	DB_state state;
-	MDB_cursor *pending;
+	WB_cursor pending[1]; // Unused if read-only.
 	LDB_cursor *persist;
+	unsigned char stable;
 };
 
 
 // DEBUG
-static char *tohex(MDB_val const *const x) {
+static char *tohex(DB_val const *const x) {
 	char const *const map = "0123456789abcdef";
-	char const *const buf = x->mv_data;
-	char *const hex = calloc(x->mv_size*2+1, 1);
+	char const *const buf = x->data;
+	char *const hex = calloc(x->size*2+1, 1);
 	if(!hex) return NULL;
-	for(size_t i = 0; i < x->mv_size; ++i) {
+	for(size_t i = 0; i < x->size; ++i) {
 		hex[i*2+0] = map[0xf & (buf[i] >> 4)];
 		hex[i*2+1] = map[0xf & (buf[i] >> 0)];
 	}
@@ -84,45 +221,35 @@ static char *tohex(MDB_val const *const x) {
 }
 
 
-static int compare_default(MDB_val const *const a, MDB_val const *const b) {
-	size_t const min = a->mv_size < b->mv_size ? a->mv_size : b->mv_size;
-	int x = memcmp(a->mv_data, b->mv_data, min);
+static int compare_default(DB_val const *const a, DB_val const *const b) {
+	size_t const min = a->size < b->size ? a->size : b->size;
+	int x = memcmp(a->data, b->data, min);
 	if(0 != x) return x;
-	if(a->mv_size < b->mv_size) return -1;
-	if(a->mv_size > b->mv_size) return +1;
+	if(a->size < b->size) return -1;
+	if(a->size > b->size) return +1;
 	return 0;
 }
 
 
-static int mdberr(int const rc) {
-	return rc <= 0 ? rc : -rc;
-}
-static int mdb_cursor_seek(MDB_cursor *const cursor, MDB_val *const key, MDB_val *const data, int const dir) {
-	if(!key) return EINVAL;
-	MDB_val const orig = *key;
-	MDB_cursor_op const op = 0 == dir ? MDB_SET : MDB_SET_RANGE;
-	int rc = mdberr(mdb_cursor_get(cursor, key, data, op));
-	if(dir >= 0) return rc;
-	if(rc >= 0) {
-		MDB_txn *const txn = mdb_cursor_txn(cursor);
-		MDB_dbi const dbi = mdb_cursor_dbi(cursor);
-		if(0 == mdb_cmp(txn, dbi, &orig, key)) return rc;
-		return mdberr(mdb_cursor_get(cursor, key, data, MDB_PREV));
-	} else if(DB_NOTFOUND == rc) {
-		return mdberr(mdb_cursor_get(cursor, key, data, MDB_LAST));
-	} else return rc;
-}
-
+// Keys and values normally point straight into the iterator, so they're
+// only good until the cursor moves. Stable cursors copy them into a ring of
+// buffers instead, so that the last few results outlive the iterator. The
+// transaction's shared cursor is stable because callers chain db_get calls
+// (including the ones inside db_read_string) and keep the earlier results.
 #define LDB_BUF_RECALL (10*2)
 struct LDB_cursor {
 	leveldb_iterator_t *iter;
-	MDB_cmp_func *cmp;
+	DB_cmp_func *cmp;
 	unsigned char valid;
+	unsigned char stable;
 	unsigned char offset;
 	char *bufs[LDB_BUF_RECALL];
+	size_t sizes[LDB_BUF_RECALL];
+	char *target; // Seek key, which might point into the iterator.
+	size_t tsize;
 };
 static void ldb_cursor_close(LDB_cursor *const cursor);
-static int ldb_cursor_open(leveldb_t *const db, leveldb_readoptions_t *const ropts, MDB_cmp_func *const cmp, LDB_cursor **const out) {
+static int ldb_cursor_open(leveldb_t *const db, leveldb_readoptions_t *const ropts, DB_cmp_func *const cmp, LDB_cursor **const out) {
 	if(!db) return DB_EINVAL;
 	if(!ropts) return DB_EINVAL;
 	if(!cmp) return DB_EINVAL;
@@ -143,11 +270,15 @@ static int ldb_cursor_open(leveldb_t *const db, leveldb_readoptions_t *const rop
 static void ldb_cursor_close(LDB_cursor *const cursor) {
 	if(!cursor) return;
 	for(unsigned i = 0; i < LDB_BUF_RECALL; ++i) {
-		leveldb_free(cursor->bufs[i]); cursor->bufs[i] = NULL;
+		free(cursor->bufs[i]); cursor->bufs[i] = NULL;
+		cursor->sizes[i] = 0;
 	}
+	free(cursor->target); cursor->target = NULL;
+	cursor->tsize = 0;
 	leveldb_iter_destroy(cursor->iter); cursor->iter = NULL;
 	cursor->cmp = NULL;
 	cursor->valid = 0;
+	cursor->stable = 0;
 	cursor->offset = 0;
 	assert_zeroed(cursor, 1);
 	free(cursor);
@@ -157,7 +288,7 @@ static int ldb_cursor_clear(LDB_cursor *const cursor) {
 	cursor->valid = 0;
 	return 0;
 }
-static int ldb_cursor_renew(leveldb_t *const db, leveldb_readoptions_t *const ropts, MDB_cmp_func *const cmp, LDB_cursor **const out) {
+static int ldb_cursor_renew(leveldb_t *const db, leveldb_readoptions_t *const ropts, DB_cmp_func *const cmp, LDB_cursor **const out) {
 	if(!out) return DB_EINVAL;
 	if(!*out) return ldb_cursor_open(db, ropts, cmp, out);
 	LDB_cursor *const cursor = *out;
@@ -169,44 +300,63 @@ static int ldb_cursor_renew(leveldb_t *const db, leveldb_readoptions_t *const ro
 	cursor->offset = 0;
 	return 0;
 }
-static int ldb_cursor_current(LDB_cursor *const cursor, MDB_val *const key, MDB_val *const val) {
+// Buffers are reused in place, so stable reads only allocate while warming up.
+static int ldb_cursor_recall(LDB_cursor *const cursor, char const *const x, size_t const s, DB_val *const out) {
+	unsigned const i = cursor->offset;
+	if(cursor->sizes[i] < s || !cursor->bufs[i]) {
+		size_t const size = s > 32 ? s : 32;
+		char *const y = realloc(cursor->bufs[i], size);
+		if(!y) return DB_ENOMEM;
+		cursor->bufs[i] = y;
+		cursor->sizes[i] = size;
+	}
+	memcpy(cursor->bufs[i], x, s);
+	out->size = s;
+	out->data = cursor->bufs[i];
+	cursor->offset = (cursor->offset + 1) % LDB_BUF_RECALL;
+	return 0;
+}
+static int ldb_cursor_current(LDB_cursor *const cursor, DB_val *const key, DB_val *const val) {
 	if(!cursor) return DB_EINVAL;
 	if(!cursor->valid) return DB_NOTFOUND;
+	int rc;
 	if(key) {
-		leveldb_free(cursor->bufs[cursor->offset]); cursor->bufs[cursor->offset] = NULL;
-
 		size_t s;
-		char const *const x = (char *)leveldb_iter_key(cursor->iter, &s);
-		char *const y = malloc(s);
-		if(!y) return DB_ENOMEM;
-		memcpy(y, x, s);
-
-		cursor->bufs[cursor->offset] = y;
-		key->mv_size = s;
-		key->mv_data = y;
-		cursor->offset = (cursor->offset + 1) % LDB_BUF_RECALL;
+		char const *const x = leveldb_iter_key(cursor->iter, &s);
+		if(cursor->stable) {
+			rc = ldb_cursor_recall(cursor, x, s, key);
+			if(rc < 0) return rc;
+		} else {
+			key->size = s;
+			key->data = (void *)x;
+		}
 	}
 	if(val) {
-		leveldb_free(cursor->bufs[cursor->offset]); cursor->bufs[cursor->offset] = NULL;
-
 		size_t s;
-		char const *const x = (char *)leveldb_iter_value(cursor->iter, &s);
-		char *const y = malloc(s);
-		if(!y) return DB_ENOMEM;
-		memcpy(y, x, s);
-
-		cursor->bufs[cursor->offset] = y;
-		val->mv_size = s;
-		val->mv_data = y;
-		cursor->offset = (cursor->offset + 1) % LDB_BUF_RECALL;
+		char const *const x = leveldb_iter_value(cursor->iter, &s);
+		if(cursor->stable) {
+			rc = ldb_cursor_recall(cursor, x, s, val);
+			if(rc < 0) return rc;
+		} else {
+			val->size = s;
+			val->data = (void *)x;
+		}
 	}
 	return 0;
 }
-static int ldb_cursor_seek(LDB_cursor *const cursor, MDB_val *const key, MDB_val *const val, int const dir) {
+static int ldb_cursor_seek(LDB_cursor *const cursor, DB_val *const key, DB_val *const val, int const dir) {
 	if(!cursor) return DB_EINVAL;
 	if(!key) return DB_EINVAL;
-	MDB_val const orig = *key;
-	leveldb_iter_seek(cursor->iter, key->mv_data, key->mv_size);
+	// The key is often from our own last read, and seeking moves it.
+	if(dir <= 0 && cursor->tsize < key->size) {
+		char *const t = realloc(cursor->target, key->size);
+		if(!t) return DB_ENOMEM;
+		cursor->target = t;
+		cursor->tsize = key->size;
+	}
+	if(dir <= 0) memcpy(cursor->target, key->data, key->size);
+	DB_val const orig = { key->size, dir <= 0 ? cursor->target : key->data };
+	leveldb_iter_seek(cursor->iter, orig.data, orig.size);
 	cursor->valid = !!leveldb_iter_valid(cursor->iter);
 	int rc = ldb_cursor_current(cursor, key, val);
 	if(dir > 0) return rc;
@@ -224,7 +374,7 @@ static int ldb_cursor_seek(LDB_cursor *const cursor, MDB_val *const key, MDB_val
 	cursor->valid = 0;
 	return DB_NOTFOUND;
 }
-static int ldb_cursor_first(LDB_cursor *const cursor, MDB_val *const key, MDB_val *const val, int const dir) {
+static int ldb_cursor_first(LDB_cursor *const cursor, DB_val *const key, DB_val *const val, int const dir) {
 	if(!cursor) return DB_EINVAL;
 	if(0 == dir) return DB_EINVAL;
 	if(dir > 0) leveldb_iter_seek_to_first(cursor->iter);
@@ -232,7 +382,7 @@ static int ldb_cursor_first(LDB_cursor *const cursor, MDB_val *const key, MDB_va
 	cursor->valid = !!leveldb_iter_valid(cursor->iter);
 	return ldb_cursor_current(cursor, key, val);
 }
-static int ldb_cursor_next(LDB_cursor *const cursor, MDB_val *const key, MDB_val *const val, int const dir) {
+static int ldb_cursor_next(LDB_cursor *const cursor, DB_val *const key, DB_val *const val, int const dir) {
 	if(!cursor) return DB_EINVAL;
 	if(!cursor->valid) return ldb_cursor_first(cursor, key, val, dir);
 	if(0 == dir) return DB_EINVAL;
@@ -271,12 +421,6 @@ int db_env_create(DB_env **const out) {
 	}
 	leveldb_options_set_filter_policy(env->opts, env->filterpolicy);
 
-	int rc = mdberr(mdb_env_create(&env->tmpenv));
-	if(rc < 0) {
-		db_env_close(env);
-		return rc;
-	}
-
 	env->wopts = leveldb_writeoptions_create();
 	if(!env->wopts) {
 		db_env_close(env);
@@ -291,6 +435,10 @@ int db_env_create(DB_env **const out) {
 int db_env_set_mapsize(DB_env *const env, size_t const size) {
 	return 0;
 }
+int db_env_set_partitions(DB_env *const env, DB_partition const *const partitions, size_t const count) {
+	// Separate LevelDB instances couldn't commit atomically.
+	return 0;
+}
 int db_env_open(DB_env *const env, char const *const name, unsigned const flags, unsigned const mode) {
 	if(!env) return DB_EINVAL;
 	char *err = NULL;
@@ -299,31 +447,6 @@ int db_env_open(DB_env *const env, char const *const name, unsigned const flags,
 	leveldb_free(err);
 	if(!env->db || err) return -1; // TODO: Parse error string?
 
-
-	char tmppath[512]; // TODO
-	if(snprintf(tmppath, sizeof(tmppath), "%s/tmp.mdb", name) < 0) return -1;
-	int rc = mdberr(mdb_env_open(env->tmpenv, tmppath, MDB_NOSUBDIR | MDB_WRITEMAP, 0600));
-	if(rc < 0) return rc;
-	(void)unlink(tmppath);
-
-	MDB_txn *tmptxn;
-	rc = mdberr(mdb_txn_begin(env->tmpenv, NULL, MDB_RDWR, &tmptxn));
-	if(rc < 0) return rc;
-	MDB_dbi dbi;
-	rc = mdberr(mdb_dbi_open(tmptxn, NULL, 0, &dbi));
-	if(rc < 0) {
-		mdb_txn_abort(tmptxn);
-		return rc;
-	}
-	if(MDB_MAIN_DBI != dbi) {
-		// Should never happen.
-		mdb_txn_abort(tmptxn);
-		return DB_PANIC;
-	}
-	rc = mdberr(mdb_txn_commit(tmptxn));
-	if(rc < 0) return rc;
-
-
 	leveldb_writeoptions_set_sync(env->wopts, !(DB_NOSYNC & flags));
 	return 0;
 }
@@ -338,7 +461,6 @@ void db_env_close(DB_env *const env) {
 	if(env->db) {
 		leveldb_close(env->db); env->db = NULL;
 	}
-	mdb_env_close(env->tmpenv); env->tmpenv = NULL;
 	if(env->wopts) {
 		leveldb_writeoptions_destroy(env->wopts); env->wopts = NULL;
 	}
@@ -351,24 +473,18 @@ int db_txn_begin(DB_env *const env, DB_txn *const parent, unsigned const flags,
 	if(!env) return DB_EINVAL;
 	if(!out) return DB_EINVAL;
 
-	MDB_txn *tmptxn = NULL;
-	if(!(DB_RDONLY & flags)) {
-		MDB_txn *p = parent ? parent->tmptxn : NULL;
-		int rc = mdberr(mdb_txn_begin(env->tmpenv, p, flags, &tmptxn));
-		if(rc < 0) return rc;
-	}
+	// Nested write transactions would need their own batch layered on
+	// the parent's, and commit never supported them anyway.
+	if(parent && !(DB_RDONLY & flags)) return DB_EINVAL;
 
 	DB_txn *txn = calloc(1, sizeof(struct DB_txn));
-	if(!txn) {
-		mdb_txn_abort(tmptxn);
-		return DB_ENOMEM;
-	}
+	if(!txn) return DB_ENOMEM;
 	txn->env = env;
 	txn->parent = parent;
 	txn->flags = flags;
 	txn->ropts = leveldb_readoptions_create();
 	txn->snapshot = NULL;
-	txn->tmptxn = tmptxn;
+	txn->batch = NULL;
 	if(!txn->ropts) {
 		db_txn_abort(txn);
 		return DB_ENOMEM;
@@ -380,7 +496,11 @@ int db_txn_begin(DB_env *const env, DB_txn *const parent, unsigned const flags,
 			return rc;
 		}
 	} else {
-		txn->tmptxn = tmptxn;
+		int rc = wb_create(env->cmp, &txn->batch);
+		if(rc < 0) {
+			db_txn_abort(txn);
+			return rc;
+		}
 	}
 	*out = txn;
 	return 0;
@@ -392,30 +512,18 @@ int db_txn_commit(DB_txn *const txn) {
 		return 0;
 	}
 
-	if(txn->parent) {
-		assert(0); // TODO
-	}
-
 	leveldb_writebatch_t *batch = leveldb_writebatch_create();
 	if(!batch) {
 		db_txn_abort(txn);
 		return DB_ENOMEM;
 	}
-	assert(txn->tmptxn);
-	MDB_cursor *cursor = NULL;
-	int rc = mdberr(mdb_cursor_open(txn->tmptxn, MDB_MAIN_DBI, &cursor));
-	if(rc < 0) {
-		db_txn_abort(txn);
-		return rc;
-	}
-	MDB_val key[1], data[1];
-	rc = mdberr(mdb_cursor_get(cursor, key, data, MDB_FIRST));
-	for(; rc >= 0; rc = mdberr(mdb_cursor_get(cursor, key, data, MDB_NEXT))) {
+	assert(txn->batch);
+	WB_node const *node = txn->batch->head->next[0];
+	for(; node; node = node->next[0]) {
 		leveldb_writebatch_put(batch,
-			key->mv_data, key->mv_size,
-			data->mv_data, data->mv_size);
+			node->key.data, node->key.size,
+			node->data.data, node->data.size);
 	}
-	mdb_cursor_close(cursor); cursor = NULL;
 
 	char *err = NULL;
 	leveldb_write(txn->env->db, txn->env->wopts, batch, &err);
@@ -436,7 +544,7 @@ void db_txn_abort(DB_txn *const txn) {
 	}
 	leveldb_readoptions_destroy(txn->ropts); txn->ropts = NULL;
 	db_cursor_close(txn->cursor); txn->cursor = NULL;
-	mdb_txn_abort(txn->tmptxn); txn->tmptxn = NULL;
+	wb_free(txn->batch); txn->batch = NULL;
 	txn->env = NULL;
 	txn->parent = NULL;
 	txn->flags = 0;
@@ -468,13 +576,15 @@ int db_txn_get_flags(DB_txn *const txn, unsigned *const flags) {
 }
 int db_txn_cmp(DB_txn *const txn, DB_val const *const a, DB_val const *const b) {
 	assert(txn); // We can't report an error from this function.
-	return txn->env->cmp((MDB_val *)a, (MDB_val *)b);
+	return txn->env->cmp(a, b);
 }
 int db_txn_cursor(DB_txn *const txn, DB_cursor **const out) {
 	if(!txn) return DB_EINVAL;
 	if(!txn->cursor) {
 		int rc = db_cursor_open(txn, &txn->cursor);
 		if(rc < 0) return rc;
+		txn->cursor->stable = 1;
+		txn->cursor->persist->stable = 1;
 	}
 	if(out) *out = txn->cursor;
 	return 0;
@@ -485,20 +595,13 @@ int db_cursor_open(DB_txn *const txn, DB_cursor **const out) {
 	if(!out) return DB_EINVAL;
 	DB_cursor *cursor = calloc(1, sizeof(struct DB_cursor));
 	if(!cursor) return DB_ENOMEM;
-	if(txn->tmptxn) {
-		int rc = mdberr(mdb_cursor_open(txn->tmptxn, MDB_MAIN_DBI, &cursor->pending));
-		if(rc < 0) {
-			db_cursor_close(cursor);
-			return rc;
-		}
-	}
 	*out = cursor;
 	return db_cursor_renew(txn, out);
 }
 void db_cursor_close(DB_cursor *const cursor) {
 	if(!cursor) return;
-	mdb_cursor_close(cursor->pending); cursor->pending = NULL;
 	db_cursor_reset(cursor);
+	cursor->stable = 0;
 	assert_zeroed(cursor, 1);
 	free(cursor);
 }
@@ -506,6 +609,8 @@ void db_cursor_reset(DB_cursor *const cursor) {
 	if(!cursor) return;
 	cursor->txn = NULL;
 	cursor->state = S_INVALID;
+	cursor->pending->batch = NULL;
+	cursor->pending->node = NULL;
 	ldb_cursor_close(cursor->persist); cursor->persist = NULL;
 }
 int db_cursor_renew(DB_txn *const txn, DB_cursor **const out) {
@@ -514,13 +619,16 @@ int db_cursor_renew(DB_txn *const txn, DB_cursor **const out) {
 	DB_cursor *const cursor = *out;
 	cursor->txn = txn;
 	cursor->state = S_INVALID;
+	cursor->pending->batch = txn->batch;
+	cursor->pending->node = NULL;
 	int rc = ldb_cursor_renew(txn->env->db, txn->ropts, txn->env->cmp, &cursor->persist);
 	if(rc < 0) return rc;
+	cursor->persist->stable = cursor->stable;
 	return 0;
 }
 int db_cursor_clear(DB_cursor *const cursor) {
 	if(!cursor) return DB_EINVAL;
-	if(!cursor->pending) {
+	if(!cursor->pending->batch) {
 		return ldb_cursor_clear(cursor->persist);
 	} else {
 		cursor->state = S_INVALID;
@@ -533,10 +641,10 @@ int db_cursor_cmp(DB_cursor *const cursor, DB_val const *const a, DB_val const *
 
 
 
-static int db_cursor_update(DB_cursor *const cursor, int const rc1, MDB_val const *const k1, MDB_val const *const d1, int const rc2, MDB_val const *const k2, MDB_val const *const d2, int const dir, DB_val *const key, DB_val *const data) {
-	if(!cursor->pending) {
-		if(key) *key = *(DB_val *)k2;
-		if(data) *data = *(DB_val *)d2;
+static int db_cursor_update(DB_cursor *const cursor, int const rc1, DB_val const *const k1, DB_val const *const d1, int const rc2, DB_val const *const k2, DB_val const *const d2, int const dir, DB_val *const key, DB_val *const data) {
+	if(!cursor->pending->batch) {
+		if(key) *key = *k2;
+		if(data) *data = *d2;
 		return rc2;
 	}
 	cursor->state = S_INVALID;
@@ -549,23 +657,21 @@ static int db_cursor_update(DB_cursor *const cursor, int const rc1, MDB_val cons
 	if(0 == x) x = cursor->txn->env->cmp(k1, k2) * (dir ? dir : 1);
 	if(x <= 0) {
 		cursor->state = 0 == x ? S_EQUAL : S_PENDING;
-		if(key) *key = *(DB_val *)k1;
-		if(data) *data = *(DB_val *)d1;
+		if(key) *key = *k1;
+		if(data) *data = *d1;
 	} else {
 		cursor->state = S_PERSIST;
-		if(key) *key = *(DB_val *)k2;
-		if(data) *data = *(DB_val *)d2;
+		if(key) *key = *k2;
+		if(data) *data = *d2;
 	}
 	return 0;
 }
 int db_cursor_current(DB_cursor *const cursor, DB_val *const key, DB_val *const data) {
 	if(!cursor) return DB_EINVAL;
-	if(!cursor->pending || S_PERSIST == cursor->state) {
-		return ldb_cursor_current(cursor->persist, (MDB_val *)key, (MDB_val *)data);
+	if(!cursor->pending->batch || S_PERSIST == cursor->state) {
+		return ldb_cursor_current(cursor->persist, key, data);
 	} else if(S_EQUAL == cursor->state || S_PENDING == cursor->state) {
-		int rc = mdberr(mdb_cursor_get(cursor->pending, (MDB_val *)key, (MDB_val *)data, MDB_GET_CURRENT));
-		if(DB_EINVAL == rc) return DB_NOTFOUND;
-		return rc;
+		return wb_cursor_current(cursor->pending, key, data);
 	} else if(S_INVALID == cursor->state) {
 		return DB_NOTFOUND;
 	} else {
@@ -575,18 +681,17 @@ int db_cursor_current(DB_cursor *const cursor, DB_val *const key, DB_val *const
 }
 int db_cursor_seek(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
 	if(!cursor) return DB_EINVAL;
-	MDB_val k1 = *(MDB_val *)key, d1;
-	MDB_val k2 = *(MDB_val *)key, d2;
-	int rc1 = mdberr(mdb_cursor_seek(cursor->pending, &k1, &d1, dir));
+	DB_val k1 = *key, d1;
+	DB_val k2 = *key, d2;
+	int rc1 = wb_cursor_seek(cursor->pending, &k1, &d1, dir);
 	int rc2 =        ldb_cursor_seek(cursor->persist, &k2, &d2, dir);
 	return db_cursor_update(cursor, rc1, &k1, &d1, rc2, &k2, &d2, dir, key, data);
 }
 int db_cursor_first(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
 	if(!cursor) return DB_EINVAL;
 	if(0 == dir) return DB_EINVAL;
-	MDB_val k1, d1, k2, d2;
-	MDB_cursor_op const op = dir < 0 ? MDB_LAST : MDB_FIRST;
-	int rc1 = mdberr(mdb_cursor_get(cursor->pending, &k1, &d1, op));
+	DB_val k1, d1, k2, d2;
+	int rc1 = wb_cursor_first(cursor->pending, &k1, &d1, dir);
 	int rc2 =        ldb_cursor_first(cursor->persist, &k2, &d2, dir);
 	return db_cursor_update(cursor, rc1, &k1, &d1, rc2, &k2, &d2, dir, key, data);
 }
@@ -594,13 +699,11 @@ int db_cursor_next(DB_cursor *const cursor, DB_val *const key, DB_val *const dat
 	if(!cursor) return DB_EINVAL;
 	if(0 == dir) return DB_EINVAL;
 	int rc1, rc2;
-	MDB_val k1, d1, k2, d2;
+	DB_val k1, d1, k2, d2;
 	if(S_PERSIST != cursor->state) {
-		MDB_cursor_op const op = dir < 0 ? MDB_PREV : MDB_NEXT;
-		rc1 = mdberr(mdb_cursor_get(cursor->pending, &k1, &d1, op));
+		rc1 = wb_cursor_next(cursor->pending, &k1, &d1, dir);
 	} else {
-		rc1 = mdberr(mdb_cursor_get(cursor->pending, &k1, &d1, MDB_GET_CURRENT));
-		if(DB_EINVAL == rc1) rc1 = DB_NOTFOUND;
+		rc1 = wb_cursor_current(cursor->pending, &k1, &d1);
 	}
 	if(S_PENDING != cursor->state) {
 		rc2 = ldb_cursor_next(cursor->persist, &k2, &d2, dir);
@@ -624,8 +727,8 @@ int db_cursor_put(DB_cursor *const cursor, DB_val *const key, DB_val *const data
 		if(DB_NOTFOUND != rc) return rc;
 	}
 	cursor->state = S_INVALID;
-	assert(cursor->pending);
-	return mdberr(mdb_cursor_put(cursor->pending, (MDB_val *)key, (MDB_val *)data, 0));
+	assert(cursor->pending->batch);
+	return wb_put(cursor->pending->batch, key, data);
 }
 int db_cursor_del(DB_cursor *const cursor) {
 	return DB_EINVAL; // TODO
@@ -16,6 +16,9 @@ int db_env_create(DB_env **const out) {
 int db_env_set_mapsize(DB_env *const env, size_t const size) {
 	return mdberr(lsmdb_env_set_mapsize((LSMDB_env *)env, size));
 }
+int db_env_set_partitions(DB_env *const env, DB_partition const *const partitions, size_t const count) {
+	return 0;
+}
 int db_env_open(DB_env *const env, char const *const name, unsigned const flags, unsigned const mode) {
 	return mdberr(lsmdb_env_open((LSMDB_env *)env, name, flags | MDB_NOSUBDIR, mode));
 }
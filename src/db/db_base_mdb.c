@@ -3,57 +3,128 @@
 
 #include <assert.h>
 #include <stdlib.h>
-#include "db_base.h"
+#include <string.h>
+#include "db_partition.h"
 #include "../../deps/lsmdb/liblmdb/lmdb.h"
 
 // MDB private definition but seems unlikely to change.
 // We double check it at run time and return an error if it's different.
 #define MDB_MAIN_DBI 1
 
+// Partitions (see db_env_set_partitions) are named sub-databases, so each
+// table group gets its own B-tree. Databases from before partitioning keep
+// everything in the main database instead.
+#define NONE DB_PARTITIONS_MAX
+
+struct DB_env {
+	MDB_env *env;
+	DB_partitions parts[1];
+	MDB_dbi dbis[DB_PARTITIONS_MAX];
+	unsigned count; // Sub-databases in use, or 0 if not open yet.
+};
 struct DB_txn {
+	DB_env *env;
 	MDB_txn *txn;
 	unsigned flags;
 	DB_cursor *cursor;
 };
+struct DB_cursor {
+	DB_txn *txn;
+	MDB_cursor *cursors[DB_PARTITIONS_MAX]; // Opened as needed.
+	unsigned part; // Whose cursor is positioned, or NONE.
+	uint64_t table; // Of the current key, if partitioned.
+};
 
 static int mdberr(int const rc) {
 	return rc <= 0 ? rc : -rc;
 }
 
 int db_env_create(DB_env **const out) {
-	return mdberr(mdb_env_create((MDB_env **)out));
+	if(!out) return DB_EINVAL;
+	DB_env *env = calloc(1, sizeof(struct DB_env));
+	if(!env) return DB_ENOMEM;
+	int rc = mdberr(mdb_env_create(&env->env));
+	if(rc < 0) {
+		free(env);
+		return rc;
+	}
+	db_partitions_init(env->parts, NULL, 0);
+	*out = env;
+	return 0;
 }
 int db_env_set_mapsize(DB_env *const env, size_t const size) {
-	return mdberr(mdb_env_set_mapsize((MDB_env *)env, size));
+	if(!env) return DB_EINVAL;
+	return mdberr(mdb_env_set_mapsize(env->env, size));
+}
+int db_env_set_partitions(DB_env *const env, DB_partition const *const partitions, size_t const count) {
+	if(!env) return DB_EINVAL;
+	if(env->count) return DB_EINVAL;
+	return db_partitions_init(env->parts, partitions, count);
 }
 int db_env_open(DB_env *const env, char const *const name, unsigned const flags, unsigned const mode) {
-	int rc = mdberr(mdb_env_open((MDB_env *)env, name, flags | MDB_NOSUBDIR, mode));
+	if(!env) return DB_EINVAL;
+	DB_partitions const *const parts = env->parts;
+	int rc = mdberr(mdb_env_set_maxdbs(env->env, DB_PARTITIONS_MAX));
+	if(rc < 0) return rc;
+	rc = mdberr(mdb_env_open(env->env, name, flags | MDB_NOSUBDIR, mode));
 	if(rc < 0) return rc;
 	MDB_txn *txn;
-	rc = mdberr(mdb_txn_begin((MDB_env *)env, NULL, 0, &txn));
+	rc = mdberr(mdb_txn_begin(env->env, NULL, 0, &txn));
 	if(rc < 0) return rc;
 	MDB_dbi dbi;
 	rc = mdberr(mdb_dbi_open(txn, NULL, 0, &dbi));
-	mdb_txn_abort(txn);
+	if(rc < 0) goto cleanup;
+	if(MDB_MAIN_DBI != dbi) rc = DB_PANIC;
+	if(rc < 0) goto cleanup;
+	MDB_stat stats;
+	rc = mdberr(mdb_stat(txn, dbi, &stats));
+	if(rc < 0) goto cleanup;
+
+	// Once partitioned, the main database only holds their names, and
+	// they have to match exactly or tables would end up in the wrong place.
+	rc = mdberr(mdb_dbi_open(txn, parts->names[0], 0, &dbi));
+	if(DB_NOTFOUND == rc && (stats.ms_entries || parts->count < 2)) {
+		env->dbis[0] = MDB_MAIN_DBI;
+		env->count = 1;
+		rc = mdberr(mdb_txn_commit(txn)); txn = NULL;
+		return rc;
+	}
+	if(rc < 0 && DB_NOTFOUND != rc) goto cleanup;
+	unsigned const create = DB_NOTFOUND == rc ? MDB_CREATE : 0;
+	rc = 0;
+	if(!create && stats.ms_entries != parts->count) rc = DB_VERSION_MISMATCH;
+	for(unsigned i = 0; rc >= 0 && i < parts->count; ++i) {
+		rc = mdberr(mdb_dbi_open(txn, parts->names[i], create, &env->dbis[i]));
+		if(DB_NOTFOUND == rc) rc = DB_VERSION_MISMATCH;
+	}
+	if(rc < 0) goto cleanup;
+	rc = mdberr(mdb_txn_commit(txn)); txn = NULL;
 	if(rc < 0) return rc;
-	if(MDB_MAIN_DBI != dbi) return DB_PANIC;
+	env->count = parts->count;
 	return 0;
+cleanup:
+	mdb_txn_abort(txn); txn = NULL;
+	return rc;
 }
 void db_env_close(DB_env *const env) {
-	mdb_env_close((MDB_env *)env);
+	if(!env) return;
+	mdb_env_close(env->env);
+	free(env);
 }
 
 int db_txn_begin(DB_env *const env, DB_txn *const parent, unsigned const flags, DB_txn **const out) {
+	if(!env) return DB_EINVAL;
 	if(!out) return DB_EINVAL;
 	MDB_txn *const psub = parent ? parent->txn : NULL;
 	MDB_txn *subtxn;
-	int rc = mdberr(mdb_txn_begin((MDB_env *)env, psub, flags, &subtxn));
+	int rc = mdberr(mdb_txn_begin(env->env, psub, flags, &subtxn));
 	if(rc < 0) return rc;
 	DB_txn *txn = malloc(sizeof(struct DB_txn));
 	if(!txn) {
 		mdb_txn_abort(subtxn);
 		return DB_ENOMEM;
 	}
+	txn->env = env;
 	txn->txn = subtxn;
 	txn->flags = flags;
 	txn->cursor = NULL;
@@ -89,7 +160,7 @@ int db_txn_renew(DB_txn *const txn) {
 }
 int db_txn_get_flags(DB_txn *const txn, unsigned *const flags) {
 	if(!txn) return DB_EINVAL;
-	if(flags) *flags = txn->flags;
+	if(flags) *flags = txn->flags | (txn->env->count > 1 ? DB_PARTITIONED : 0);
 	return 0;
 }
 int db_txn_cmp(DB_txn *const txn, DB_val const *const a, DB_val const *const b) {
@@ -106,38 +177,86 @@ int db_txn_cursor(DB_txn *const txn, DB_cursor **const out) {
 }
 
 int db_cursor_open(DB_txn *const txn, DB_cursor **const out) {
-	return mdberr(mdb_cursor_open(txn->txn, MDB_MAIN_DBI, (MDB_cursor **)out));
+	if(!txn) return DB_EINVAL;
+	if(!out) return DB_EINVAL;
+	DB_cursor *cursor = calloc(1, sizeof(struct DB_cursor));
+	if(!cursor) return DB_ENOMEM;
+	cursor->txn = txn;
+	cursor->part = NONE;
+	*out = cursor;
+	return 0;
 }
 void db_cursor_close(DB_cursor *const cursor) {
-	mdb_cursor_close((MDB_cursor *)cursor);
+	if(!cursor) return;
+	for(unsigned i = 0; i < DB_PARTITIONS_MAX; ++i) {
+		if(cursor->cursors[i]) mdb_cursor_close(cursor->cursors[i]);
+		cursor->cursors[i] = NULL;
+	}
+	free(cursor);
 }
 void db_cursor_reset(DB_cursor *const cursor) {
 	// Do nothing.
 }
 int db_cursor_renew(DB_txn *const txn, DB_cursor **const out) {
 	if(!out) return DB_EINVAL;
-	if(*out) return mdberr(mdb_cursor_renew(txn->txn, (MDB_cursor *)*out));
-	return mdberr(mdb_cursor_open(txn->txn, MDB_MAIN_DBI, (MDB_cursor **)out));
+	if(!*out) return db_cursor_open(txn, out);
+	DB_cursor *const cursor = *out;
+	cursor->txn = txn;
+	cursor->part = NONE;
+	for(unsigned i = 0; i < DB_PARTITIONS_MAX; ++i) {
+		if(!cursor->cursors[i]) continue;
+		int rc = mdberr(mdb_cursor_renew(txn->txn, cursor->cursors[i]));
+		if(rc < 0) return rc;
+	}
+	return 0;
 }
 int db_cursor_clear(DB_cursor *const cursor) {
-	return mdberr(mdb_cursor_renew(mdb_cursor_txn((MDB_cursor *)cursor), (MDB_cursor *)cursor));
+	if(!cursor) return DB_EINVAL;
+	cursor->part = NONE;
+	return 0;
 }
 int db_cursor_cmp(DB_cursor *const cursor, DB_val const *const a, DB_val const *const b) {
 	assert(cursor);
-	return mdb_cmp(mdb_cursor_txn((MDB_cursor *)cursor), MDB_MAIN_DBI, (MDB_val const *)a, (MDB_val const *)b);
+	return db_txn_cmp(cursor->txn, a, b);
 }
 
-int db_cursor_current(DB_cursor *const cursor, DB_val *const key, DB_val *const data) {
-	if(!cursor) return DB_EINVAL;
-	int rc = mdberr(mdb_cursor_get((MDB_cursor *)cursor, (MDB_val *)key, (MDB_val *)data, MDB_GET_CURRENT));
-	if(DB_EINVAL == rc) return DB_NOTFOUND;
+static int cursor_for(DB_cursor *const cursor, unsigned const part, MDB_cursor **const out) {
+	if(!cursor->cursors[part]) {
+		DB_txn *const txn = cursor->txn;
+		int rc = mdberr(mdb_cursor_open(txn->txn, txn->env->dbis[part], &cursor->cursors[part]));
+		if(rc < 0) return rc;
+	}
+	*out = cursor->cursors[part];
+	return 0;
+}
+static int cursor_position(DB_cursor *const cursor, unsigned const part, MDB_val const *const k, MDB_val const *const d, DB_val *const key, DB_val *const data) {
+	cursor->part = part;
+	cursor->table = 0;
+	if(cursor->txn->env->count > 1) {
+		db_table_decode(k->mv_data, k->mv_size, &cursor->table);
+	}
+	if(key) *key = *(DB_val const *)k;
+	if(data) *data = *(DB_val const *)d;
+	return 0;
+}
+// MDB keeps a cursor's EOF flag even if keys are added after it, which
+// only matters in write transactions. Reposition before trusting it.
+static int sub_step(DB_txn *const txn, MDB_cursor *const c, MDB_val *const k, MDB_val *const d, MDB_cursor_op const op) {
+	int const rdonly = txn->flags & DB_RDONLY;
+	int rc;
+	if(MDB_LAST == op && !rdonly) {
+		rc = mdberr(mdb_cursor_get(c, k, d, MDB_FIRST));
+		if(rc < 0) return rc;
+	}
+	rc = mdberr(mdb_cursor_get(c, k, d, op));
+	if(MDB_NEXT != op || DB_NOTFOUND != rc || rdonly) return rc;
+	rc = mdberr(mdb_cursor_get(c, k, d, MDB_GET_CURRENT));
+	if(rc >= 0) rc = mdberr(mdb_cursor_get(c, k, d, MDB_SET));
+	if(rc >= 0) rc = mdberr(mdb_cursor_get(c, k, d, MDB_NEXT));
 	return rc;
 }
-int db_cursor_seek(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
-	if(!key) return DB_EINVAL;
-	MDB_cursor *const c = (MDB_cursor *)cursor;
-	MDB_val *const k = (MDB_val *)key;
-	MDB_val *const d = (MDB_val *)data;
+// Positions one sub-database's cursor, with the same rules as seeking.
+static int sub_seek(MDB_cursor *const c, MDB_val *const k, MDB_val *const d, int const dir) {
 	MDB_val const orig = *k;
 	MDB_cursor_op const op = 0 == dir ? MDB_SET : MDB_SET_RANGE;
 	int rc = mdberr(mdb_cursor_get(c, k, d, op));
@@ -145,32 +264,136 @@ int db_cursor_seek(DB_cursor *const cursor, DB_val *const key, DB_val *const dat
 	if(rc >= 0) {
 		MDB_txn *const txn = mdb_cursor_txn(c);
 		if(0 == mdb_cmp(txn, MDB_MAIN_DBI, &orig, k)) return rc;
-		return mdb_cursor_get(c, k, d, MDB_PREV);
+		return mdberr(mdb_cursor_get(c, k, d, MDB_PREV));
 	} else if(DB_NOTFOUND == rc) {
 		return mdberr(mdb_cursor_get(c, k, d, MDB_LAST));
 	} else return rc;
 }
-int db_cursor_first(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
-	if(0 == dir) return DB_EINVAL;
-	MDB_cursor_op const op = dir < 0 ? MDB_FIRST : MDB_LAST;
+// Finds the nearest key across every sub-database. With no bound, that's
+// the first or last key overall. Going backward, an exclusive bound skips
+// a key equal to it.
+static int cursor_cross(DB_cursor *const cursor, MDB_val const *const bound, int const excl, int const dir, DB_val *const key, DB_val *const data) {
+	MDB_txn *const txn = cursor->txn->txn;
+	unsigned best = NONE;
+	MDB_val bk = { 0, NULL }, bd = { 0, NULL };
+	cursor->part = NONE;
+	for(unsigned i = 0; i < cursor->txn->env->count; ++i) {
+		MDB_cursor *c;
+		MDB_val k, d;
+		int rc = cursor_for(cursor, i, &c);
+		if(rc < 0) return rc;
+		if(bound) {
+			k = *bound;
+			rc = sub_seek(c, &k, &d, dir);
+			if(rc >= 0 && dir < 0 && excl && 0 == mdb_cmp(txn, MDB_MAIN_DBI, &k, bound)) {
+				rc = mdberr(mdb_cursor_get(c, &k, &d, MDB_PREV));
+			}
+		} else {
+			rc = sub_step(cursor->txn, c, &k, &d, dir > 0 ? MDB_FIRST : MDB_LAST);
+		}
+		if(DB_NOTFOUND == rc) continue;
+		if(rc < 0) return rc;
+		if(NONE != best && mdb_cmp(txn, MDB_MAIN_DBI, &k, &bk) * dir >= 0) continue;
+		best = i;
+		bk = k;
+		bd = d;
+	}
+	if(NONE == best) return DB_NOTFOUND;
+	return cursor_position(cursor, best, &bk, &bd, key, data);
+}
+static int cursor_next_table(DB_cursor *const cursor, uint64_t const table, int const dir, DB_val *const key, DB_val *const data) {
+	unsigned char buf[DB_TABLE_MAX];
+	MDB_val bound = { 0, buf };
+	if(dir > 0) {
+		cursor->part = NONE;
+		if(UINT64_MAX == table) return DB_NOTFOUND;
+		bound.mv_size = db_table_encode(table+1, buf);
+	} else {
+		bound.mv_size = db_table_encode(table, buf);
+	}
+	return cursor_cross(cursor, &bound, 1, dir, key, data);
+}
+
+int db_cursor_current(DB_cursor *const cursor, DB_val *const key, DB_val *const data) {
+	if(!cursor) return DB_EINVAL;
+	if(NONE == cursor->part) return DB_NOTFOUND;
 	MDB_val _k[1], _d[1];
 	MDB_val *const k = key ? (MDB_val *)key : _k;
 	MDB_val *const d = data ? (MDB_val *)data : _d;
-	return mdberr(mdb_cursor_get((MDB_cursor *)cursor, (MDB_val *)k, (MDB_val *)d, op));
+	int rc = mdberr(mdb_cursor_get(cursor->cursors[cursor->part], k, d, MDB_GET_CURRENT));
+	if(DB_EINVAL == rc) return DB_NOTFOUND;
+	return rc;
+}
+int db_cursor_seek(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
+	if(!cursor) return DB_EINVAL;
+	if(!key) return DB_EINVAL;
+	DB_env *const env = cursor->txn->env;
+	uint64_t table = 0;
+	unsigned part = 0;
+	if(env->count > 1) {
+		if(db_table_decode(key->data, key->size, &table)) {
+			part = db_partitions_key(env->parts, key);
+		} else if(0 != dir) {
+			return cursor_cross(cursor, (MDB_val *)key, 0, dir, key, data);
+		}
+	}
+	MDB_cursor *c;
+	int rc = cursor_for(cursor, part, &c);
+	if(rc < 0) return rc;
+	MDB_val k = *(MDB_val *)key, d;
+	rc = sub_seek(c, &k, &d, dir);
+	cursor->part = NONE;
+	if(rc < 0 && DB_NOTFOUND != rc) return rc;
+	if(env->count < 2 || 0 == dir) {
+		if(rc < 0) return rc;
+		return cursor_position(cursor, part, &k, &d, key, data);
+	}
+	uint64_t t;
+	if(rc >= 0 && db_table_decode(k.mv_data, k.mv_size, &t) && t == table) {
+		return cursor_position(cursor, part, &k, &d, key, data);
+	}
+	// Nothing left in this table, so look at the neighboring ones.
+	return cursor_next_table(cursor, table, dir, key, data);
+}
+int db_cursor_first(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
+	if(!cursor) return DB_EINVAL;
+	if(0 == dir) return DB_EINVAL;
+	return cursor_cross(cursor, NULL, 0, dir, key, data);
 }
 int db_cursor_next(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
+	if(!cursor) return DB_EINVAL;
 	if(0 == dir) return DB_EINVAL;
+	if(NONE == cursor->part) return db_cursor_first(cursor, key, data, dir);
+	unsigned const part = cursor->part;
 	MDB_cursor_op const op = dir < 0 ? MDB_PREV : MDB_NEXT;
-	MDB_val _k[1], _d[1];
-	MDB_val *const k = key ? (MDB_val *)key : _k;
-	MDB_val *const d = data ? (MDB_val *)data : _d;
-	return mdberr(mdb_cursor_get((MDB_cursor *)cursor, (MDB_val *)key, (MDB_val *)data, op));
+	MDB_val k, d;
+	int rc = sub_step(cursor->txn, cursor->cursors[part], &k, &d, op);
+	cursor->part = NONE;
+	if(rc < 0 && DB_NOTFOUND != rc) return rc;
+	if(cursor->txn->env->count < 2) {
+		if(rc < 0) return rc;
+		return cursor_position(cursor, part, &k, &d, key, data);
+	}
+	uint64_t t;
+	if(rc >= 0 && db_table_decode(k.mv_data, k.mv_size, &t) && t == cursor->table) {
+		return cursor_position(cursor, part, &k, &d, key, data);
+	}
+	return cursor_next_table(cursor, cursor->table, dir, key, data);
 }
 
 int db_cursor_put(DB_cursor *const cursor, DB_val *const key, DB_val *const data, unsigned const flags) {
-	return mdberr(mdb_cursor_put((MDB_cursor *)cursor, (MDB_val *)key, (MDB_val *)data, flags));
+	if(!cursor) return DB_EINVAL;
+	if(!key) return DB_EINVAL;
+	DB_env *const env = cursor->txn->env;
+	unsigned const part = env->count > 1 ? db_partitions_key(env->parts, key) : 0;
+	// Putting through the MDB cursor can leave a stale EOF flag on it,
+	// which breaks later first/next calls. Write through the txn instead
+	// and leave the cursor unpositioned, like the other back-ends do.
+	cursor->part = NONE;
+	return mdberr(mdb_put(cursor->txn->txn, env->dbis[part], (MDB_val *)key, (MDB_val *)data, flags));
 }
 int db_cursor_del(DB_cursor *const cursor) {
-	return mdberr(mdb_cursor_del((MDB_cursor *)cursor, 0));
+	if(!cursor) return DB_EINVAL;
+	if(NONE == cursor->part) return DB_EINVAL;
+	return mdberr(mdb_cursor_del(cursor->cursors[cursor->part], 0));
 }
-
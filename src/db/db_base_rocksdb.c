@@ -0,0 +1,810 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <rocksdb/c.h>
+#include "db_partition.h"
+
+// TODO
+#define assert_zeroed(buf, count) do { \
+	for(size_t i = 0; i < sizeof(*(buf)) * (count); ++i) { \
+		if(0 == ((char const *)(buf))[i]) continue; \
+		fprintf(stderr, "%s:%d Buffer at %p not zeroed (%ld)\n", \
+			__FILE__, __LINE__, (buf), i); \
+		abort(); \
+	} \
+} while(0)
+
+// Each partition (see db_env_set_partitions) is a column family. They
+// share one block cache unless they ask for their own. Compaction is rate
+// limited so that bulk pulls don't starve reads, and writes are slowed down
+// long before RocksDB would have to stop them outright.
+#define RDB_CACHE_SIZE (1024 * 1024 * 256)
+#define RDB_WRITE_BUFFER (1024 * 1024 * 64)
+#define RDB_BLOCK_SIZE (1024 * 16)
+#define RDB_BLOOM_BITS 10
+#define RDB_COMPACTION_RATE (1024 * 1024 * 64) // Bytes per second.
+#define RDB_BACKGROUND_THREADS 4
+#define RDB_PENDING_SOFT (1024ULL * 1024 * 1024 * 64)
+#define RDB_PENDING_HARD (1024ULL * 1024 * 1024 * 256)
+
+typedef enum {
+	S_INVALID = 0,
+	S_ITER, // Positioned by an iterator.
+	S_KEY, // Positioned by a copy of the key, after a point lookup.
+} DB_state;
+
+typedef int DB_cmp_func(DB_val const *const a, DB_val const *const b);
+
+struct DB_env {
+	rocksdb_options_t *opts;
+	DB_partitions parts[1];
+	rocksdb_options_t *cfopts[DB_PARTITIONS_MAX];
+	rocksdb_cache_t *cache;
+	rocksdb_cache_t *caches[DB_PARTITIONS_MAX]; // Partitions' own.
+	rocksdb_ratelimiter_t *limiter;
+	rocksdb_t *db;
+	rocksdb_column_family_handle_t *cf[DB_PARTITIONS_MAX];
+	unsigned count; // 1 for databases from before column families.
+	rocksdb_writeoptions_t *wopts;
+	DB_cmp_func *cmp;
+};
+struct DB_txn {
+	DB_env *env;
+	DB_txn *parent;
+	unsigned flags;
+	rocksdb_readoptions_t *ropts; // Prefix seeks, within one table.
+	rocksdb_readoptions_t *total; // Total order, for crossing tables.
+	rocksdb_snapshot_t const *snapshot;
+	rocksdb_writebatch_wi_t *batch; // Pending writes, or NULL if read-only.
+	uint64_t gen; // Bumped by every write, so cursors can rebuild iterators.
+	DB_cursor *cursor;
+};
+
+// Stable cursors copy keys and values into a ring of buffers, so that the
+// last few results outlive the iterator. Cursors in write transactions
+// always do, since values from the batch move when it grows.
+#define RDB_BUF_RECALL (10*2)
+struct DB_cursor {
+	DB_txn *txn;
+	DB_state state;
+	rocksdb_iterator_t *prefix[DB_PARTITIONS_MAX];
+	rocksdb_iterator_t *total[DB_PARTITIONS_MAX];
+	rocksdb_iterator_t *iter; // One of the above, if S_ITER.
+	uint64_t table; // Of the current key.
+	uint64_t gen;
+	char *got; // Value from a point lookup, if S_KEY.
+	size_t gsize;
+	char *pos; // Current key, if S_KEY or in a write transaction.
+	size_t psize;
+	size_t pcap;
+	unsigned char stable;
+	unsigned char offset;
+	char *bufs[RDB_BUF_RECALL];
+	size_t sizes[RDB_BUF_RECALL];
+};
+
+
+static int compare_default(DB_val const *const a, DB_val const *const b) {
+	size_t const min = a->size < b->size ? a->size : b->size;
+	int x = memcmp(a->data, b->data, min);
+	if(0 != x) return x;
+	if(a->size < b->size) return -1;
+	if(a->size > b->size) return +1;
+	return 0;
+}
+
+static void prefix_destroy(void *ctx) {}
+static char *prefix_transform(void *ctx, char const *const key, size_t const length, size_t *const dst_length) {
+	*dst_length = db_table_decode(key, length, NULL);
+	return (char *)key;
+}
+static unsigned char prefix_in_domain(void *ctx, char const *const key, size_t const length) {
+	return db_table_decode(key, length, NULL) > 0;
+}
+static unsigned char prefix_in_range(void *ctx, char const *const key, size_t const length) {
+	return length > 0 && db_table_decode(key, length, NULL) == length;
+}
+static char const *prefix_name(void *ctx) {
+	return "stronglink.TableID"; // Stored in SST files, so don't change it.
+}
+
+static rocksdb_options_t *rdb_cf_options(DB_env *const env, unsigned const part) {
+	rocksdb_options_t *const opts = rocksdb_options_create();
+	if(!opts) return NULL;
+	size_t const buffer = env->parts->write_buffer[part] ?
+		env->parts->write_buffer[part] : RDB_WRITE_BUFFER;
+	rocksdb_cache_t *const cache = env->caches[part] ?
+		env->caches[part] : env->cache;
+	rocksdb_options_set_compression(opts, rocksdb_snappy_compression);
+	rocksdb_options_set_write_buffer_size(opts, buffer);
+	rocksdb_options_set_max_write_buffer_number(opts, 4);
+	rocksdb_options_set_target_file_size_base(opts, buffer);
+	rocksdb_options_set_max_bytes_for_level_base(opts, buffer * 8);
+	rocksdb_options_set_level0_file_num_compaction_trigger(opts, 4);
+	rocksdb_options_set_level0_slowdown_writes_trigger(opts, 20);
+	rocksdb_options_set_level0_stop_writes_trigger(opts, 36);
+	rocksdb_options_set_soft_pending_compaction_bytes_limit(opts, RDB_PENDING_SOFT);
+	rocksdb_options_set_hard_pending_compaction_bytes_limit(opts, RDB_PENDING_HARD);
+
+	// Prefix blooms let seeks skip files that don't have the table at all.
+	// The options take ownership of the transform and the filter policy.
+	rocksdb_slicetransform_t *const prefix = rocksdb_slicetransform_create(NULL, prefix_destroy, prefix_transform, prefix_in_domain, prefix_in_range, prefix_name);
+	rocksdb_block_based_table_options_t *const table = rocksdb_block_based_options_create();
+	rocksdb_filterpolicy_t *const filter = rocksdb_filterpolicy_create_bloom_full(RDB_BLOOM_BITS);
+	if(!prefix || !table || !filter) {
+		if(prefix) rocksdb_slicetransform_destroy(prefix);
+		if(table) rocksdb_block_based_options_destroy(table);
+		if(filter) rocksdb_filterpolicy_destroy(filter);
+		rocksdb_options_destroy(opts);
+		return NULL;
+	}
+	rocksdb_options_set_prefix_extractor(opts, prefix);
+	rocksdb_options_set_memtable_prefix_bloom_size_ratio(opts, 0.05);
+	rocksdb_block_based_options_set_filter_policy(table, filter);
+	rocksdb_block_based_options_set_whole_key_filtering(table, 1);
+	rocksdb_block_based_options_set_block_cache(table, cache);
+	rocksdb_block_based_options_set_block_size(table, RDB_BLOCK_SIZE);
+	rocksdb_block_based_options_set_cache_index_and_filter_blocks(table, 1);
+	rocksdb_block_based_options_set_pin_l0_filter_and_index_blocks_in_cache(table, 1);
+	rocksdb_options_set_block_based_table_factory(opts, table);
+	rocksdb_block_based_options_destroy(table);
+	return opts;
+}
+
+
+static unsigned rdb_partition(DB_env *const env, char const *const data, size_t const size) {
+	if(env->count < 2) return 0;
+	DB_val const key = { size, (void *)data };
+	return db_partitions_key(env->parts, &key);
+}
+static int rdb_check(rocksdb_iterator_t *const iter) {
+	if(rocksdb_iter_valid(iter)) return 0;
+	char *err = NULL;
+	rocksdb_iter_get_error(iter, &err);
+	if(!err) return DB_NOTFOUND;
+	fprintf(stderr, "Database error %s\n", err);
+	rocksdb_free(err);
+	return DB_EIO;
+}
+static void rdb_iters_close(DB_cursor *const cursor) {
+	for(unsigned i = 0; i < DB_PARTITIONS_MAX; ++i) {
+		if(cursor->prefix[i]) rocksdb_iter_destroy(cursor->prefix[i]);
+		if(cursor->total[i]) rocksdb_iter_destroy(cursor->total[i]);
+		cursor->prefix[i] = NULL;
+		cursor->total[i] = NULL;
+	}
+	cursor->iter = NULL;
+}
+static void rdb_got_free(DB_cursor *const cursor) {
+	if(cursor->got) rocksdb_free(cursor->got);
+	cursor->got = NULL;
+	cursor->gsize = 0;
+}
+// Write transactions use total order throughout, since merging the batch
+// into a prefix iterator can step outside of the prefix anyway.
+static int rdb_iter(DB_cursor *const cursor, unsigned const part, int const total, rocksdb_iterator_t **const out) {
+	DB_txn *const txn = cursor->txn;
+	rocksdb_iterator_t **const iter = total || txn->batch ?
+		&cursor->total[part] : &cursor->prefix[part];
+	if(!*iter) {
+		rocksdb_column_family_handle_t *const cf = txn->env->cf[part];
+		rocksdb_readoptions_t *const ropts = total || txn->batch ?
+			txn->total : txn->ropts;
+		rocksdb_iterator_t *const base = rocksdb_create_iterator_cf(txn->env->db, ropts, cf);
+		if(!base) return DB_ENOMEM;
+		if(txn->batch) {
+			*iter = rocksdb_writebatch_wi_create_iterator_with_base_cf(txn->batch, base, cf);
+			if(!*iter) {
+				rocksdb_iter_destroy(base);
+				return DB_ENOMEM;
+			}
+		} else {
+			*iter = base;
+		}
+	}
+	*out = *iter;
+	return 0;
+}
+// Iterators over the batch don't necessarily see writes made after they
+// were created, so they're rebuilt and repositioned from the copied key.
+static void rdb_refresh(DB_cursor *const cursor) {
+	if(cursor->gen == cursor->txn->gen) return;
+	rdb_iters_close(cursor);
+	rdb_got_free(cursor);
+	if(S_ITER == cursor->state) cursor->state = S_KEY;
+	cursor->gen = cursor->txn->gen;
+}
+static int rdb_out(DB_cursor *const cursor, char const *const x, size_t const s, DB_val *const out) {
+	if(!out) return 0;
+	if(!cursor->stable && !cursor->txn->batch) {
+		out->size = s;
+		out->data = (void *)x;
+		return 0;
+	}
+	unsigned const i = cursor->offset;
+	if(cursor->sizes[i] < s || !cursor->bufs[i]) {
+		size_t const size = s > 32 ? s : 32;
+		char *const y = realloc(cursor->bufs[i], size);
+		if(!y) return DB_ENOMEM;
+		cursor->bufs[i] = y;
+		cursor->sizes[i] = size;
+	}
+	memcpy(cursor->bufs[i], x, s);
+	out->size = s;
+	out->data = cursor->bufs[i];
+	cursor->offset = (cursor->offset + 1) % RDB_BUF_RECALL;
+	return 0;
+}
+static int rdb_save(DB_cursor *const cursor, char const *const x, size_t const s) {
+	if(x == cursor->pos) return 0; // Already current.
+	if(cursor->pcap < s || !cursor->pos) {
+		size_t const size = s > 32 ? s : 32;
+		char *const y = realloc(cursor->pos, size);
+		if(!y) return DB_ENOMEM;
+		cursor->pos = y;
+		cursor->pcap = size;
+	}
+	memcpy(cursor->pos, x, s);
+	cursor->psize = s;
+	return 0;
+}
+static int rdb_current(DB_cursor *const cursor, DB_val *const key, DB_val *const data) {
+	int rc;
+	if(S_KEY == cursor->state) {
+		rc = rdb_out(cursor, cursor->pos, cursor->psize, key);
+		if(rc < 0) return rc;
+		return rdb_out(cursor, cursor->got, cursor->gsize, data);
+	}
+	size_t s;
+	char const *x;
+	if(key) {
+		x = rocksdb_iter_key(cursor->iter, &s);
+		rc = rdb_out(cursor, x, s, key);
+		if(rc < 0) return rc;
+	}
+	if(data) {
+		x = rocksdb_iter_value(cursor->iter, &s);
+		rc = rdb_out(cursor, x, s, data);
+		if(rc < 0) return rc;
+	}
+	return 0;
+}
+static int rdb_position(DB_cursor *const cursor, rocksdb_iterator_t *const iter, DB_val *const key, DB_val *const data) {
+	size_t s;
+	char const *const x = rocksdb_iter_key(iter, &s);
+	uint64_t table = 0;
+	db_table_decode(x, s, &table);
+	rdb_got_free(cursor);
+	cursor->state = S_ITER;
+	cursor->iter = iter;
+	cursor->table = table;
+	if(cursor->txn->batch) {
+		int rc = rdb_save(cursor, x, s);
+		if(rc < 0) {
+			cursor->state = S_INVALID;
+			return rc;
+		}
+	}
+	return rdb_current(cursor, key, data);
+}
+// Finds the nearest key across every column family. With no bound, that's
+// the first or last key overall. Going backward, an exclusive bound skips
+// a key equal to it.
+static int rdb_cross(DB_cursor *const cursor, DB_val const *const bound, int const excl, int const dir, DB_val *const key, DB_val *const data) {
+	rocksdb_iterator_t *best = NULL;
+	DB_val bkey = { 0, NULL };
+	cursor->state = S_INVALID;
+	for(unsigned i = 0; i < cursor->txn->env->count; ++i) {
+		rocksdb_iterator_t *iter;
+		int rc = rdb_iter(cursor, i, 1, &iter);
+		if(rc < 0) return rc;
+		if(!bound && dir > 0) {
+			rocksdb_iter_seek_to_first(iter);
+		} else if(!bound) {
+			rocksdb_iter_seek_to_last(iter);
+		} else if(dir > 0) {
+			rocksdb_iter_seek(iter, bound->data, bound->size);
+		} else {
+			rocksdb_iter_seek_for_prev(iter, bound->data, bound->size);
+		}
+		rc = rdb_check(iter);
+		if(DB_NOTFOUND == rc) continue;
+		if(rc < 0) return rc;
+		DB_val k;
+		k.data = (void *)rocksdb_iter_key(iter, &k.size);
+		if(bound && dir < 0 && excl && 0 == compare_default(&k, bound)) {
+			rocksdb_iter_prev(iter);
+			rc = rdb_check(iter);
+			if(DB_NOTFOUND == rc) continue;
+			if(rc < 0) return rc;
+			k.data = (void *)rocksdb_iter_key(iter, &k.size);
+		}
+		if(best && compare_default(&k, &bkey) * dir >= 0) continue;
+		best = iter;
+		bkey = k;
+	}
+	if(!best) return DB_NOTFOUND;
+	return rdb_position(cursor, best, key, data);
+}
+static int rdb_next_table(DB_cursor *const cursor, uint64_t const table, int const dir, DB_val *const key, DB_val *const data) {
+	unsigned char buf[DB_TABLE_MAX];
+	DB_val bound = { 0, buf };
+	if(dir > 0) {
+		cursor->state = S_INVALID;
+		if(UINT64_MAX == table) return DB_NOTFOUND;
+		bound.size = db_table_encode(table+1, buf);
+	} else {
+		bound.size = db_table_encode(table, buf);
+	}
+	return rdb_cross(cursor, &bound, 1, dir, key, data);
+}
+// Moves the iterator to the copied key, after a point lookup or a write.
+static int rdb_sync(DB_cursor *const cursor) {
+	DB_env *const env = cursor->txn->env;
+	rocksdb_iterator_t *iter;
+	unsigned const part = rdb_partition(env, cursor->pos, cursor->psize);
+	int rc = rdb_iter(cursor, part, 0, &iter);
+	if(rc < 0) return rc;
+	rocksdb_iter_seek(iter, cursor->pos, cursor->psize);
+	rc = rdb_check(iter);
+	if(rc >= 0) {
+		DB_val const k = { cursor->psize, cursor->pos };
+		DB_val x;
+		x.data = (void *)rocksdb_iter_key(iter, &x.size);
+		if(0 != compare_default(&x, &k)) rc = DB_NOTFOUND;
+	}
+	if(rc < 0) {
+		cursor->state = S_INVALID;
+		return rc;
+	}
+	rdb_got_free(cursor);
+	cursor->state = S_ITER;
+	cursor->iter = iter;
+	return 0;
+}
+
+
+int db_env_create(DB_env **const out) {
+	DB_env *env = calloc(1, sizeof(struct DB_env));
+	if(!env) return DB_ENOMEM;
+	env->cmp = compare_default;
+
+	env->opts = rocksdb_options_create();
+	env->cache = rocksdb_cache_create_lru(RDB_CACHE_SIZE);
+	env->limiter = rocksdb_ratelimiter_create(RDB_COMPACTION_RATE, 1000 * 100, 10);
+	env->wopts = rocksdb_writeoptions_create();
+	if(!env->opts || !env->cache || !env->limiter || !env->wopts) {
+		db_env_close(env);
+		return DB_ENOMEM;
+	}
+
+	rocksdb_options_set_create_if_missing(env->opts, 1);
+	rocksdb_options_set_create_missing_column_families(env->opts, 1);
+
+	int maxfiles = 100; // Safe default
+//#ifdef __POSIX__
+	struct rlimit lim;
+	getrlimit(RLIMIT_NOFILE, &lim);
+	maxfiles = lim.rlim_cur / 3;
+//#endif
+	rocksdb_options_set_max_open_files(env->opts, maxfiles);
+
+	rocksdb_options_increase_parallelism(env->opts, RDB_BACKGROUND_THREADS);
+	rocksdb_options_set_ratelimiter(env->opts, env->limiter);
+	rocksdb_options_set_bytes_per_sync(env->opts, 1024 * 1024);
+
+	int rc = db_partitions_init(env->parts, NULL, 0);
+	if(rc < 0) {
+		db_env_close(env);
+		return rc;
+	}
+
+	rocksdb_writeoptions_set_sync(env->wopts, 1);
+	*out = env;
+	return 0;
+}
+int db_env_set_mapsize(DB_env *const env, size_t const size) {
+	return 0;
+}
+int db_env_set_partitions(DB_env *const env, DB_partition const *const partitions, size_t const count) {
+	if(!env) return DB_EINVAL;
+	if(env->db) return DB_EINVAL;
+	return db_partitions_init(env->parts, partitions, count);
+}
+int db_env_open(DB_env *const env, char const *const name, unsigned const flags, unsigned const mode) {
+	if(!env) return DB_EINVAL;
+	DB_partitions const *const parts = env->parts;
+	char *err = NULL;
+
+	// Databases from before partitioning only have the default family,
+	// and everything stays there. Otherwise the families have to match,
+	// or tables would be looked for in the wrong place.
+	size_t count = 0;
+	char **const existing = rocksdb_list_column_families(env->opts, name, &count, &err);
+	if(err) rocksdb_free(err); // Doesn't exist yet.
+	err = NULL;
+	int rc = 0;
+	env->count = existing && 1 == count ? 1 : parts->count;
+	for(unsigned i = 0; existing && count > 1 && i < parts->count; ++i) {
+		size_t j = 0;
+		while(j < count && 0 != strcmp(existing[j], parts->names[i])) j++;
+		if(j == count) rc = DB_VERSION_MISMATCH;
+	}
+	if(existing && count > 1 && count != parts->count) rc = DB_VERSION_MISMATCH;
+	if(existing) rocksdb_list_column_families_destroy(existing, count);
+	if(rc < 0) return rc;
+
+	for(unsigned i = 0; i < env->count; ++i) {
+		if(parts->cache[i]) {
+			env->caches[i] = rocksdb_cache_create_lru(parts->cache[i]);
+			if(!env->caches[i]) return DB_ENOMEM;
+		}
+		env->cfopts[i] = rdb_cf_options(env, i);
+		if(!env->cfopts[i]) return DB_ENOMEM;
+	}
+	rocksdb_options_t const *opts[DB_PARTITIONS_MAX];
+	for(unsigned i = 0; i < env->count; ++i) opts[i] = env->cfopts[i];
+	env->db = rocksdb_open_column_families(env->opts, name, env->count, parts->names, opts, env->cf, &err);
+	if(err) fprintf(stderr, "Database error %s\n", err);
+	if(err) rocksdb_free(err);
+	if(!env->db || err) return DB_EIO;
+
+	rocksdb_writeoptions_set_sync(env->wopts, !(DB_NOSYNC & flags));
+	return 0;
+}
+void db_env_close(DB_env *const env) {
+	if(!env) return;
+	for(unsigned i = 0; i < DB_PARTITIONS_MAX; ++i) {
+		if(env->cf[i]) rocksdb_column_family_handle_destroy(env->cf[i]);
+		env->cf[i] = NULL;
+	}
+	if(env->db) {
+		rocksdb_close(env->db); env->db = NULL;
+	}
+	for(unsigned i = 0; i < DB_PARTITIONS_MAX; ++i) {
+		if(env->cfopts[i]) rocksdb_options_destroy(env->cfopts[i]);
+		if(env->caches[i]) rocksdb_cache_destroy(env->caches[i]);
+		env->cfopts[i] = NULL;
+		env->caches[i] = NULL;
+	}
+	if(env->opts) {
+		rocksdb_options_destroy(env->opts); env->opts = NULL;
+	}
+	if(env->cache) {
+		rocksdb_cache_destroy(env->cache); env->cache = NULL;
+	}
+	if(env->limiter) {
+		rocksdb_ratelimiter_destroy(env->limiter); env->limiter = NULL;
+	}
+	if(env->wopts) {
+		rocksdb_writeoptions_destroy(env->wopts); env->wopts = NULL;
+	}
+	memset(env->parts, 0, sizeof(env->parts));
+	env->count = 0;
+	env->cmp = NULL;
+	assert_zeroed(env, 1);
+	free(env);
+}
+
+int db_txn_begin(DB_env *const env, DB_txn *const parent, unsigned const flags, DB_txn **const out) {
+	if(!env) return DB_EINVAL;
+	if(!out) return DB_EINVAL;
+
+	// Nested write transactions would need their own batch layered on
+	// the parent's.
+	if(parent && !(DB_RDONLY & flags)) return DB_EINVAL;
+
+	DB_txn *txn = calloc(1, sizeof(struct DB_txn));
+	if(!txn) return DB_ENOMEM;
+	txn->env = env;
+	txn->parent = parent;
+	txn->flags = flags;
+	txn->ropts = rocksdb_readoptions_create();
+	txn->total = rocksdb_readoptions_create();
+	txn->snapshot = NULL;
+	txn->batch = NULL;
+	txn->gen = 0;
+	if(!txn->ropts || !txn->total) {
+		db_txn_abort(txn);
+		return DB_ENOMEM;
+	}
+	rocksdb_readoptions_set_prefix_same_as_start(txn->ropts, 1);
+	rocksdb_readoptions_set_total_order_seek(txn->total, 1);
+	if(DB_RDONLY & flags) {
+		int rc = db_txn_renew(txn);
+		if(rc < 0) {
+			db_txn_abort(txn);
+			return rc;
+		}
+	} else {
+		txn->batch = rocksdb_writebatch_wi_create(0, 1);
+		if(!txn->batch) {
+			db_txn_abort(txn);
+			return DB_ENOMEM;
+		}
+	}
+	*out = txn;
+	return 0;
+}
+int db_txn_commit(DB_txn *const txn) {
+	if(!txn) return DB_EINVAL;
+	if(DB_RDONLY & txn->flags) {
+		db_txn_abort(txn);
+		return 0;
+	}
+	assert(txn->batch);
+	char *err = NULL;
+	rocksdb_write_writebatch_wi(txn->env->db, txn->env->wopts, txn->batch, &err);
+	if(err) {
+		fprintf(stderr, "Database error %s\n", err);
+		rocksdb_free(err);
+		db_txn_abort(txn);
+		return DB_EIO;
+	}
+	db_txn_abort(txn);
+	return 0;
+}
+void db_txn_abort(DB_txn *const txn) {
+	if(!txn) return;
+	db_cursor_close(txn->cursor); txn->cursor = NULL;
+	if(txn->snapshot) {
+		rocksdb_readoptions_set_snapshot(txn->ropts, NULL);
+		rocksdb_readoptions_set_snapshot(txn->total, NULL);
+		rocksdb_release_snapshot(txn->env->db, txn->snapshot); txn->snapshot = NULL;
+	}
+	if(txn->ropts) {
+		rocksdb_readoptions_destroy(txn->ropts); txn->ropts = NULL;
+	}
+	if(txn->total) {
+		rocksdb_readoptions_destroy(txn->total); txn->total = NULL;
+	}
+	if(txn->batch) {
+		rocksdb_writebatch_wi_destroy(txn->batch); txn->batch = NULL;
+	}
+	txn->env = NULL;
+	txn->parent = NULL;
+	txn->flags = 0;
+	txn->gen = 0;
+	assert_zeroed(txn, 1);
+	free(txn);
+}
+void db_txn_reset(DB_txn *const txn) {
+	if(!txn) return;
+	assert(txn->flags & DB_RDONLY);
+	if(txn->snapshot) {
+		rocksdb_readoptions_set_snapshot(txn->ropts, NULL);
+		rocksdb_readoptions_set_snapshot(txn->total, NULL);
+		rocksdb_release_snapshot(txn->env->db, txn->snapshot); txn->snapshot = NULL;
+	}
+}
+int db_txn_renew(DB_txn *const txn) {
+	if(!txn) return DB_EINVAL;
+	assert(txn->flags & DB_RDONLY);
+	assert(!txn->snapshot);
+	txn->snapshot = rocksdb_create_snapshot(txn->env->db);
+	if(!txn->snapshot) return DB_ENOMEM;
+	rocksdb_readoptions_set_snapshot(txn->ropts, txn->snapshot);
+	rocksdb_readoptions_set_snapshot(txn->total, txn->snapshot);
+	return 0;
+}
+int db_txn_get_flags(DB_txn *const txn, unsigned *const flags) {
+	if(!txn) return DB_EINVAL;
+	if(flags) *flags = txn->flags | (txn->env->count > 1 ? DB_PARTITIONED : 0);
+	return 0;
+}
+int db_txn_cmp(DB_txn *const txn, DB_val const *const a, DB_val const *const b) {
+	assert(txn); // We can't report an error from this function.
+	return txn->env->cmp(a, b);
+}
+int db_txn_cursor(DB_txn *const txn, DB_cursor **const out) {
+	if(!txn) return DB_EINVAL;
+	if(!txn->cursor) {
+		int rc = db_cursor_open(txn, &txn->cursor);
+		if(rc < 0) return rc;
+		txn->cursor->stable = 1;
+	}
+	if(out) *out = txn->cursor;
+	return 0;
+}
+
+int db_cursor_open(DB_txn *const txn, DB_cursor **const out) {
+	if(!txn) return DB_EINVAL;
+	if(!out) return DB_EINVAL;
+	DB_cursor *cursor = calloc(1, sizeof(struct DB_cursor));
+	if(!cursor) return DB_ENOMEM;
+	*out = cursor;
+	return db_cursor_renew(txn, out);
+}
+void db_cursor_close(DB_cursor *const cursor) {
+	if(!cursor) return;
+	db_cursor_reset(cursor);
+	for(unsigned i = 0; i < RDB_BUF_RECALL; ++i) {
+		free(cursor->bufs[i]); cursor->bufs[i] = NULL;
+		cursor->sizes[i] = 0;
+	}
+	free(cursor->pos); cursor->pos = NULL;
+	cursor->psize = 0;
+	cursor->pcap = 0;
+	cursor->stable = 0;
+	cursor->offset = 0;
+	assert_zeroed(cursor, 1);
+	free(cursor);
+}
+void db_cursor_reset(DB_cursor *const cursor) {
+	if(!cursor) return;
+	rdb_iters_close(cursor);
+	rdb_got_free(cursor);
+	cursor->txn = NULL;
+	cursor->state = S_INVALID;
+	cursor->table = 0;
+	cursor->gen = 0;
+}
+int db_cursor_renew(DB_txn *const txn, DB_cursor **const out) {
+	if(!out) return DB_EINVAL;
+	if(!*out) return db_cursor_open(txn, out);
+	DB_cursor *const cursor = *out;
+	rdb_iters_close(cursor);
+	rdb_got_free(cursor);
+	cursor->txn = txn;
+	cursor->state = S_INVALID;
+	cursor->table = 0;
+	cursor->gen = txn->gen;
+	return 0;
+}
+int db_cursor_clear(DB_cursor *const cursor) {
+	if(!cursor) return DB_EINVAL;
+	cursor->state = S_INVALID;
+	return 0;
+}
+int db_cursor_cmp(DB_cursor *const cursor, DB_val const *const a, DB_val const *const b) {
+	return db_txn_cmp(cursor->txn, a, b);
+}
+
+int db_cursor_current(DB_cursor *const cursor, DB_val *const key, DB_val *const data) {
+	if(!cursor) return DB_EINVAL;
+	rdb_refresh(cursor);
+	if(S_INVALID == cursor->state) return DB_NOTFOUND;
+	if(S_KEY == cursor->state && !cursor->got) {
+		int rc = rdb_sync(cursor);
+		if(rc < 0) return rc;
+	}
+	return rdb_current(cursor, key, data);
+}
+int db_cursor_seek(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
+	if(!cursor) return DB_EINVAL;
+	if(!key) return DB_EINVAL;
+	DB_txn *const txn = cursor->txn;
+	DB_env *const env = txn->env;
+	rdb_refresh(cursor);
+	uint64_t table = 0;
+	int const valid = db_table_decode(key->data, key->size, &table) > 0;
+	unsigned const part = rdb_partition(env, key->data, key->size);
+	int rc;
+
+	// Exact matches are point lookups, which can use the whole key blooms.
+	if(0 == dir) {
+		char *err = NULL;
+		size_t len = 0;
+		rocksdb_column_family_handle_t *const cf = env->cf[part];
+		char *const val = txn->batch ?
+			rocksdb_writebatch_wi_get_from_batch_and_db_cf(txn->batch, env->db, txn->ropts, cf, key->data, key->size, &len, &err) :
+			rocksdb_get_cf(env->db, txn->ropts, cf, key->data, key->size, &len, &err);
+		cursor->state = S_INVALID;
+		if(err) {
+			fprintf(stderr, "Database error %s\n", err);
+			rocksdb_free(err);
+			if(val) rocksdb_free(val);
+			return DB_EIO;
+		}
+		if(!val) return DB_NOTFOUND;
+		rc = rdb_save(cursor, key->data, key->size);
+		if(rc < 0) {
+			rocksdb_free(val);
+			return rc;
+		}
+		rdb_got_free(cursor);
+		cursor->state = S_KEY;
+		cursor->table = table;
+		cursor->got = val;
+		cursor->gsize = len;
+		return rdb_current(cursor, key, data);
+	}
+
+	if(!valid) return rdb_cross(cursor, key, 0, dir, key, data);
+	rocksdb_iterator_t *iter;
+	rc = rdb_iter(cursor, part, 0, &iter);
+	if(rc < 0) return rc;
+	if(dir > 0) rocksdb_iter_seek(iter, key->data, key->size);
+	else rocksdb_iter_seek_for_prev(iter, key->data, key->size);
+	rc = rdb_check(iter);
+	if(rc < 0 && DB_NOTFOUND != rc) {
+		cursor->state = S_INVALID;
+		return rc;
+	}
+	if(rc >= 0) {
+		size_t s;
+		char const *const x = rocksdb_iter_key(iter, &s);
+		uint64_t t = 0;
+		db_table_decode(x, s, &t);
+		if(t == table) return rdb_position(cursor, iter, key, data);
+	}
+	// Nothing left in this table, so look at the neighboring ones.
+	return rdb_next_table(cursor, table, dir, key, data);
+}
+int db_cursor_first(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
+	if(!cursor) return DB_EINVAL;
+	if(0 == dir) return DB_EINVAL;
+	rdb_refresh(cursor);
+	return rdb_cross(cursor, NULL, 0, dir, key, data);
+}
+int db_cursor_next(DB_cursor *const cursor, DB_val *const key, DB_val *const data, int const dir) {
+	if(!cursor) return DB_EINVAL;
+	rdb_refresh(cursor);
+	if(S_INVALID == cursor->state) return db_cursor_first(cursor, key, data, dir);
+	if(0 == dir) return DB_EINVAL;
+	int rc;
+	if(S_KEY == cursor->state) {
+		rc = rdb_sync(cursor);
+		if(rc < 0) return rc;
+	}
+	rocksdb_iterator_t *const iter = cursor->iter;
+	if(dir > 0) rocksdb_iter_next(iter);
+	else rocksdb_iter_prev(iter);
+	rc = rdb_check(iter);
+	if(rc < 0 && DB_NOTFOUND != rc) {
+		cursor->state = S_INVALID;
+		return rc;
+	}
+	if(rc >= 0) {
+		size_t s;
+		char const *const x = rocksdb_iter_key(iter, &s);
+		uint64_t t = 0;
+		db_table_decode(x, s, &t);
+		if(t == cursor->table) return rdb_position(cursor, iter, key, data);
+	}
+	return rdb_next_table(cursor, cursor->table, dir, key, data);
+}
+
+int db_cursor_put(DB_cursor *const cursor, DB_val *const key, DB_val *const data, unsigned const flags) {
+	if(!cursor) return DB_EINVAL;
+	DB_txn *const txn = cursor->txn;
+	if(DB_RDONLY & txn->flags) return DB_EACCES;
+	if(DB_NOOVERWRITE & flags) {
+		DB_val k = *key, d;
+		int rc = db_cursor_seek(cursor, &k, &d, 0);
+		if(rc >= 0) {
+			*key = k;
+			*data = d;
+			return DB_KEYEXIST;
+		}
+		if(DB_NOTFOUND != rc) return rc;
+	}
+	assert(txn->batch);
+	unsigned const part = rdb_partition(txn->env, key->data, key->size);
+	rocksdb_writebatch_wi_put_cf(txn->batch, txn->env->cf[part],
+		key->data, key->size, data->data, data->size);
+	txn->gen++;
+	cursor->state = S_INVALID;
+	return 0;
+}
+int db_cursor_del(DB_cursor *const cursor) {
+	if(!cursor) return DB_EINVAL;
+	DB_txn *const txn = cursor->txn;
+	if(DB_RDONLY & txn->flags) return DB_EACCES;
+	rdb_refresh(cursor);
+	if(S_INVALID == cursor->state) return DB_NOTFOUND;
+	assert(txn->batch);
+	// Write transactions always keep a copy of the current key.
+	unsigned const part = rdb_partition(txn->env, cursor->pos, cursor->psize);
+	rocksdb_writebatch_wi_delete_cf(txn->batch, txn->env->cf[part],
+		cursor->pos, cursor->psize);
+	txn->gen++;
+	cursor->state = S_INVALID;
+	return 0;
+}
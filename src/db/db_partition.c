@@ -0,0 +1,78 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <string.h>
+#include "db_partition.h"
+
+int db_partitions_init(DB_partitions *const parts, DB_partition const *const list, size_t const count) {
+	if(!parts) return DB_EINVAL;
+	if(count && !list) return DB_EINVAL;
+	if(count > DB_PARTITION_RANGES_MAX) return DB_EINVAL;
+	memset(parts, 0, sizeof(*parts));
+	parts->count = 1;
+	parts->names[0] = "default";
+	for(size_t i = 0; i < count; ++i) {
+		DB_partition const *const p = &list[i];
+		if(!p->name || p->min >= p->max) return DB_EINVAL;
+		if(p->min < DB_PARTITION_RESERVED) return DB_EINVAL;
+		unsigned j = 0;
+		for(; j < parts->count; ++j) {
+			if(0 == strcmp(parts->names[j], p->name)) break;
+		}
+		if(j == parts->count) {
+			if(parts->count >= DB_PARTITIONS_MAX) return DB_EINVAL;
+			parts->names[j] = p->name;
+			parts->cache[j] = p->cache;
+			parts->write_buffer[j] = p->write_buffer;
+			parts->count++;
+		}
+		parts->ranges[i] = *p;
+		parts->owners[i] = j;
+	}
+	parts->nranges = count;
+	// Earlier entries win if they overlap.
+	for(size_t i = count; i-- > 0;) {
+		uint64_t const max = parts->ranges[i].max;
+		uint64_t const end = max < DB_PARTITION_FAST ? max : DB_PARTITION_FAST;
+		for(uint64_t t = parts->ranges[i].min; t < end; ++t) {
+			parts->fast[t] = parts->owners[i];
+		}
+	}
+	return 0;
+}
+unsigned db_partitions_find(DB_partitions const *const parts, uint64_t const table) {
+	if(table < DB_PARTITION_FAST) return parts->fast[table];
+	for(size_t i = 0; i < parts->nranges; ++i) {
+		if(table < parts->ranges[i].min) continue;
+		if(table >= parts->ranges[i].max) continue;
+		return parts->owners[i];
+	}
+	return 0;
+}
+unsigned db_partitions_key(DB_partitions const *const parts, DB_val const *const key) {
+	uint64_t table;
+	if(parts->count < 2) return 0;
+	if(!db_table_decode(key->data, key->size, &table)) return 0;
+	if(table < DB_PARTITION_RESERVED) return 0;
+	return db_partitions_find(parts, table);
+}
+
+size_t db_table_decode(void const *const data, size_t const size, uint64_t *const out) {
+	if(!size) return 0;
+	unsigned char const *const x = data;
+	size_t const len = (x[0] >> 4) + 1;
+	if(len > size || len > DB_TABLE_MAX) return 0;
+	uint64_t table = x[0] & 0x0f;
+	for(size_t i = 1; i < len; ++i) table = table << 8 | x[i];
+	if(out) *out = table;
+	return len;
+}
+size_t db_table_encode(uint64_t const table, unsigned char *const out) {
+	size_t len = 1;
+	while(len < DB_TABLE_MAX && table >> (4 + 8 * (len-1))) len++;
+	for(size_t i = len; i-- > 1;) out[i] = 0xff & (table >> (8 * (len-1-i)));
+	out[0] = (len-1) << 4 | (len < DB_TABLE_MAX ? 0x0f & (table >> (8 * (len-1))) : 0);
+	assert(len == db_table_decode(out, len, NULL));
+	return len;
+}
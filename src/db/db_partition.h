@@ -0,0 +1,41 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#ifndef DB_PARTITION_H
+#define DB_PARTITION_H
+
+#include "db_base.h"
+
+// Shared by the back-ends that support db_env_set_partitions.
+#define DB_PARTITIONS_MAX 8
+#define DB_PARTITION_RANGES_MAX 32
+#define DB_PARTITION_FAST 256 // Tables below this are looked up directly.
+#define DB_PARTITION_RESERVED 20 // Tables 0-19 belong to the DB layer.
+
+// Partition 0 is always the default one.
+typedef struct {
+	unsigned count;
+	char const *names[DB_PARTITIONS_MAX];
+	size_t cache[DB_PARTITIONS_MAX];
+	size_t write_buffer[DB_PARTITIONS_MAX];
+	size_t nranges;
+	DB_partition ranges[DB_PARTITION_RANGES_MAX];
+	unsigned char owners[DB_PARTITION_RANGES_MAX];
+	unsigned char fast[DB_PARTITION_FAST];
+} DB_partitions;
+
+// With no list, everything is in the default partition.
+int db_partitions_init(DB_partitions *const parts, DB_partition const *const list, size_t const count);
+unsigned db_partitions_find(DB_partitions const *const parts, uint64_t const table);
+// Routes by table ID alone. The DB layer's own tables (DBSchema, DBBigString,
+// DBNextID...) always go in the default partition.
+unsigned db_partitions_key(DB_partitions const *const parts, DB_val const *const key);
+
+// Keys start with their table ID, in the varint format from db_schema.c.
+// It sorts correctly with memcmp and no ID is a prefix of another, so a
+// table's keys are exactly those from its encoded ID up to the next one's.
+#define DB_TABLE_MAX 9
+size_t db_table_decode(void const *const data, size_t const size, uint64_t *const out);
+size_t db_table_encode(uint64_t const table, unsigned char *const out);
+
+#endif
@@ -3,7 +3,9 @@
 
 #include <assert.h>
 #include <stdio.h> // DEBUG
+#include <openssl/rand.h>
 #include <openssl/sha.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include "../common.h"
@@ -102,20 +104,93 @@ void db_bind_uint64(DB_val *const val, uint64_t const x) {
 	val->size += len;
 }
 
-uint64_t db_next_id(dbid_t const table, DB_txn *const txn) {
+int db_last_id(dbid_t const table, DB_txn *const txn, uint64_t *const out) {
+	assert(out);
 	DB_cursor *cur = NULL;
-	if(db_txn_cursor(txn, &cur) < 0) return 0;
+	int rc = db_txn_cursor(txn, &cur);
+	if(rc < 0) return rc;
 	DB_range range[1];
 	DB_RANGE_STORAGE(range, DB_VARINT_MAX);
 	db_bind_uint64(range->min, table+0);
 	db_bind_uint64(range->max, table+1);
 	DB_val prev[1];
-	int rc = db_cursor_firstr(cur, range, prev, NULL, -1);
-	if(DB_NOTFOUND == rc) return 1;
-	if(rc < 0) return 0;
+	rc = db_cursor_firstr(cur, range, prev, NULL, -1);
+	if(DB_NOTFOUND == rc) {
+		*out = 0;
+		return 0;
+	}
+	if(rc < 0) return rc;
 	uint64_t const t = db_read_uint64(prev);
 	assert(table == t);
-	return db_read_uint64(prev)+1;
+	*out = db_read_uint64(prev);
+	return 0;
+}
+
+// IDs are reserved in blocks by bumping a counter row, then handed out from
+// memory. The row is written in the caller's transaction, so if that aborts,
+// the reservation goes with it. Each block gets a random tag so we can tell
+// whether the stored row is still the one we wrote (even if another
+// environment is using the same slot). Gaps after a crash are fine, and IDs
+// already committed are never handed out again.
+#define DB_ID_BATCH 256
+#define DB_ID_SLOTS 16
+
+typedef struct {
+	dbid_t table;
+	uint64_t next;
+	uint64_t limit;
+	uint64_t tag;
+} db_id_block;
+static db_id_block id_blocks[DB_ID_SLOTS];
+static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t db_next_id(dbid_t const table, DB_txn *const txn) {
+	DB_val key[1];
+	DB_VAL_STORAGE(key, DB_VARINT_MAX*2);
+	db_bind_uint64(key, DBNextID);
+	db_bind_uint64(key, table);
+	DB_VAL_STORAGE_VERIFY(key);
+	DB_val val[1];
+	uint64_t limit = 0;
+	uint64_t tag = 0;
+	int rc = db_get(txn, key, val);
+	if(rc >= 0) {
+		limit = db_read_uint64(val);
+		tag = db_read_uint64(val);
+	} else if(DB_NOTFOUND != rc) return 0;
+
+	db_id_block *const block = &id_blocks[table % DB_ID_SLOTS];
+	uint64_t id = 0;
+	pthread_mutex_lock(&id_lock);
+	if(table == block->table && limit == block->limit && tag == block->tag && block->next < block->limit) {
+		id = block->next++;
+	}
+	pthread_mutex_unlock(&id_lock);
+	if(id) return id;
+
+	// Reserve a new block. Checking the table itself too means databases
+	// from before the counter row (or with IDs written some other way)
+	// still never get an ID reused.
+	uint64_t last = 0;
+	rc = db_last_id(table, txn, &last);
+	if(rc < 0) return 0;
+	uint64_t const base = MAX(limit, last+1);
+	if(RAND_bytes((unsigned char *)&tag, sizeof(tag)) <= 0) return 0;
+	DB_val next_val[1];
+	DB_VAL_STORAGE(next_val, DB_VARINT_MAX*2);
+	db_bind_uint64(next_val, base+DB_ID_BATCH);
+	db_bind_uint64(next_val, tag);
+	DB_VAL_STORAGE_VERIFY(next_val);
+	rc = db_put(txn, key, next_val, 0);
+	if(rc < 0) return 0;
+
+	pthread_mutex_lock(&id_lock);
+	block->table = table;
+	block->next = base+1;
+	block->limit = base+DB_ID_BATCH;
+	block->tag = tag;
+	pthread_mutex_unlock(&id_lock);
+	return base;
 }
 
 
@@ -127,6 +202,20 @@ uint64_t db_next_id(dbid_t const table, DB_txn *const txn) {
 // an empty string is 0x00 01.
 #define DB_INLINE_TRUNC (DB_INLINE_MAX-SHA256_DIGEST_LENGTH)
 
+// Big strings are stored under their inline form. Partitioned databases are
+// always new, so there it goes in the DBBigString table like any other key.
+// Older databases have it bare, with no table ID.
+static void big_string_key(DB_txn *const txn, unsigned char const *const inline_str, DB_val *const key) {
+	unsigned flags = 0;
+	int rc = db_txn_get_flags(txn, &flags);
+	db_assertf(rc >= 0, "Database error %s", db_strerror(rc));
+	unsigned char *const out = key->data;
+	key->size = 0;
+	if(flags & DB_PARTITIONED) db_bind_uint64(key, DBBigString);
+	memcpy(out+key->size, inline_str, DB_INLINE_MAX);
+	key->size += DB_INLINE_MAX;
+}
+
 char const *db_read_string(DB_val *const val, DB_txn *const txn) {
 	assert(txn);
 	assert(val);
@@ -155,9 +244,15 @@ char const *db_read_string(DB_val *const val, DB_txn *const txn) {
 		return str;
 	}
 
-	DB_val key = { DB_INLINE_MAX, (char *)str };
+	db_assert(val->size >= DB_INLINE_MAX);
+	val->data += DB_INLINE_MAX;
+	val->size -= DB_INLINE_MAX;
+
+	DB_val key[1];
+	DB_VAL_STORAGE(key, DB_VARINT_MAX + DB_INLINE_MAX);
+	big_string_key(txn, (unsigned char const *)str, key);
 	DB_val full[1];
-	int rc = db_get(txn, &key, full);
+	int rc = db_get(txn, key, full);
 	db_assertf(rc >= 0, "Database error %s", db_strerror(rc));
 	char const *const fstr = full->data;
 	db_assert('\0' == fstr[full->size-1]);
@@ -206,11 +301,13 @@ void db_bind_string_len(DB_val *const val, char const *const str, size_t const l
 	db_assertf(rc >= 0, "Database error %s", db_strerror(rc));
 	if(flags & DB_RDONLY) return;
 
-	DB_val key = { DB_INLINE_MAX, out+val->size-DB_INLINE_MAX };
+	DB_val key[1];
+	DB_VAL_STORAGE(key, DB_VARINT_MAX + DB_INLINE_MAX);
+	big_string_key(txn, out+val->size-DB_INLINE_MAX, key);
 	char *str2 = nulterm ? (char *)str : strndup(str, len);
 	DB_val full = { len+1, str2 };
 	assert('\0' == str2[full.size-1]);
-	rc = db_put(txn, &key, &full, 0);
+	rc = db_put(txn, key, &full, 0);
 	if(!nulterm) free(str2);
 	str2 = NULL;
 	db_assertf(rc >= 0, "Database error %s", db_strerror(rc));
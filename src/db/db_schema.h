@@ -43,6 +43,7 @@ enum {
 	// 0-19 are reserved.
 	DBSchema = 0, // TODO
 	DBBigString = 1,
+	DBNextID = 2,
 };
 
 int db_schema_verify(DB_txn *const txn);
@@ -51,7 +52,10 @@ int db_schema_verify(DB_txn *const txn);
 uint64_t db_read_uint64(DB_val *const val);
 void db_bind_uint64(DB_val *const val, uint64_t const x);
 
+// IDs are handed out in increasing order but may have gaps. Returns 0 on error.
 uint64_t db_next_id(dbid_t const table, DB_txn *const txn);
+// The highest ID actually in use in the table, or 0 if it's empty.
+int db_last_id(dbid_t const table, DB_txn *const txn, uint64_t *const out);
 
 #define DB_INLINE_MAX 96
 char const *db_read_string(DB_val *const val, DB_txn *const txn);
@@ -3,21 +3,40 @@
 
 #include "SLNFilter.h"
 
-static int filtercmp(SLNFilter *const a, SLNFilter *const b, int const dir) {
-	uint64_t asort, afile, bsort, bfile;
-	[a current:dir :&asort :&afile];
-	[b current:dir :&bsort :&bfile];
-	if(asort > bsort) return +dir;
-	if(asort < bsort) return -dir;
-	if(afile > bfile) return +dir;
-	if(afile < bfile) return -dir;
+static int headcmp(struct head const *const a, struct head const *const b, int const dir) {
+	if(a->sortID > b->sortID) return +dir;
+	if(a->sortID < b->sortID) return -dir;
+	if(a->fileID > b->fileID) return +dir;
+	if(a->fileID < b->fileID) return -dir;
 	return 0;
 }
-static int filtercmp_fwd(SLNFilter *const *const a, SLNFilter *const *const b) {
-	return filtercmp(*a, *b, +1);
+// The heap holds the filters by their cached positions, with the next one
+// in dir at the top. It's separate so that filters stays in plan order.
+static void sift_down(SLNFilter **const heap, struct head *const heads, size_t const count, size_t i, int const dir) {
+	for(;;) {
+		size_t const l = i*2+1;
+		size_t const r = i*2+2;
+		size_t x = i;
+		if(l < count && headcmp(&heads[l], &heads[x], dir) < 0) x = l;
+		if(r < count && headcmp(&heads[r], &heads[x], dir) < 0) x = r;
+		if(x == i) return;
+		SLNFilter *const f = heap[i];
+		heap[i] = heap[x];
+		heap[x] = f;
+		struct head const h = heads[i];
+		heads[i] = heads[x];
+		heads[x] = h;
+		i = x;
+	}
+}
+static int estimatecmp_asc(SLNFilter *const *const a, SLNFilter *const *const b) {
+	uint64_t const x = [*a estimate], y = [*b estimate];
+	if(x < y) return -1;
+	if(x > y) return +1;
+	return 0;
 }
-static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
-	return filtercmp(*a, *b, -1);
+static int estimatecmp_desc(SLNFilter *const *const a, SLNFilter *const *const b) {
+	return estimatecmp_asc(b, a);
 }
 
 @implementation SLNCollectionFilter
@@ -27,9 +46,14 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 	}
 	assert_zeroed(filters, count);
 	FREE(&filters); filters = NULL;
+	FREE(&heap); heap = NULL;
+	FREE(&order); order = NULL;
+	FREE(&heads); heads = NULL;
 	count = 0;
 	asize = 0;
 	sort = 0;
+	bounded = false;
+	SLNBitmapClear(files);
 	[super free];
 }
 
@@ -42,12 +66,100 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 	if(count+1 > asize) {
 		asize = MAX(8, asize * 2);
 		filters = reallocarray(filters, asize, sizeof(filters[0]));
+		heap = reallocarray(heap, asize, sizeof(heap[0]));
+		order = reallocarray(order, asize, sizeof(order[0]));
+		heads = reallocarray(heads, asize, sizeof(heads[0]));
 		assert(filters); // TODO
+		assert(heap); // TODO
+		assert(order); // TODO
+		assert(heads); // TODO
 	}
+	order[count] = filter;
 	filters[count++] = filter;
 	return 0;
 }
 
+- (SLNFilter *)plan {
+	SLNFilter **old = filters;
+	size_t const n = count;
+	filters = NULL;
+	FREE(&heap);
+	FREE(&order);
+	FREE(&heads);
+	count = 0;
+	asize = 0;
+	for(size_t i = 0; i < n; i++) {
+		SLNFilter *const filter = [old[i] plan]; old[i] = nil;
+		if([filter type] != [self type]) {
+			[self addFilterArg:filter];
+			continue;
+		}
+		// Nested collections of the same kind can be flattened.
+		SLNCollectionFilter *const inner = (SLNCollectionFilter *)filter;
+		for(size_t j = 0; j < inner->count; j++) {
+			[self addFilterArg:inner->filters[j]]; inner->filters[j] = nil;
+		}
+		inner->count = 0;
+		[inner free];
+	}
+	FREE(&old);
+	[self prune];
+	if(1 != count) return self;
+	SLNFilter *const filter = filters[0]; filters[0] = nil;
+	count = 0;
+	[self free];
+	return filter;
+}
+- (void)prune {}
+// Replaces a negated collection with the opposite collection of negations
+// (De Morgan), since negations only work on simple filters.
+- (SLNFilter *)negate {
+	SLNCollectionFilter *const other = SLNUnionFilterType == [self type] ?
+		[[SLNIntersectionFilter alloc] init] :
+		[[SLNUnionFilter alloc] init];
+	assert(other); // TODO
+	for(size_t i = 0; i < count; i++) {
+		SLNNegationFilter *const negation = [[SLNNegationFilter alloc] init];
+		assert(negation); // TODO
+		[negation addFilterArg:filters[i]]; filters[i] = nil;
+		[other addFilterArg:negation];
+	}
+	count = 0;
+	[self free];
+	return [other plan];
+}
+// Even for intersections, a file can only become a new match if at
+// least one of the children matched something new.
+- (bool)mayMatch:(SLNChanges const *const)changes {
+	for(size_t i = 0; i < count; i++) {
+		if([filters[i] mayMatch:changes]) return true;
+	}
+	return false;
+}
+// Children are combined without regard to order, since it doesn't change
+// the results, and tokens have to match whatever order a new parse gives.
+- (uint64_t)fingerprint:(uint64_t const)hash {
+	uint64_t x = [super fingerprint:hash];
+	uint64_t sum = 0, mix = 0;
+	for(size_t i = 0; i < count; i++) {
+		uint64_t const y = [filters[i] fingerprint:UINT64_C(0xcbf29ce484222325)];
+		sum += y;
+		mix ^= y * UINT64_C(0x9e3779b97f4a7c15);
+	}
+	x = fingerprint_add(x, &sum, sizeof(sum));
+	x = fingerprint_add(x, &mix, sizeof(mix));
+	return fingerprint_add(x, &count, sizeof(count));
+}
+- (size_t)serialize:(byte_t *const)data :(size_t const)size {
+	size_t len = [super serialize:data :size];
+	len = serial_add(data, size, len, &count, sizeof(count));
+	for(size_t i = 0; i < count; i++) {
+		bool const room = len < size;
+		len += [filters[i] serialize:room ? data+len : NULL :room ? size-len : 0];
+	}
+	return len;
+}
+
 - (int)prepare:(DB_txn *const)txn {
 	int rc = [super prepare:txn];
 	if(rc < 0) return rc;
@@ -56,10 +168,16 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 		if(rc < 0) return rc;
 	}
 	sort = 0;
+	bounded = false;
+	SLNBitmapClear(files);
 	return 0;
 }
+- (SLNBitmap const *)fileSet {
+	return bounded ? files : NULL;
+}
 - (void)seek:(int const)dir :(uint64_t const)sortID :(uint64_t const)fileID {
 	assert(count);
+	if(0 == estimate) return; // Nothing can match.
 	for(size_t i = 0; i < count; i++) {
 		[filters[i] seek:dir :sortID :fileID];
 	}
@@ -67,38 +185,43 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 }
 - (void)current:(int const)dir :(uint64_t *const)sortID :(uint64_t *const)fileID {
 	assert(count);
-	if(0 == sort) { // Means we don't have a valid position.
+	if(0 == sort || !valid(heads[0].sortID)) { // Means we don't have a valid position.
 		if(sortID) *sortID = invalid(dir);
 		if(fileID) *fileID = invalid(dir);
+		return;
 	}
-	[filters[0] current:dir :sortID :fileID];
+	if(sortID) *sortID = heads[0].sortID;
+	if(fileID) *fileID = heads[0].fileID;
 }
 - (void)step:(int const)dir {
 	assert(count);
 	assert(0 != dir);
+	if(0 == estimate) return;
 	assert(0 != sort); // Means we don't have a valid position.
-	uint64_t oldSortID, oldFileID;
-	[filters[0] current:dir :&oldSortID :&oldFileID];
+	struct head const old = heads[0];
+	if(!valid(old.sortID)) return;
 	if((dir > 0) != (sort > 0)) {
 		// Flip directions. Inexact sub-filters must be repositioned.
-		[self seek:dir :oldSortID :oldFileID];
+		[self seek:dir :old.sortID :old.fileID];
 	}
-	[filters[0] step:dir];
-	for(size_t i = 1; i < count; i++) {
-		uint64_t curSortID, curFileID;
-		[filters[i] current:dir :&curSortID :&curFileID];
-		if(curSortID != oldSortID || curFileID != oldFileID) break;
-		[filters[i] step:dir];
+	// Step every filter at the old position. Each one that moves only
+	// has to be sifted back down, instead of re-sorting all of them.
+	while(0 == headcmp(&heads[0], &old, dir)) {
+		[heap[0] step:dir];
+		[heap[0] current:dir :&heads[0].sortID :&heads[0].fileID];
+		sift_down(heap, heads, count, 0, dir);
 	}
-	[self sort:dir];
 }
 
 - (void)sort:(int const)dir {
 	assert(0 != dir);
-	int (*cmp)();
-	if(dir > 0) cmp = filtercmp_fwd;
-	if(dir < 0) cmp = filtercmp_rev;
-	qsort(filters, count, sizeof(filters[0]), cmp);
+	for(size_t i = 0; i < count; i++) {
+		heap[i] = filters[i];
+		[heap[i] current:dir :&heads[i].sortID :&heads[i].fileID];
+	}
+	for(size_t i = count/2; i-- > 0;) {
+		sift_down(heap, heads, count, i, dir);
+	}
 	sort = dir;
 }
 @end
@@ -109,7 +232,8 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 }
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(intersection\n");
+	fprintf(stderr, "(intersection");
+	print_estimate(estimate);
 	for(size_t i = 0; i < count; i++) [filters[i] print:depth+1];
 	indent(depth);
 	fprintf(stderr, ")\n");
@@ -126,19 +250,66 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 	return len;
 }
 
+// Any meta-file that matches another indirect filter also makes its file
+// visible, so visible filters next to them are redundant.
+- (void)prune {
+	bool visible = false;
+	for(size_t i = 0; i < count; i++) {
+		SLNFilterType const type = [filters[i] type];
+		if(SLNFulltextFilterType == type) visible = true;
+		if(SLNPhraseFilterType == type) visible = true;
+		if(SLNMetadataFilterType == type) visible = true;
+	}
+	size_t n = 0;
+	for(size_t i = 0; i < count; i++) {
+		SLNFilter *const filter = filters[i]; filters[i] = nil;
+		if(SLNVisibleFilterType == [filter type]) {
+			if(visible) {
+				[filter free];
+				continue;
+			}
+			visible = true;
+		}
+		filters[n++] = filter;
+	}
+	count = n;
+	if(count) memcpy(order, filters, sizeof(*filters) * count);
+}
+
+// The smallest filter is checked first, since it's most likely to reject.
+- (int)prepare:(DB_txn *const)txn {
+	int rc = [super prepare:txn];
+	if(rc < 0) return rc;
+	for(size_t i = 0; i < count; i++) {
+		estimate = MIN(estimate, [filters[i] estimate]);
+	}
+	// Files have to be in the set of every child that has one.
+	for(size_t i = 0; i < count; i++) {
+		SLNBitmap const *const x = [filters[i] fileSet];
+		if(!x) continue;
+		rc = bounded ? SLNBitmapAnd(files, x) : SLNBitmapCopy(files, x);
+		if(rc < 0) return rc;
+		bounded = true;
+	}
+	if(bounded) estimate = MIN(estimate, SLNBitmapCardinality(files));
+	qsort(order, count, sizeof(*order), (int (*)())estimatecmp_asc);
+	return 0;
+}
+
 - (SLNAgeRange)fullAge:(uint64_t const)fileID {
 	SLNAgeRange age = { 0, UINT64_MAX };
 	for(size_t i = 0; i < count; i++) {
-		SLNAgeRange const x = [filters[count-1-i] fullAge:fileID];
+		SLNAgeRange const x = [order[i] fullAge:fileID];
 		if(valid(x.min) && x.min > age.min) age.min = x.min;
 		if(valid(x.max) && x.max < age.max) age.max = x.max;
 	}
 	return age;
 }
 - (uint64_t)fastAge:(uint64_t const)fileID :(uint64_t const)sortID {
+	if(bounded && !SLNBitmapContains(files, fileID)) return UINT64_MAX;
 	bool hit = false;
 	for(size_t i = 0; i < count; i++) {
-		uint64_t const age = [filters[count-1-i] fastAge:fileID :sortID];
+		uint64_t const age = [order[i] fastAge:fileID :sortID];
 		if(age > sortID) return UINT64_MAX;
 		if(age == sortID) hit = true;
 	}
@@ -153,7 +324,8 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 }
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(union\n");
+	fprintf(stderr, "(union");
+	print_estimate(estimate);
 	for(size_t i = 0; i < count; i++) [filters[i] print:depth+1];
 	indent(depth);
 	fprintf(stderr, ")\n");
@@ -167,19 +339,43 @@ static int filtercmp_rev(SLNFilter *const *const a, SLNFilter *const *const b) {
 	return len;
 }
 
+// The largest filter is checked first, since it's most likely to have
+// matched earlier.
+- (int)prepare:(DB_txn *const)txn {
+	int rc = [super prepare:txn];
+	if(rc < 0) return rc;
+	estimate = 0;
+	for(size_t i = 0; i < count; i++) {
+		uint64_t const x = [filters[i] estimate];
+		estimate = x > UINT64_MAX - estimate ? UINT64_MAX : estimate + x;
+	}
+	// Only bounded if every child is.
+	bounded = count > 0;
+	for(size_t i = 0; bounded && i < count; i++) {
+		SLNBitmap const *const x = [filters[i] fileSet];
+		if(!x) bounded = false;
+		else rc = SLNBitmapOr(files, x);
+		if(rc < 0) return rc;
+	}
+	if(!bounded) SLNBitmapClear(files);
+	qsort(order, count, sizeof(*order), (int (*)())estimatecmp_desc);
+	return 0;
+}
+
 - (SLNAgeRange)fullAge:(uint64_t const)fileID {
 	SLNAgeRange age = { UINT64_MAX, 0 };
 	for(size_t i = 0; i < count; i++) {
-		SLNAgeRange const x = [filters[count-1-i] fullAge:fileID];
+		SLNAgeRange const x = [order[i] fullAge:fileID];
 		if(valid(x.min) && x.min < age.min) age.min = x.min;
 		if(valid(x.max) && x.max > age.max) age.max = x.max;
 	}
 	return age;
 }
 - (uint64_t)fastAge:(uint64_t const)fileID :(uint64_t const)sortID {
+	if(bounded && !SLNBitmapContains(files, fileID)) return UINT64_MAX;
 	bool hit = false;
 	for(size_t i = 0; i < count; i++) {
-		uint64_t const age = [filters[count-1-i] fastAge:fileID :sortID];
+		uint64_t const age = [order[i] fastAge:fileID :sortID];
 		if(age < sortID) return 0;
 		if(age == sortID) hit = true;
 	}
@@ -32,11 +32,15 @@
 }
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(uri \"%s\")\n", URI);
+	fprintf(stderr, "(uri \"%s\")", URI);
+	print_estimate(estimate);
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	return wr(data, size, URI);
 }
+- (bool)mayMatch:(SLNChanges const *const)changes {
+	return SLNChangesMayContain(changes, "", URI);
+}
 
 - (int)prepare:(DB_txn *const)txn {
 	int rc = [super prepare:txn];
@@ -44,6 +48,12 @@
 	db_cursor_renew(txn, &files); // SLNURIAndFileID
 	db_cursor_renew(txn, &age); // SLNURIAndFileID
 	curtxn = txn;
+
+	DB_range range[1];
+	SLNURIAndFileIDRange1(range, curtxn, URI);
+	rc = db_cursor_firstr(files, range, NULL, NULL, +1);
+	if(rc < 0 && DB_NOTFOUND != rc) return rc;
+	estimate = rc >= 0 ? 1 : 0;
 	return 0;
 }
 - (void)seek:(int const)dir :(uint64_t const)sortID :(uint64_t const)fileID {
@@ -122,7 +132,8 @@
 }
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(target \"%s\")\n", targetURI);
+	fprintf(stderr, "(target \"%s\")", targetURI);
+	print_estimate(estimate);
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	size_t len = 0;
@@ -130,6 +141,9 @@
 	len += wr(data+len, size-len, targetURI);
 	return len;
 }
+- (bool)mayMatch:(SLNChanges const *const)changes {
+	return SLNChangesMayContain(changes, "", targetURI);
+}
 
 - (int)prepare:(DB_txn *const)txn {
 	int rc = [super prepare:txn];
@@ -197,7 +211,8 @@
 }
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(all)\n");
+	fprintf(stderr, "(all)");
+	print_estimate(estimate);
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	return wr(data, size, "*");
@@ -6,6 +6,8 @@
 #include <objc/runtime.h>
 #include "../StrongLink.h"
 #include "../SLNDB.h"
+#include "../SLNPostings.h"
+#include "../SLNBitmap.h"
 #include "../../deps/libressl-portable/include/compat/stdlib.h"
 #include "../../deps/libressl-portable/include/compat/string.h"
 
@@ -24,6 +26,17 @@
 // compile-time checking.
 
 @interface SLNFilter : SLNObject
+{
+	uint64_t estimate; // Matching meta-files, or UINT64_MAX if unknown.
+}
+- (uint64_t)estimate;
+- (SLNFilter *)plan;
+- (bool)mayMatch:(SLNChanges const *const)changes;
+- (uint64_t)fingerprint:(uint64_t const)hash;
+- (size_t)serialize:(byte_t *const)data :(size_t const)size;
+// Superset of the matching file IDs, or NULL if unknown. Valid after
+// -prepare:, until the next -prepare: or -free.
+- (SLNBitmap const *)fileSet;
 @end
 @interface SLNFilter (Abstract)
 - (SLNFilterType)type;
@@ -72,6 +85,13 @@
 
 struct token {
 	str_t *str;
+	size_t offset; // Within the query.
+	uint64_t estimate;
+	SLNPostingsCursor *metafiles;
+	SLNPostingsCursor *match;
+	uint64_t *positions;
+	size_t pcount;
+	size_t psize;
 };
 @interface SLNFulltextFilter : SLNIndirectFilter
 {
@@ -79,11 +99,14 @@ struct token {
 	struct token *tokens;
 	size_t count;
 	size_t asize;
-	DB_cursor *metafiles;
-	DB_cursor *phrase; // TODO
-	DB_cursor *match;
 }
 @end
+@interface SLNFulltextFilter (Subclass)
+- (bool)verify:(uint64_t const)metaFileID;
+@end
+
+@interface SLNPhraseFilter : SLNFulltextFilter
+@end
 
 @interface SLNMetadataFilter : SLNIndirectFilter
 {
@@ -91,18 +114,33 @@ struct token {
 	str_t *value;
 	DB_cursor *metafiles;
 	DB_cursor *match;
+	bool indexed;
+	bool loaded; // All of files, instead of just what -fastAge:: needed.
+	SLNBitmap files[1];
 }
 @end
 
 // SLNCollectionFilter.m
+struct head {
+	uint64_t sortID;
+	uint64_t fileID;
+};
 @interface SLNCollectionFilter : SLNFilter
 {
-	SLNFilter **filters;
+	SLNFilter **filters; // In plan order.
+	SLNFilter **heap; // weak refs, a binary heap on their positions
+	struct head *heads; // Cached position of each filter in heap.
+	SLNFilter **order; // weak refs, in the order ages are checked
 	size_t count;
 	size_t asize;
 	int sort;
+	bool bounded; // Whether files is set.
+	SLNBitmap files[1];
 }
 - (int)addFilterArg:(SLNFilter *const)filter;
+- (SLNFilter *)plan;
+- (void)prune;
+- (SLNFilter *)negate;
 
 - (void)current:(int const)dir :(uint64_t *const)sortID :(uint64_t *const)fileID;
 - (void)step:(int const)dir;
@@ -110,6 +148,7 @@ struct token {
 - (void)sort:(int const)dir;
 @end
 @interface SLNIntersectionFilter : SLNCollectionFilter
+- (void)prune;
 - (SLNAgeRange)fullAge:(uint64_t const)fileID;
 - (uint64_t)fastAge:(uint64_t const)fileID :(uint64_t const)sortID;
 @end
@@ -185,6 +224,11 @@ static uint64_t invalid(int const dir) {
 static void indent(size_t const depth) {
 	for(size_t i = 0; i < depth; i++) fputc('\t', stderr);
 }
+// Ends a line of -print:, with the planner's estimate once it's known.
+static void print_estimate(uint64_t const estimate) {
+	if(UINT64_MAX != estimate) fprintf(stderr, " ; ~%llu", (unsigned long long)estimate);
+	fputc('\n', stderr);
+}
 static bool needs_quotes(strarg_t const str) {
 	// TODO: Kind of a hack.
 	for(size_t i = 0; '\0' != str[i]; i++) {
@@ -192,6 +236,23 @@ static bool needs_quotes(strarg_t const str) {
 	}
 	return false;
 }
+// FNV-1a, for filter fingerprints.
+static uint64_t fingerprint_add(uint64_t const hash, void const *const data, size_t const len) {
+	unsigned char const *const bytes = data;
+	uint64_t x = hash;
+	for(size_t i = 0; i < len; i++) {
+		x ^= bytes[i];
+		x *= UINT64_C(0x100000001b3);
+	}
+	return x;
+}
+// Appends to a -serialize:: buffer. Returns the new length even if it
+// didn't fit, so callers can measure first.
+static size_t serial_add(byte_t *const data, size_t const size, size_t const len, void const *const x, size_t const n) {
+	if(len < size) memcpy(data+len, x, MIN(n, size-len));
+	return len+n;
+}
+
 static size_t wr(str_t *const data, size_t const size, strarg_t const str) {
 	return strlcpy(data, str, size);
 }
@@ -19,9 +19,59 @@
 @end
 
 @implementation SLNFilter
+- (id)init {
+	if(!(self = [super init])) return nil;
+	estimate = UINT64_MAX;
+	return self;
+}
+- (void)free {
+	estimate = 0;
+	[super free];
+}
+
 - (SLNFilter *)unwrap {
 	return self;
 }
+- (uint64_t)estimate {
+	return estimate;
+}
+- (SLNFilter *)plan {
+	return self;
+}
+- (bool)mayMatch:(SLNChanges const *const)changes {
+	return true;
+}
+- (uint64_t)fingerprint:(uint64_t const)hash {
+	SLNFilterType const type = [self type];
+	uint64_t x = fingerprint_add(hash, &type, sizeof(type));
+	for(size_t i = 0;; i++) {
+		strarg_t const str = [self stringArg:i];
+		if(!str) break;
+		x = fingerprint_add(x, str, strlen(str)+1);
+	}
+	return x;
+}
+// Covers the same things as -fingerprint:, but exactly.
+- (size_t)serialize:(byte_t *const)data :(size_t const)size {
+	SLNFilterType const type = [self type];
+	size_t len = serial_add(data, size, 0, &type, sizeof(type));
+	for(size_t i = 0;; i++) {
+		strarg_t const str = [self stringArg:i];
+		if(!str) break;
+		size_t const n = strlen(str);
+		len = serial_add(data, size, len, &n, sizeof(n));
+		len = serial_add(data, size, len, str, n);
+	}
+	size_t const end = SIZE_MAX;
+	return serial_add(data, size, len, &end, sizeof(end));
+}
+- (SLNBitmap const *)fileSet {
+	return NULL;
+}
+
+- (strarg_t)stringArg:(size_t const)i {
+	return NULL;
+}
 
 - (int)addStringArg:(strarg_t const)str :(size_t const)len {
 	return DB_EINVAL;
@@ -30,6 +80,7 @@
 	return DB_EINVAL;
 }
 - (int)prepare:(DB_txn *const)txn {
+	estimate = UINT64_MAX;
 	return 0;
 }
 @end
@@ -49,6 +100,8 @@ SLNFilterRef SLNFilterCreateInternal(SLNFilterType const type) {
 			return (SLNFilterRef)[[SLNVisibleFilter alloc] init];
 		case SLNFulltextFilterType:
 			return (SLNFilterRef)[[SLNFulltextFilter alloc] init];
+		case SLNPhraseFilterType:
+			return (SLNFilterRef)[[SLNPhraseFilter alloc] init];
 		case SLNMetadataFilterType:
 			return (SLNFilterRef)[[SLNMetadataFilter alloc] init];
 		case SLNIntersectionFilterType:
@@ -96,6 +149,10 @@ void SLNFilterPrint(SLNFilterRef const filter, size_t const depth) {
 	assert(filter);
 	return [(SLNFilter *)filter print:depth];
 }
+SLNFilterRef SLNFilterPlan(SLNFilterRef const filter) {
+	if(!filter) return NULL;
+	return (SLNFilterRef)[(SLNFilter *)filter plan];
+}
 size_t SLNFilterToUserFilterString(SLNFilterRef const filter, str_t *const data, size_t const size, size_t const depth) {
 	assert(filter);
 	return [(SLNFilter *)filter getUserFilter:data :size :depth];
@@ -104,6 +161,10 @@ int SLNFilterPrepare(SLNFilterRef const filter, DB_txn *const txn) {
 	assert(filter);
 	return [(SLNFilter *)filter prepare:txn];
 }
+uint64_t SLNFilterGetEstimate(SLNFilterRef const filter) {
+	assert(filter);
+	return [(SLNFilter *)filter estimate];
+}
 void SLNFilterSeek(SLNFilterRef const filter, int const dir, uint64_t const sortID, uint64_t const fileID) {
 	[(SLNFilter *)filter seek:dir :sortID :fileID];
 }
@@ -125,4 +186,19 @@ uint64_t SLNFilterFastAge(SLNFilterRef const filter, uint64_t const fileID, uint
 	assert(filter);
 	return [(SLNFilter *)filter fastAge:fileID :sortID];
 }
+uint64_t SLNFilterFingerprint(SLNFilterRef const filter) {
+	assert(filter);
+	uint64_t const x = [(SLNFilter *)filter fingerprint:UINT64_C(0xcbf29ce484222325)];
+	// Zero and UINT64_MAX are reserved.
+	if(0 == x || UINT64_MAX == x) return 1;
+	return x;
+}
+size_t SLNFilterSerialize(SLNFilterRef const filter, byte_t *const data, size_t const size) {
+	assert(filter);
+	return [(SLNFilter *)filter serialize:data :size];
+}
+bool SLNFilterMayMatch(SLNFilterRef const filter, SLNChanges const *const changes) {
+	assert(filter);
+	return [(SLNFilter *)filter mayMatch:changes];
+}
 
@@ -1,11 +1,25 @@
 // Copyright 2014-2015 Ben Trask
 // MIT licensed (see LICENSE for details)
 
+#include <openssl/hmac.h>
 #include "../StrongLink.h"
 #include "../SLNDB.h"
 #include "../http/QueryString.h"
 
 #define BATCH_SIZE 50
+// Exports read up to this many results per transaction, so the filter
+// only has to be prepared and re-seeked once for each.
+#define STREAM_BATCH_SIZE 1000
+// Estimates count up to this many results before extrapolating.
+#define SAMPLE_MAX 1000
+
+// Continuation tokens: sortID, fileID and filter fingerprint, followed by
+// a truncated HMAC. The key is random per process, so tokens don't survive
+// restarts.
+#define TOKEN_PREFIX '~'
+#define TOKEN_DATA (8 * 3)
+#define TOKEN_MAC 16
+#define TOKEN_LEN (1 + (TOKEN_DATA + TOKEN_MAC) * 2)
 
 // TODO: Copy and pasted from SLNFilter.h.
 static bool valid(uint64_t const x) {
@@ -18,6 +32,68 @@ static uint64_t invalid(int const dir) {
 	return 0;
 }
 
+static byte_t token_key[32];
+static bool token_key_ready = false;
+static int token_mac(byte_t const *const data, byte_t *const out) {
+	if(!token_key_ready) {
+		if(async_random(token_key, sizeof(token_key)) < 0) return DB_EIO;
+		token_key_ready = true;
+	}
+	byte_t mac[EVP_MAX_MD_SIZE];
+	unsigned len = 0;
+	if(!HMAC(EVP_sha256(), token_key, sizeof(token_key), data, TOKEN_DATA, mac, &len)) return DB_ENOMEM;
+	assert(len >= TOKEN_MAC);
+	memcpy(out, mac, TOKEN_MAC);
+	return 0;
+}
+static void pack64(byte_t *const out, uint64_t const x) {
+	for(size_t i = 0; i < 8; i++) out[i] = 0xff & (x >> (56 - 8*i));
+}
+static uint64_t unpack64(byte_t const *const in) {
+	uint64_t x = 0;
+	for(size_t i = 0; i < 8; i++) x = x << 8 | in[i];
+	return x;
+}
+static void parse_token(strarg_t const str, SLNFilterPosition *const start) {
+	// Bad tokens get a fingerprint that no filter has.
+	start->fingerprint = UINT64_MAX;
+	if(TOKEN_LEN != strlen(str)) return;
+	byte_t buf[TOKEN_DATA + TOKEN_MAC];
+	tobin(buf, str+1, TOKEN_LEN-1);
+	byte_t mac[TOKEN_MAC];
+	if(token_mac(buf, mac) < 0) return;
+	byte_t diff = 0;
+	for(size_t i = 0; i < TOKEN_MAC; i++) diff |= mac[i] ^ buf[TOKEN_DATA+i];
+	if(diff) return;
+	uint64_t const fingerprint = unpack64(buf+16);
+	if(!valid(fingerprint)) return;
+	start->sortID = unpack64(buf+0);
+	start->fileID = unpack64(buf+8);
+	start->fingerprint = fingerprint;
+}
+str_t *SLNFilterPositionCopyToken(SLNFilterRef const filter, SLNFilterPosition const *const pos) {
+	assert(filter);
+	assert(pos);
+	if(pos->URI) return NULL;
+	if(!valid(pos->sortID)) return NULL;
+	byte_t buf[TOKEN_DATA + TOKEN_MAC];
+	pack64(buf+0, pos->sortID);
+	pack64(buf+8, pos->fileID);
+	pack64(buf+16, SLNFilterFingerprint(filter));
+	if(token_mac(buf, buf+TOKEN_DATA) < 0) return NULL;
+	str_t *const token = malloc(TOKEN_LEN+1);
+	if(!token) return NULL;
+	token[0] = TOKEN_PREFIX;
+	tohex(token+1, buf, sizeof(buf));
+	token[TOKEN_LEN] = '\0';
+	return token;
+}
+bool SLNFilterPositionMatches(SLNFilterRef const filter, SLNFilterPosition const *const pos) {
+	assert(pos);
+	if(!pos->fingerprint) return true;
+	return SLNFilterFingerprint(filter) == pos->fingerprint;
+}
+
 static void parse_start(strarg_t const str, SLNFilterPosition *const start) {
 	assert(!start->URI);
 	assert(0 != start->dir);
@@ -33,6 +109,10 @@ static void parse_start(strarg_t const str, SLNFilterPosition *const start) {
 	}
 	start->sortID = invalid(-start->dir);
 	start->fileID = invalid(-start->dir);
+	if(start->URI && TOKEN_PREFIX == start->URI[0]) {
+		parse_token(start->URI, start);
+		FREE(&start->URI);
+	}
 }
 static uint64_t parse_count(strarg_t const str, uint64_t const count) {
 	if(!str) return count;
@@ -76,10 +156,12 @@ void SLNFilterPositionCleanup(SLNFilterPosition *const pos) {
 	FREE(&pos->URI);
 	pos->sortID = 0;
 	pos->fileID = 0;
+	pos->fingerprint = 0;
 	assert_zeroed(pos, 1);
 }
 
 int SLNFilterSeekToPosition(SLNFilterRef const filter, SLNFilterPosition const *const pos, DB_txn *const txn) {
+	if(!SLNFilterPositionMatches(filter, pos)) return DB_EINVAL;
 	if(!pos->URI) {
 		SLNFilterSeek(filter, pos->dir, pos->sortID, pos->fileID);
 		if(valid(pos->fileID)) SLNFilterStep(filter, pos->dir);
@@ -136,10 +218,16 @@ int SLNFilterGetPosition(SLNFilterRef const filter, SLNFilterPosition *const pos
 	pos->fileID = fileID;
 	return 0;
 }
-int SLNFilterCopyURI(SLNFilterRef const filter, uint64_t const fileID, bool const meta, DB_txn *const txn, str_t **const out) {
+// Lookups go through a cursor when walking many results. They're done in
+// file ID order (see copy_URIs), so the seeks stay close together.
+static int lookup(DB_cursor *const cursor, DB_txn *const txn, DB_val *const key, DB_val *const val) {
+	if(!cursor) return db_get(txn, key, val);
+	return db_cursor_seek(cursor, key, val, 0);
+}
+static int copy_URI(DB_cursor *const files, DB_cursor *const metafiles, uint64_t const fileID, bool const meta, DB_txn *const txn, str_t **const out) {
 	DB_val fileID_key[1], file_val[1];
 	SLNFileByIDKeyPack(fileID_key, txn, fileID);
-	int rc = db_get(txn, fileID_key, file_val);
+	int rc = lookup(files, txn, fileID_key, file_val);
 	if(rc < 0) return rc;
 
 	strarg_t const hash = db_read_string(file_val, txn);
@@ -152,7 +240,7 @@ int SLNFilterCopyURI(SLNFilterRef const filter, uint64_t const fileID, bool cons
 	} else {
 		DB_val key[1], val[1];
 		SLNMetaFileByIDKeyPack(key, txn, fileID);
-		rc = db_get(txn, key, val);
+		rc = lookup(metafiles, txn, key, val);
 		if(rc < 0) return rc;
 		uint64_t f;
 		strarg_t target = NULL;
@@ -166,72 +254,256 @@ int SLNFilterCopyURI(SLNFilterRef const filter, uint64_t const fileID, bool cons
 	return 0;
 }
 
-ssize_t SLNFilterCopyURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const dir, bool const meta, str_t *URIs[], size_t const max) {
-	assert(URIs);
-	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return DB_EACCES;
-	if(0 == pos->dir) return DB_EINVAL;
-	if(0 == dir) return DB_EINVAL;
-	if(0 == max) return 0;
-
-	DB_env *db = NULL;
-	DB_txn *txn = NULL;
-	ssize_t rc = 0;
-
-	SLNRepoRef const repo = SLNSessionGetRepo(session);
-	SLNRepoDBOpen(repo, &db);
-	rc = db_txn_begin(db, NULL, DB_RDONLY, &txn);
-	if(rc < 0) goto cleanup;
+int SLNFilterCopyURI(SLNFilterRef const filter, uint64_t const fileID, bool const meta, DB_txn *const txn, str_t **const out) {
+	return copy_URI(NULL, NULL, fileID, meta, txn, out);
+}
 
-	rc = SLNFilterPrepare(filter, txn);
-	if(rc < 0) goto cleanup;
+struct result {
+	uint64_t fileID;
+	size_t x; // Slot in the output.
+};
+static int result_cmp(void const *const a, void const *const b) {
+	struct result const *const x = a;
+	struct result const *const y = b;
+	if(x->fileID < y->fileID) return -1;
+	if(x->fileID > y->fileID) return +1;
+	return 0;
+}
+static ssize_t copy_URIs(SLNFilterRef const filter, SLNFilterPosition *const pos, int const dir, bool const meta, DB_txn *const txn, str_t *URIs[], size_t const max) {
+	DB_cursor *files = NULL;
+	DB_cursor *metafiles = NULL;
+	struct result *results = NULL;
+	ssize_t rc = SLNFilterPrepare(filter, txn);
+	if(rc < 0) return rc;
 	rc = SLNFilterSeekToPosition(filter, pos, txn);
+	if(rc < 0) return rc;
+	rc = db_cursor_open(txn, &files);
+	if(rc >= 0 && meta) rc = db_cursor_open(txn, &metafiles);
+	if(rc < 0) goto cleanup;
+	results = calloc(MAX(1, max), sizeof(*results));
+	if(!results) rc = DB_ENOMEM;
 	if(rc < 0) goto cleanup;
 
 	int const stepdir = pos->dir * dir;
 	size_t i = 0;
 	for(; i < max; i++) {
-		size_t const x = stepdir > 0 ? i : max-1-i;
 		rc = SLNFilterGetPosition(filter, pos, txn);
 		if(DB_NOTFOUND == rc) {
 			rc = 0;
 			break;
 		}
-		rc = SLNFilterCopyURI(filter, pos->fileID, meta, txn, &URIs[x]);
 		if(rc < 0) goto cleanup;
-		assert(URIs[x]);
+		results[i].fileID = pos->fileID;
+		results[i].x = stepdir > 0 ? i : max-1-i;
 		SLNFilterStep(filter, pos->dir);
 	}
 
+	// Results come in sort order, which is unrelated to where the files
+	// are stored. Looking them up in ID order turns random seeks into a
+	// mostly forward scan.
+	qsort(results, i, sizeof(*results), result_cmp);
+	for(size_t j = 0; j < i; j++) {
+		size_t const x = results[j].x;
+		rc = copy_URI(files, metafiles, results[j].fileID, meta, txn, &URIs[x]);
+		if(rc < 0) {
+			for(size_t k = 0; k < j; k++) FREE(&URIs[results[k].x]);
+			goto cleanup;
+		}
+		assert(URIs[x]);
+	}
+
 	// The results should always be in the first `i` slots, even when
 	// filling them in reverse order.
 	if(stepdir < 0) {
 		memmove(URIs+0, URIs+(max-i), sizeof(*URIs) * i);
 	}
-
-	assert(rc >= 0);
 	rc = i;
 
+cleanup:
+	FREE(&results);
+	db_cursor_close(files); files = NULL;
+	db_cursor_close(metafiles); metafiles = NULL;
+	return rc;
+}
+// Only first pages are cached, since later ones rarely repeat.
+static bool first_page(SLNFilterPosition const *const pos) {
+	if(pos->URI) return false;
+	if(pos->fingerprint) return false;
+	return invalid(-pos->dir) == pos->sortID && invalid(-pos->dir) == pos->fileID;
+}
+ssize_t SLNFilterCopyURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const dir, bool const meta, str_t *URIs[], size_t const max) {
+	assert(URIs);
+	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return DB_EACCES;
+	if(0 == pos->dir) return DB_EINVAL;
+	if(0 == dir) return DB_EINVAL;
+	if(0 == max) return 0;
+
+	DB_env *db = NULL;
+	DB_txn *txn = NULL;
+	ssize_t rc = 0;
+
+	SLNRepoRef const repo = SLNSessionGetRepo(session);
+	SLNQueryCacheRef const cache = SLNRepoGetQueryCache(repo);
+	bool const cacheable = first_page(pos);
+	if(cacheable) {
+		rc = SLNQueryCacheCopyURIs(cache, filter, pos, dir, meta, URIs, max);
+		if(DB_NOTFOUND != rc) return rc;
+	}
+	// Checked before our snapshot, so a submission in between only
+	// makes the cache entry look older than it is.
+	uint64_t const latest = SLNRepoSubmissionLatest(repo);
+
+	SLNRepoDBOpen(repo, &db);
+	rc = db_txn_begin(db, NULL, DB_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+
+	rc = copy_URIs(filter, pos, dir, meta, txn, URIs, max);
+
 cleanup:
 	db_txn_abort(txn); txn = NULL;
 	SLNRepoDBClose(repo, &db);
 
+	if(cacheable && rc >= 0) {
+		SLNQueryCacheAddURIs(cache, filter, latest, pos, dir, meta, URIs, rc, max);
+	}
 	return rc;
 }
-ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx) {
-	str_t *URIs[BATCH_SIZE];
-	ssize_t const count = SLNFilterCopyURIs(filter, session, pos, pos->dir, meta, URIs, MIN(max, BATCH_SIZE));
+// Counts results from one end without looking up their URIs. Also
+// reports the sortIDs of the first and last results walked.
+static int walk(SLNFilterRef const filter, DB_txn *const txn, int const dir, uint64_t const max, uint64_t *const count, uint64_t *const first, uint64_t *const last) {
+	SLNFilterPosition pos[1] = {{ .dir = dir }};
+	pos->sortID = invalid(-dir);
+	pos->fileID = invalid(-dir);
+	int rc = SLNFilterPrepare(filter, txn);
+	if(rc < 0) return rc;
+	rc = SLNFilterSeekToPosition(filter, pos, txn);
+	if(rc < 0) return rc;
+	uint64_t n = 0;
+	for(; n < max; n++) {
+		rc = SLNFilterGetPosition(filter, pos, txn);
+		if(DB_NOTFOUND == rc) break;
+		if(rc < 0) return rc;
+		if(0 == n && first) *first = pos->sortID;
+		SLNFilterStep(filter, dir);
+	}
+	if(last) *last = pos->sortID;
+	*count = n;
+	return 0;
+}
+int SLNFilterCount(SLNFilterRef const filter, SLNSessionRef const session, uint64_t *const out) {
+	assert(out);
+	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return DB_EACCES;
+
+	SLNRepoRef const repo = SLNSessionGetRepo(session);
+	SLNQueryCacheRef const cache = SLNRepoGetQueryCache(repo);
+	int rc = SLNQueryCacheGetCount(cache, filter, out);
+	if(DB_NOTFOUND != rc) return rc;
+	uint64_t const latest = SLNRepoSubmissionLatest(repo);
+
+	DB_env *db = NULL;
+	DB_txn *txn = NULL;
+	SLNRepoDBOpen(repo, &db);
+	rc = db_txn_begin(db, NULL, DB_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = walk(filter, txn, +1, UINT64_MAX, out, NULL, NULL);
+cleanup:
+	db_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, &db);
+
+	if(rc >= 0) SLNQueryCacheAddCount(cache, filter, latest, *out);
+	return rc;
+}
+int SLNFilterEstimate(SLNFilterRef const filter, SLNSessionRef const session, uint64_t *const out) {
+	assert(out);
+	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return DB_EACCES;
+
+	SLNRepoRef const repo = SLNSessionGetRepo(session);
+	if(SLNQueryCacheGetCount(SLNRepoGetQueryCache(repo), filter, out) >= 0) return 0;
+
+	DB_env *db = NULL;
+	DB_txn *txn = NULL;
+	uint64_t n = 0, newest = 0, oldest = 0;
+	SLNRepoDBOpen(repo, &db);
+	int rc = db_txn_begin(db, NULL, DB_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = walk(filter, txn, -1, SAMPLE_MAX, &n, &newest, &oldest);
+	if(rc < 0) goto cleanup;
+	if(n < SAMPLE_MAX) {
+		*out = n;
+		goto cleanup;
+	}
+
+	// sortIDs only increase, so assume older results are as dense as
+	// the ones we saw, but never more than the indexes allow.
+	assert(newest >= oldest);
+	double const x = (double)n * newest / (newest - oldest + 1);
+	uint64_t est = x >= (double)UINT64_MAX ? UINT64_MAX : MAX((uint64_t)x, n);
+	uint64_t const bound = SLNFilterGetEstimate(filter);
+	if(bound >= n) est = MIN(est, bound);
+	*out = est;
+
+cleanup:
+	db_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, &db);
+	return rc;
+}
+
+// Written BATCH_SIZE URIs at a time.
+static ssize_t write_URIs(str_t *URIs[], ssize_t const count, SLNFilterWriteCB const writecb, void *ctx) {
 	if(count <= 0) return count;
-	uv_buf_t parts[BATCH_SIZE*2];
-	for(size_t i = 0; i < count; i++) {
-		parts[i*2+0] = uv_buf_init((char *)URIs[i], strlen(URIs[i]));
-		parts[i*2+1] = uv_buf_init((char *)STR_LEN("\r\n"));
+	int rc = 0;
+	for(size_t i = 0; i < count && rc >= 0; i += BATCH_SIZE) {
+		size_t const n = MIN(count-i, BATCH_SIZE);
+		uv_buf_t parts[BATCH_SIZE*2];
+		for(size_t j = 0; j < n; j++) {
+			parts[j*2+0] = uv_buf_init((char *)URIs[i+j], strlen(URIs[i+j]));
+			parts[j*2+1] = uv_buf_init((char *)STR_LEN("\r\n"));
+		}
+		rc = writecb(ctx, parts, n*2);
 	}
-	int rc = writecb(ctx, parts, count*2);
 	for(size_t i = 0; i < count; i++) FREE(&URIs[i]);
 	assert_zeroed(URIs, count);
 	if(rc < 0) return rc;
 	return count;
 }
+ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx) {
+	size_t const n = MIN(max, STREAM_BATCH_SIZE);
+	if(!n) return 0;
+	str_t **URIs = calloc(n, sizeof(*URIs));
+	if(!URIs) return DB_ENOMEM;
+	ssize_t const count = SLNFilterCopyURIs(filter, session, pos, pos->dir, meta, URIs, n);
+	ssize_t const rc = write_URIs(URIs, count, writecb, ctx);
+	FREE(&URIs);
+	return rc;
+}
+
+// The filter's position is kept between wakeups, and new matches are
+// found during the repo's shared fan-out.
+typedef struct {
+	SLNFilterRef filter;
+	SLNFilterPosition *pos;
+	bool meta;
+	size_t max;
+	ssize_t count;
+	str_t *URIs[BATCH_SIZE];
+} live_query;
+static void scanned(SLNFilterPosition *const pos, uint64_t const latest) {
+	// This is how far we scanned, even if we didn't find anything.
+	if(pos->sortID >= latest) return;
+	FREE(&pos->URI);
+	pos->sortID = latest;
+	pos->fileID = 0;
+}
+static int live_query_cb(void *ctx, DB_txn *const txn, uint64_t const latest) {
+	live_query *const q = ctx;
+	q->count = copy_URIs(q->filter, q->pos, q->pos->dir, q->meta, txn, q->URIs, q->max);
+	if(q->count < 0) return q->count;
+	return 0;
+}
+static bool live_query_test(void *ctx, SLNChanges const *const changes) {
+	live_query *const q = ctx;
+	return SLNFilterMayMatch(q->filter, changes);
+}
 int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, bool const wait, SLNFilterWriteCB const writecb, SLNFilterFlushCB const flushcb, void *ctx) {
 	uint64_t remaining = max;
 	for(;;) {
@@ -239,40 +511,49 @@ int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, S
 		if(count < 0) return count;
 		remaining -= count;
 		if(!remaining) return 0;
-		if(!count) break;
+		if(count < STREAM_BATCH_SIZE) break;
 	}
 
 	if(!wait || pos->dir < 0) return 0;
 
 	SLNRepoRef const repo = SLNSessionGetRepo(session);
+	live_query q[1] = {{ .filter = filter, .pos = pos, .meta = meta }};
+	SLNSubscriber sub[1] = {{ .cb = live_query_cb, .test = live_query_test, .ctx = q }};
 	for(;;) {
 		int rc = flushcb ? flushcb(ctx) : 0;
 		if(rc < 0) return rc;
 
-		uint64_t latest = pos->sortID;
+		q->max = MIN(remaining, BATCH_SIZE);
+		q->count = 0;
+		sub->sortID = pos->sortID;
 		uint64_t const timeout = uv_now(async_loop)+(1000 * 30);
-		rc = SLNRepoSubmissionWait(repo, &latest, timeout);
+		rc = SLNRepoSubmissionSubscribe(repo, sub, timeout);
 		if(UV_ETIMEDOUT == rc) {
 			uv_buf_t const parts[] = { uv_buf_init((char *)STR_LEN("\r\n")) };
 			rc = writecb(ctx, parts, numberof(parts));
 			if(rc < 0) break;
 			continue;
 		}
-		assert(rc >= 0); // TODO: Handle cancellation?
+		if(rc < 0) return rc;
+
+		ssize_t count = write_URIs(q->URIs, q->count, writecb, ctx);
+		if(count < 0) return count;
+		remaining -= count;
+		if(!remaining) return 0;
+		if(count < BATCH_SIZE) {
+			scanned(pos, sub->latest);
+			continue;
+		}
 
+		// We fell behind, so catch up on our own.
 		for(;;) {
-			ssize_t const count = SLNFilterWriteURIBatch(filter, session, pos, meta, remaining, writecb, ctx);
+			count = SLNFilterWriteURIBatch(filter, session, pos, meta, remaining, writecb, ctx);
 			if(count < 0) return count;
 			remaining -= count;
 			if(!remaining) return 0;
-			if(count < BATCH_SIZE) break;
-		}
-
-		// This is how far we scanned, even if we didn't find anything.
-		if(pos->sortID < latest) {
-			pos->sortID = latest;
-			pos->fileID = 0;
+			if(count < STREAM_BATCH_SIZE) break;
 		}
+		scanned(pos, sub->latest);
 	}
 
 	return 0;
@@ -154,7 +154,8 @@
 }
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(visible)\n");
+	fprintf(stderr, "(visible)");
+	print_estimate(estimate);
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	if(depth) return wr(data, size, "*");
@@ -202,18 +203,35 @@
 }
 @end
 
+// Past this many postings, a token counts as common. Estimating only
+// reads block headers, but there's no reason to read all of them.
+#define ESTIMATE_MAX (SLN_POSTINGS_BLOCK_MAX * 32)
+
+static int token_cmp(void const *const a, void const *const b) {
+	struct token const *const x = a;
+	struct token const *const y = b;
+	if(x->estimate < y->estimate) return -1;
+	if(x->estimate > y->estimate) return +1;
+	return 0;
+}
+
 @implementation SLNFulltextFilter
 - (void)free {
 	FREE(&term);
 	for(size_t i = 0; i < count; ++i) {
 		FREE(&tokens[i].str);
+		tokens[i].offset = 0;
+		tokens[i].estimate = 0;
+		SLNPostingsCursorClose(tokens[i].metafiles); tokens[i].metafiles = NULL;
+		SLNPostingsCursorClose(tokens[i].match); tokens[i].match = NULL;
+		FREE(&tokens[i].positions);
+		tokens[i].pcount = 0;
+		tokens[i].psize = 0;
 	}
 	assert_zeroed(tokens, count);
 	FREE(&tokens);
 	count = 0;
 	asize = 0;
-	db_cursor_close(metafiles); metafiles = NULL;
-	db_cursor_close(match); match = NULL;
 	[super free];
 }
 
@@ -251,7 +269,10 @@
 			tokens = reallocarray(tokens, asize, sizeof(tokens[0]));
 			assert(tokens); // TODO
 		}
-		tokens[count].str = strndup(token, tlen);
+		tokens[count] = (struct token){
+			.str = strndup(token, tlen),
+			.offset = count,
+		};
 		assert(tokens[count].str); // TODO
 		count++;
 	}
@@ -263,68 +284,154 @@
 }
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(fulltext %s)\n", term);
+	fprintf(stderr, "(fulltext %s)", term);
+	print_estimate(estimate);
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	return wr(data, size, term);
 }
+- (bool)mayMatch:(SLNChanges const *const)changes {
+	// Every token has to be in the same new meta-file.
+	for(size_t i = 0; i < count; i++) {
+		if(!SLNChangesMayContain(changes, NULL, tokens[i].str)) return false;
+	}
+	return true;
+}
 
 - (int)prepare:(DB_txn *const)txn {
 	int rc = [super prepare:txn];
 	if(rc < 0) return rc;
-	db_cursor_renew(txn, &metafiles);
-	db_cursor_renew(txn, &match);
+	if(!count) return DB_EINVAL;
+	for(size_t i = 0; i < count; i++) {
+		SLNPostingsCursorRenew(txn, tokens[i].str, &tokens[i].metafiles);
+		SLNPostingsCursorRenew(txn, tokens[i].str, &tokens[i].match);
+		tokens[i].estimate = UINT64_MAX;
+		SLNPostingsEstimate(txn, tokens[i].str, ESTIMATE_MAX, &tokens[i].estimate);
+	}
+	// The rarest token drives the intersection and is checked first
+	// when matching, so the common ones are mostly skipped over.
+	qsort(tokens, count, sizeof(*tokens), token_cmp);
+	estimate = tokens[0].estimate;
 	return 0;
 }
 
+// Leapfrog the other tokens' postings up to tokens[0], which is at sortID.
+// Each seek can only move forward (in dir), and seeks that land nearby stay
+// within the cached block, so selective queries touch very few rows.
+- (uint64_t)intersect:(int const)dir :(uint64_t const)sortID {
+	uint64_t target = sortID;
+	size_t i = 1;
+	while(i < count) {
+		uint64_t actual = target;
+		int rc = SLNPostingsCursorSeek(tokens[i].metafiles, &actual, dir);
+		if(rc < 0) return invalid(dir);
+		if(actual == target) { i++; continue; }
+		rc = SLNPostingsCursorSeek(tokens[0].metafiles, &actual, dir);
+		if(rc < 0) return invalid(dir);
+		target = actual;
+		i = 1;
+	}
+	return target;
+}
+// Intersects starting at sortID, then skips any results that fail -verify:.
+- (uint64_t)settle:(int const)dir :(uint64_t const)sortID {
+	uint64_t actualSortID = sortID;
+	for(;;) {
+		actualSortID = [self intersect:dir :actualSortID];
+		if(!valid(actualSortID)) return actualSortID;
+		if([self verify:actualSortID]) return actualSortID;
+		int rc = SLNPostingsCursorNext(tokens[0].metafiles, &actualSortID, dir);
+		if(rc < 0) return invalid(dir);
+	}
+}
+- (bool)verify:(uint64_t const)metaFileID {
+	return true;
+}
+
 - (uint64_t)seekMeta:(int const)dir :(uint64_t const)sortID {
 	assert(count);
-	DB_range range[1];
-	SLNTermMetaFileIDAndPositionRange1(range, curtxn, tokens[0].str);
-	DB_val sortID_key[1];
-	SLNTermMetaFileIDAndPositionKeyPack(sortID_key, curtxn, tokens[0].str, sortID, 0);
-	// TODO: In order to handle seeking backwards over document with several matching positions, we need to use sortID+1... But sortID might be UINT64_MAX, so be careful.
-	int rc = db_cursor_seekr(metafiles, range, sortID_key, NULL, dir);
+	uint64_t actualSortID = sortID;
+	int rc = SLNPostingsCursorSeek(tokens[0].metafiles, &actualSortID, dir);
 	if(rc < 0) return invalid(dir);
-	strarg_t token;
-	uint64_t actualSortID, position;
-	SLNTermMetaFileIDAndPositionKeyUnpack(sortID_key, curtxn, &token, &actualSortID, &position);
-	assert(0 == strcmp(tokens[0].str, token));
-	return actualSortID;
+	return [self settle:dir :actualSortID];
 }
 - (uint64_t)currentMeta:(int const)dir {
 	assert(count);
-	DB_val sortID_key[1];
-	int rc = db_cursor_current(metafiles, sortID_key, NULL);
+	uint64_t sortID;
+	int rc = SLNPostingsCursorCurrent(tokens[0].metafiles, &sortID);
 	if(rc < 0) return invalid(dir);
-	strarg_t token;
-	uint64_t sortID, position;
-	SLNTermMetaFileIDAndPositionKeyUnpack(sortID_key, curtxn, &token, &sortID, &position);
-	assert(0 == strcmp(tokens[0].str, token));
 	return sortID;
 }
 - (uint64_t)stepMeta:(int const)dir {
 	assert(count);
-	DB_range range[1];
-	SLNTermMetaFileIDAndPositionRange1(range, curtxn, tokens[0].str);
-	DB_val sortID_key[1];
-	int rc = db_cursor_nextr(metafiles, range, sortID_key, NULL, dir);
+	uint64_t sortID;
+	int rc = SLNPostingsCursorNext(tokens[0].metafiles, &sortID, dir);
 	if(rc < 0) return invalid(dir);
-	strarg_t token;
-	uint64_t sortID, position;
-	SLNTermMetaFileIDAndPositionKeyUnpack(sortID_key, curtxn, &token, &sortID, &position);
-	assert(0 == strcmp(tokens[0].str, token));
-	return sortID;
+	return [self settle:dir :sortID];
 }
 - (bool)match:(uint64_t const)metaFileID {
 	assert(count);
-	DB_range range[1];
-	SLNTermMetaFileIDAndPositionRange2(range, curtxn, tokens[0].str, metaFileID);
-	DB_val sortID_key[1];
-	int rc = db_cursor_firstr(match, range, sortID_key, NULL, +1);
-	if(rc >= 0) return true;
-	if(DB_NOTFOUND == rc) return false;
-	assertf(0, "Database error %s", sln_strerror(rc));
+	for(size_t i = 0; i < count; i++) {
+		uint64_t actualMetaFileID = metaFileID;
+		int rc = SLNPostingsCursorSeek(tokens[i].match, &actualMetaFileID, 0);
+		if(DB_NOTFOUND == rc) return false;
+		assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+	}
+	return [self verify:metaFileID];
+}
+@end
+
+static bool contains(uint64_t const *const list, size_t const count, uint64_t const x) {
+	size_t lo = 0, hi = count;
+	while(lo < hi) {
+		size_t const mid = lo + (hi-lo) / 2;
+		if(list[mid] == x) return true;
+		if(list[mid] < x) lo = mid+1;
+		else hi = mid;
+	}
+	return false;
+}
+
+@implementation SLNPhraseFilter
+- (SLNFilterType)type {
+	return SLNPhraseFilterType;
+}
+- (void)print:(size_t const)depth {
+	indent(depth);
+	fprintf(stderr, "(phrase \"%s\")", term);
+	print_estimate(estimate);
+}
+- (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
+	size_t len = 0;
+	len += wr(data+len, size-len, "\"");
+	len += wr(data+len, size-len, term);
+	len += wr(data+len, size-len, "\"");
+	return len;
+}
+
+// Checks adjacency using the stored word positions, so documents never
+// have to be loaded.
+- (bool)verify:(uint64_t const)metaFileID {
+	if(count < 2) return true;
+	for(size_t i = 0; i < count; i++) {
+		int rc = SLNPostingsGetPositions(curtxn, tokens[i].str, metaFileID, &tokens[i].positions, &tokens[i].pcount, &tokens[i].psize);
+		// Meta-files indexed before positions were recorded can't be
+		// checked, so fall back to matching all of the terms.
+		if(DB_NOTFOUND == rc) return true;
+		assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+	}
+	// Anchor on each occurrence of the rarest token.
+	for(size_t i = 0; i < tokens[0].pcount; i++) {
+		uint64_t const pos = tokens[0].positions[i];
+		if(pos < tokens[0].offset) continue;
+		uint64_t const start = pos - tokens[0].offset;
+		size_t j = 1;
+		for(; j < count; j++) {
+			if(!contains(tokens[j].positions, tokens[j].pcount, start + tokens[j].offset)) break;
+		}
+		if(j >= count) return true;
+	}
+	return false;
 }
 @end
 
@@ -334,6 +441,9 @@
 	FREE(&value);
 	db_cursor_close(metafiles); metafiles = NULL;
 	db_cursor_close(match); match = NULL;
+	indexed = false;
+	loaded = false;
+	SLNBitmapClear(files);
 	[super free];
 }
 
@@ -362,7 +472,8 @@
 }
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(metadata \"%s\" \"%s\")\n", field, value);
+	fprintf(stderr, "(metadata \"%s\" \"%s\")", field, value);
+	print_estimate(estimate);
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	size_t len = 0;
@@ -371,6 +482,9 @@
 	len += wr_quoted(data+len, size-len, value);
 	return len;
 }
+- (bool)mayMatch:(SLNChanges const *const)changes {
+	return SLNChangesMayContain(changes, field, value);
+}
 
 - (int)prepare:(DB_txn *const)txn {
 	int rc = [super prepare:txn];
@@ -378,9 +492,50 @@
 	if(!field || !value) return DB_EINVAL;
 	db_cursor_renew(txn, &metafiles); // SLNFieldValueAndMetaFileID
 	db_cursor_renew(txn, &match); // SLNFieldValueAndMetaFileID
+	indexed = false;
+	loaded = false;
+	SLNBitmapClear(files);
+
+	DB_val count_key[1];
+	SLNFieldValueMetaFileCountKeyPack(count_key, txn, field, value);
+	DB_val count_val[1];
+	rc = db_get(txn, count_key, count_val);
+	if(rc >= 0) {
+		SLNFieldValueMetaFileCountValUnpack(count_val, txn, &estimate, &indexed);
+		return 0;
+	}
+	if(DB_NOTFOUND != rc) return rc;
+	// No statistics yet, so count the first few rows.
+	DB_range range[1];
+	SLNFieldValueAndMetaFileIDRange2(range, txn, field, value);
+	estimate = 0;
+	rc = db_cursor_firstr(metafiles, range, NULL, NULL, +1);
+	for(; rc >= 0; rc = db_cursor_nextr(metafiles, range, NULL, NULL, +1)) {
+		if(++estimate >= ESTIMATE_MAX) break;
+	}
+	if(rc < 0 && DB_NOTFOUND != rc) return rc;
 	return 0;
 }
 
+- (SLNBitmap const *)fileSet {
+	if(!indexed) return NULL;
+	if(loaded) return files;
+	int rc = SLNBitmapLoad(curtxn, field, value, files);
+	assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+	loaded = true;
+	return files;
+}
+// Common values can rule out most files without joining through their
+// meta-files. Only the containers we run into are read.
+- (uint64_t)fastAge:(uint64_t const)fileID :(uint64_t const)sortID {
+	if(indexed && !loaded) {
+		int rc = SLNBitmapLoadContainer(curtxn, field, value, fileID, files);
+		assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+	}
+	if(indexed && !SLNBitmapContains(files, fileID)) return UINT64_MAX;
+	return [super fastAge:fileID :sortID];
+}
+
 - (uint64_t)seekMeta:(int const)dir :(uint64_t const)sortID {
 	DB_range range[1];
 	SLNFieldValueAndMetaFileIDRange2(range, curtxn, field, value);
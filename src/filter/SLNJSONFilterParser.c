@@ -51,7 +51,7 @@ SLNFilterRef SLNJSONFilterParserEnd(SLNJSONFilterParserRef const parser) {
 	assertf(-1 == parser->depth, "Parser ended at invalid depth %d", parser->depth);
 	SLNFilterRef const filter = parser->stack[0];
 	parser->stack[0] = NULL;
-	return yajl_status_ok == err ? filter : NULL;
+	return yajl_status_ok == err ? SLNFilterPlan(filter) : NULL;
 }
 
 SLNFilterType SLNFilterTypeFromString(strarg_t const type, size_t const len) {
@@ -60,6 +60,7 @@ SLNFilterType SLNFilterTypeFromString(strarg_t const type, size_t const len) {
 	if(substr("intersection", type, len)) return SLNIntersectionFilterType;
 	if(substr("union", type, len)) return SLNUnionFilterType;
 	if(substr("fulltext", type, len)) return SLNFulltextFilterType;
+	if(substr("phrase", type, len)) return SLNPhraseFilterType;
 	if(substr("metadata", type, len)) return SLNMetadataFilterType;
 //	if(substr("linked-from", type, len)) return SLNLinkedFromFilterType;
 	return SLNFilterTypeInvalid;
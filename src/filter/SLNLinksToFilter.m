@@ -95,7 +95,8 @@ cleanup:
 }
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(links-to \"%s\")\n", URI);
+	fprintf(stderr, "(links-to \"%s\")", URI);
+	print_estimate(estimate);
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	return wr(data, size, URI);
@@ -127,6 +128,7 @@ cleanup:
 	for(size_t i = 0; alts[i]; i++) FREE(&alts[i]);
 	FREE(&alts);
 	if(rc >= 0) rc = [filter prepare:txn];
+	if(rc >= 0) estimate = [filter estimate];
 	return rc;
 }
 
@@ -17,7 +17,8 @@
 }
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(meta)\n");
+	fprintf(stderr, "(meta)");
+	print_estimate(estimate);
 }
 - (size_t)getUserFilter:(str_t *const)data :(size_t const)size :(size_t const)depth {
 	assert(0);
@@ -26,9 +26,28 @@
 	subfilter = filter;
 	return 0;
 }
+- (SLNFilter *)plan {
+	subfilter = [subfilter plan];
+	SLNFilterType const type = [subfilter type];
+	if(SLNIntersectionFilterType != type && SLNUnionFilterType != type) return self;
+	// Push the negation down into the collection.
+	SLNCollectionFilter *const collection = (SLNCollectionFilter *)subfilter;
+	subfilter = nil;
+	[self free];
+	return [collection negate];
+}
+- (uint64_t)fingerprint:(uint64_t const)hash {
+	return [subfilter fingerprint:[super fingerprint:hash]];
+}
+- (size_t)serialize:(byte_t *const)data :(size_t const)size {
+	size_t const len = [super serialize:data :size];
+	bool const room = len < size;
+	return len + [subfilter serialize:room ? data+len : NULL :room ? size-len : 0];
+}
 - (void)print:(size_t const)depth {
 	indent(depth);
-	fprintf(stderr, "(negation\n");
+	fprintf(stderr, "(negation");
+	print_estimate(estimate);
 	[subfilter print:depth+1];
 	indent(depth);
 	fprintf(stderr, ")\n");
@@ -59,14 +59,19 @@ static SLNFilterRef createfilter(SLNFilterType const type) {
 
 static SLNFilterRef parse_term(strarg_t *const query) {
 	strarg_t q = *query;
-	read_term(&q, NULL);
+	size_t tlen;
+	strarg_t const term = read_term(&q, &tlen);
 	size_t const len = q - *query;
 	if(0 == len) return NULL;
 	// TODO: HACK
 	if(sizeof("or")-1 == len && 0 == strncasecmp("or", *query, len)) return NULL;
 	if(sizeof("and")-1 == len && 0 == strncasecmp("and", *query, len)) return NULL;
-	SLNFilterRef filter = createfilter(SLNFulltextFilterType);
-	int rc = SLNFilterAddStringArg(filter, *query, len);
+	// Quoted terms are phrases.
+	bool const quoted = '"' == **query || '\'' == **query;
+	SLNFilterRef filter = createfilter(quoted ? SLNPhraseFilterType : SLNFulltextFilterType);
+	int rc = quoted ?
+		SLNFilterAddStringArg(filter, term, tlen) :
+		SLNFilterAddStringArg(filter, *query, len);
 	if(rc < 0) {
 		SLNFilterFree(&filter);
 		return NULL;
@@ -192,7 +197,7 @@ int SLNUserFilterParse(SLNSessionRef const session, strarg_t const query, SLNFil
 		SLNFilterFree(&filter);
 		return DB_EINVAL;
 	}
-	*out = filter;
+	*out = SLNFilterPlan(filter);
 	return 0;
 }
 
@@ -124,6 +124,10 @@ int HTTPConnectionPeek(HTTPConnectionRef const conn, HTTPEvent *const type, uv_b
 
 	while(HTTPNothing == conn->type) {
 		uv_buf_t raw[1];
+		if(!SocketPending(conn->socket)) {
+			rc = HTTPConnectionFlush(conn);
+			if(rc < 0) return rc;
+		}
 		rc = SocketPeek(conn->socket, raw);
 		if(UV_EAGAIN == rc) continue;
 		if(UV_EOF == rc && (HTTPMessageIncomplete & conn->flags)) {
@@ -141,7 +145,12 @@ int HTTPConnectionPeek(HTTPConnectionRef const conn, HTTPEvent *const type, uv_b
 
 		SocketPop(conn->socket, len);
 
-		if(HPE_INVALID_EOF_STATE == rc) return UV_ECONNABORTED;
+		// Responses held by HTTPConnectionEnd still belong to the
+		// client, even though the rest of its input is bad.
+		if(HPE_INVALID_EOF_STATE == rc) {
+			(void)HTTPConnectionFlush(conn);
+			return UV_ECONNABORTED;
+		}
 		if(HPE_OK != rc && HPE_PAUSED != rc) {
 			// TODO: We should convert HPE_* and return them
 			// instead of logging and returning UV_UNKNOWN.
@@ -149,6 +158,7 @@ int HTTPConnectionPeek(HTTPConnectionRef const conn, HTTPEvent *const type, uv_b
 				http_errno_name(rc),
 				HTTP_PARSER_ERRNO_LINE(conn->parser));
 //			fprintf(stderr, "%s (%lu)\n", strndup(raw->base, raw->len), raw->len);
+			(void)HTTPConnectionFlush(conn);
 			return UV_UNKNOWN;
 		}
 	}
@@ -488,6 +498,10 @@ int HTTPConnectionWriteFile(HTTPConnectionRef const conn, uv_file const file) {
 	FREE(&buf);
 	return rc;
 }
+int HTTPConnectionWriteFileRange(HTTPConnectionRef const conn, uv_file const file, uint64_t const offset, uint64_t const length) {
+	if(!conn) return 0;
+	return SocketWriteFile(conn->socket, file, offset, length);
+}
 int HTTPConnectionWriteChunkLength(HTTPConnectionRef const conn, uint64_t const length) {
 	if(!conn) return 0;
 	str_t str[16];
@@ -571,6 +585,11 @@ int HTTPConnectionWriteChunkEnd(HTTPConnectionRef const conn) {
 }
 int HTTPConnectionEnd(HTTPConnectionRef const conn) {
 	if(!conn) return 0;
+	// If the client has already pipelined another request, hold onto the
+	// response so several can go out together. HTTPConnectionPeek flushes
+	// before it has to wait for more input. Anything else that might wait
+	// (locks, long-polling...) has to call HTTPConnectionFlush first.
+	if(SocketPending(conn->socket)) return 0;
 	int rc = HTTPConnectionFlush(conn);
 	if(rc < 0) return rc;
 	// We assume keep-alive is enabled.
@@ -640,7 +659,7 @@ int HTTPConnectionSendFile(HTTPConnectionRef const conn, strarg_t const path, st
 	rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Cache-Control", "max-age=604800; public"); // TODO: Just cache all static files for one week, for now.
 	if(type) rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Content-Type", type);
 	rc = rc < 0 ? rc : HTTPConnectionBeginBody(conn);
-	rc = rc < 0 ? rc : HTTPConnectionWriteFile(conn, file);
+	rc = rc < 0 ? rc : HTTPConnectionWriteFileRange(conn, file, 0, size);
 	rc = rc < 0 ? rc : HTTPConnectionEnd(conn);
 
 cleanup:
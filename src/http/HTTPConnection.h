@@ -50,6 +50,7 @@ int HTTPConnectionWriteContentLength(HTTPConnectionRef const conn, uint64_t cons
 int HTTPConnectionWriteSetCookie(HTTPConnectionRef const conn, strarg_t const cookie, strarg_t const path, uint64_t const maxage);
 int HTTPConnectionBeginBody(HTTPConnectionRef const conn);
 int HTTPConnectionWriteFile(HTTPConnectionRef const conn, uv_file const file);
+int HTTPConnectionWriteFileRange(HTTPConnectionRef const conn, uv_file const file, uint64_t const offset, uint64_t const length);
 int HTTPConnectionWriteChunkLength(HTTPConnectionRef const conn, uint64_t const length);
 int HTTPConnectionWriteChunkv(HTTPConnectionRef const conn, uv_buf_t parts[], unsigned int const count);
 int HTTPConnectionWriteChunkFile(HTTPConnectionRef const conn, strarg_t const path);
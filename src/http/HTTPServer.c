@@ -101,6 +101,8 @@ static void connection(uv_stream_t *const socket) {
 		if(rc < 0) break;
 	}
 
+	// Send any responses that were held back for pipelining.
+	(void)HTTPConnectionFlush(conn);
 	HTTPConnectionFree(&conn);
 }
 static void connection_cb(uv_stream_t *const socket, int const status) {
@@ -3,11 +3,19 @@
 
 #include "Socket.h"
 
-#define READ_BUFFER (1024 * 8)
-#define WRITE_BUFFER (1024 * 2)
+// Buffers come from the async buffer pool and are only held while
+// a request is being read or written, so idle connections hold none.
+#define READ_BUFFER ASYNC_BUFFER_SIZE
+#define WRITE_BUFFER ASYNC_BUFFER_SIZE
+#define FILE_BUFFER ASYNC_BUFFER_SIZE
+#define SENDFILE_MAX (1024 * 1024 * 64)
+#define SENDFILE_TIMEOUT (1000 * 60)
 
 static int sock_read(SocketRef const socket, size_t const size, uv_buf_t *const out);
 static int sock_write(SocketRef const socket, uv_buf_t const *const buf);
+static int sock_sendfile(SocketRef const socket, uv_file const file, uint64_t offset, uint64_t length);
+static int sock_copyfile(SocketRef const socket, uv_file const file, uint64_t offset, uint64_t length);
+static int sock_wait_writable(uv_os_fd_t const fd);
 static int tls_poll(uv_stream_t *const stream, int const event);
 
 struct Socket {
@@ -55,9 +63,10 @@ void SocketFree(SocketRef *const socketptr) {
 	if(socket->secure) tls_close(socket->secure);
 	tls_free(socket->secure); socket->secure = NULL;
 	async_close((uv_handle_t *)socket->stream);
-	FREE(&socket->rdmem);
+	async_buffer_free(socket->rdmem); socket->rdmem = NULL;
 	socket->rd->base = NULL; socket->rd->len = 0;
-	FREE(&socket->wr->base); socket->wr->len = 0;
+	async_buffer_free(socket->wr->base); socket->wr->base = NULL;
+	socket->wr->len = 0;
 	socket->err = 0;
 	assert_zeroed(socket, 1);
 	FREE(socketptr); socket = NULL;
@@ -74,7 +83,7 @@ int SocketStatus(SocketRef const socket) {
 int SocketPeek(SocketRef const socket, uv_buf_t *const out) {
 	if(!socket) return UV_EINVAL;
 	if(0 == socket->rd->len) {
-		FREE(&socket->rdmem);
+		async_buffer_free(socket->rdmem); socket->rdmem = NULL;
 		int rc = sock_read(socket, READ_BUFFER, socket->rd);
 		if(UV_EAGAIN == rc) return rc;
 		if(rc < 0) {
@@ -96,6 +105,10 @@ void SocketPop(SocketRef const socket, size_t const len) {
 	socket->rd->base = NULL;
 	socket->rd->len = 0;
 }
+size_t SocketPending(SocketRef const socket) {
+	if(!socket) return 0;
+	return socket->rd->len;
+}
 
 int SocketWrite(SocketRef const socket, uv_buf_t const *const buf) {
 	if(!socket) return UV_EINVAL;
@@ -109,7 +122,7 @@ int SocketWrite(SocketRef const socket, uv_buf_t const *const buf) {
 		return 0;
 	}
 	if(!socket->wr->base) {
-		socket->wr->base = malloc(WRITE_BUFFER);
+		socket->wr->base = async_buffer_alloc(WRITE_BUFFER);
 		if(!socket->wr->base) return UV_ENOMEM;
 	}
 	size_t const used = MIN(WRITE_BUFFER - socket->wr->len, buf->len);
@@ -125,12 +138,45 @@ int SocketWrite(SocketRef const socket, uv_buf_t const *const buf) {
 	}
 	return 0;
 }
+int SocketWriteFile(SocketRef const socket, uv_file const file, uint64_t const offset, uint64_t const length) {
+	if(!socket) return UV_EINVAL;
+	if(0 == length) return 0;
+	int rc;
+	// Small files are copied into the write buffer, so that they can go
+	// out together with the headers (and any other pipelined responses).
+	if(length < WRITE_BUFFER - socket->wr->len) {
+		if(!socket->wr->base) {
+			socket->wr->base = async_buffer_alloc(WRITE_BUFFER);
+			if(!socket->wr->base) return UV_ENOMEM;
+		}
+		size_t pos = 0;
+		while(pos < length) {
+			uv_buf_t chunk = uv_buf_init(socket->wr->base + socket->wr->len + pos, length - pos);
+			ssize_t const len = async_fs_read(file, &chunk, 1, offset + pos);
+			if(len < 0) return len;
+			if(0 == len) return UV_EOF; // File was truncated.
+			pos += len;
+		}
+		socket->wr->len += length;
+		return 0;
+	}
+	rc = SocketFlush(socket, false);
+	if(rc < 0) return rc;
+	if(socket->secure) rc = sock_copyfile(socket, file, offset, length);
+	else rc = sock_sendfile(socket, file, offset, length);
+	// The body is already partly sent, so the connection can't be reused.
+	if(rc < 0) socket->err = rc;
+	return rc;
+}
 int SocketFlush(SocketRef const socket, bool const more) {
 	if(!socket) return UV_EINVAL;
 	if(0 == socket->wr->len) return 0;
 	assert(socket->wr->base);
 	int rc = sock_write(socket, socket->wr);
-	if(!more) FREE(&socket->wr->base);
+	if(!more) {
+		async_buffer_free(socket->wr->base);
+		socket->wr->base = NULL;
+	}
 	socket->wr->len = 0;
 	return rc;
 }
@@ -139,22 +185,30 @@ int SocketFlush(SocketRef const socket, bool const more) {
 static int sock_read(SocketRef const socket, size_t const size, uv_buf_t *const out) {
 	if(!socket->secure) return async_read((uv_stream_t *)socket->stream, size, out);
 
-	out->base = malloc(size);
-	if(!out->base) return UV_ENOMEM;
+	out->base = NULL;
 	size_t total = 0;
 	for(;;) {
+		if(!out->base) out->base = async_buffer_alloc(size);
+		if(!out->base) return UV_ENOMEM;
 		size_t partial = 0;
 		int event = tls_read(socket->secure, out->base+total, size-total, &partial);
 		total += partial;
 		if(0 == event) break;
+		// Don't hold the buffer while waiting on an idle connection.
+		if(0 == total) {
+			async_buffer_free(out->base);
+			out->base = NULL;
+		}
 		int rc = tls_poll((uv_stream_t *)socket->stream, event);
 		if(rc < 0) {
-			FREE(&out->base);
+			async_buffer_free(out->base);
+			out->base = NULL;
 			return rc;
 		}
 	}
 	if(0 == total) {
-		FREE(&out->base);
+		async_buffer_free(out->base);
+		out->base = NULL;
 		return UV_EOF;
 	}
 	out->len = total;
@@ -176,6 +230,90 @@ static int sock_write(SocketRef const socket, uv_buf_t const *const buf) {
 	return 0;
 }
 
+static int sock_sendfile(SocketRef const socket, uv_file const file, uint64_t offset, uint64_t length) {
+	uv_os_fd_t fd;
+	int rc = uv_fileno((uv_handle_t *)socket->stream, &fd);
+	if(rc < 0) return rc;
+	// Each sendfile(2) runs on the pool (the file might not be cached),
+	// but the socket is non-blocking, so waiting happens on the loop.
+	while(length > 0) {
+		ssize_t const len = async_fs_sendfile(fd, file, offset, MIN(length, SENDFILE_MAX));
+		if(UV_EAGAIN == len) {
+			rc = sock_wait_writable(fd);
+			if(rc < 0) break;
+			continue;
+		}
+		rc = len;
+		if(0 == len) rc = UV_EOF; // File was truncated.
+		if(rc < 0) break;
+		offset += len;
+		length -= len;
+		rc = 0;
+	}
+	return rc;
+}
+
+typedef struct {
+	async_t *thread;
+	int status;
+} wait_state;
+static void wait_poll_cb(uv_poll_t *const handle, int const status, int const events) {
+	wait_state *const state = handle->data;
+	state->status = status;
+	async_switch(state->thread);
+}
+static void wait_timer_cb(uv_timer_t *const timer) {
+	wait_state *const state = timer->data;
+	state->status = UV_ETIMEDOUT;
+	async_switch(state->thread);
+}
+// The stream has nothing queued while we're sending a file, so it's
+// safe to watch its descriptor with a separate poll handle.
+static int sock_wait_writable(uv_os_fd_t const fd) {
+	wait_state state[1] = {{ async_active(), 0 }};
+	uv_poll_t poll[1];
+	uv_timer_t timer[1];
+	int rc = uv_poll_init_socket(async_loop, poll, fd);
+	if(rc < 0) return rc;
+	rc = uv_timer_init(async_loop, timer);
+	if(rc < 0) {
+		async_close((uv_handle_t *)poll);
+		return rc;
+	}
+	poll->data = state;
+	timer->data = state;
+	rc = uv_poll_start(poll, UV_WRITABLE, wait_poll_cb);
+	if(rc >= 0) rc = uv_timer_start(timer, wait_timer_cb, SENDFILE_TIMEOUT, 0);
+	if(rc >= 0) {
+		async_yield();
+		rc = state->status;
+	}
+	uv_poll_stop(poll);
+	uv_timer_stop(timer);
+	async_close((uv_handle_t *)poll);
+	async_close((uv_handle_t *)timer);
+	return rc;
+}
+static int sock_copyfile(SocketRef const socket, uv_file const file, uint64_t offset, uint64_t length) {
+	char *buf = async_buffer_alloc(FILE_BUFFER);
+	if(!buf) return UV_ENOMEM;
+	int rc = 0;
+	while(length > 0) {
+		uv_buf_t chunk = uv_buf_init(buf, MIN(length, FILE_BUFFER));
+		ssize_t const len = async_fs_read(file, &chunk, 1, offset);
+		rc = len;
+		if(0 == len) rc = UV_EOF; // File was truncated.
+		if(rc < 0) break;
+		chunk.len = len;
+		rc = sock_write(socket, &chunk);
+		if(rc < 0) break;
+		offset += len;
+		length -= len;
+	}
+	async_buffer_free(buf); buf = NULL;
+	return rc;
+}
+
 static int tls_poll(uv_stream_t *const stream, int const event) {
 	int rc;
 	if(TLS_READ_AGAIN == event) {
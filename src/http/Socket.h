@@ -15,7 +15,12 @@ int SocketStatus(SocketRef const socket);
 
 int SocketPeek(SocketRef const socket, uv_buf_t *const out);
 void SocketPop(SocketRef const socket, size_t const len);
+// Bytes already received that SocketPeek can return without blocking.
+size_t SocketPending(SocketRef const socket);
 
 int SocketWrite(SocketRef const socket, uv_buf_t const *const buf);
+// Writes length bytes of the file starting at offset. Plain sockets use
+// sendfile(2), secure ones copy through a small buffer.
+int SocketWriteFile(SocketRef const socket, uv_file const file, uint64_t const offset, uint64_t const length);
 int SocketFlush(SocketRef const socket, bool const more);
 
@@ -0,0 +1,154 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include "sha_ni.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+bool sha_ni_available(void) {
+	unsigned a, b, c, d;
+	if(!__get_cpuid(1, &a, &b, &c, &d)) return false;
+	if(!(c & (1 << 9))) return false; // SSSE3
+	if(!(c & (1 << 19))) return false; // SSE4.1
+	if(__get_cpuid_max(0, NULL) < 7) return false;
+	__cpuid_count(7, 0, a, b, c, d);
+	if(!(b & (1 << 29))) return false; // SHA
+	return true;
+}
+
+TARGET static __m128i sha1_rnds4(__m128i const abcd, __m128i const e, int const f) {
+	// The round function has to be an immediate.
+	switch(f) {
+	case 0: return _mm_sha1rnds4_epu32(abcd, e, 0);
+	case 1: return _mm_sha1rnds4_epu32(abcd, e, 1);
+	case 2: return _mm_sha1rnds4_epu32(abcd, e, 2);
+	default: return _mm_sha1rnds4_epu32(abcd, e, 3);
+	}
+}
+// Four rounds using the message words in `a`. After the first four
+// groups, `a` is first advanced 16 words by the message schedule.
+#define SHA1_ROUNDS(g, a, b, c, d) do { \
+	if((g) >= 4) { \
+		__m128i x = _mm_sha1msg1_epu32((a), (b)); \
+		x = _mm_xor_si128(x, (c)); \
+		(a) = _mm_sha1msg2_epu32(x, (d)); \
+	} \
+	__m128i const e = 0 == (g) ? \
+		_mm_add_epi32(e0, (a)) : \
+		_mm_sha1nexte_epu32(prev, (a)); \
+	prev = abcd; \
+	abcd = sha1_rnds4(abcd, e, (g) / 5); \
+} while(0)
+TARGET void sha1_ni_compress(uint32_t state[5], unsigned char const *data, size_t blocks) {
+	__m128i const mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const *)state), 0x1B);
+	__m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+	for(; blocks > 0; blocks--, data += 64) {
+		__m128i const abcd_save = abcd;
+		__m128i const e0_save = e0;
+		__m128i prev = abcd;
+		// Keep the schedule in named variables so it stays in registers.
+		__m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 0)), mask);
+		__m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 16)), mask);
+		__m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 32)), mask);
+		__m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 48)), mask);
+		for(int g = 0; g < 20; g += 4) {
+			SHA1_ROUNDS(g+0, w0, w1, w2, w3);
+			SHA1_ROUNDS(g+1, w1, w2, w3, w0);
+			SHA1_ROUNDS(g+2, w2, w3, w0, w1);
+			SHA1_ROUNDS(g+3, w3, w0, w1, w2);
+		}
+		e0 = _mm_sha1nexte_epu32(prev, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+	abcd = _mm_shuffle_epi32(abcd, 0x1B);
+	_mm_storeu_si128((__m128i *)state, abcd);
+	state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+static uint32_t const K256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+// Four rounds using the message words in `a`.
+#define SHA256_ROUNDS(a, k) do { \
+	__m128i msg = _mm_add_epi32((a), _mm_loadu_si128((__m128i const *)(k))); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+	msg = _mm_shuffle_epi32(msg, 0x0E); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg); \
+} while(0)
+#define SHA256_SCHEDULE(a, b, c, d) do { \
+	__m128i x = _mm_sha256msg1_epu32((a), (b)); \
+	x = _mm_add_epi32(x, _mm_alignr_epi8((d), (c), 4)); \
+	(a) = _mm_sha256msg2_epu32(x, (d)); \
+} while(0)
+TARGET void sha256_ni_compress(uint32_t state[8], unsigned char const *data, size_t blocks) {
+	__m128i const mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_loadu_si128((__m128i const *)&state[0]);
+	__m128i state1 = _mm_loadu_si128((__m128i const *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1); // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B); // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+	for(; blocks > 0; blocks--, data += 64) {
+		__m128i const abef_save = state0;
+		__m128i const cdgh_save = state1;
+		// Keep the schedule in named variables so it stays in registers.
+		__m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 0)), mask);
+		__m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 16)), mask);
+		__m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 32)), mask);
+		__m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 48)), mask);
+		for(size_t i = 0; i < 64; i += 16) {
+			if(i) SHA256_SCHEDULE(w0, w1, w2, w3);
+			SHA256_ROUNDS(w0, &K256[i+0]);
+			if(i) SHA256_SCHEDULE(w1, w2, w3, w0);
+			SHA256_ROUNDS(w1, &K256[i+4]);
+			if(i) SHA256_SCHEDULE(w2, w3, w0, w1);
+			SHA256_ROUNDS(w2, &K256[i+8]);
+			if(i) SHA256_SCHEDULE(w3, w0, w1, w2);
+			SHA256_ROUNDS(w3, &K256[i+12]);
+		}
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+	}
+	tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8); // ABEF
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#else
+
+bool sha_ni_available(void) {
+	return false;
+}
+void sha1_ni_compress(uint32_t state[5], unsigned char const *data, size_t blocks) {
+	assert(!"SHA extensions not supported");
+}
+void sha256_ni_compress(uint32_t state[8], unsigned char const *data, size_t blocks) {
+	assert(!"SHA extensions not supported");
+}
+
+#endif
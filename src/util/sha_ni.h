@@ -0,0 +1,18 @@
+// Copyright 2014-2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#ifndef SHA_NI_H
+#define SHA_NI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hardware SHA-1 and SHA-256 block functions using the x86 SHA extensions.
+// Only call the compress functions if sha_ni_available() returns true.
+// `data` must contain `blocks` full 64-byte blocks.
+bool sha_ni_available(void);
+void sha1_ni_compress(uint32_t state[5], unsigned char const *data, size_t blocks);
+void sha256_ni_compress(uint32_t state[8], unsigned char const *data, size_t blocks);
+
+#endif